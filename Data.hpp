@@ -1,32 +1,419 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <clang/Basic/SourceLocation.h>
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/iterator.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
 
 // FIXME
 using namespace clang;
 
+// The finalizer of MurmurHash3, it mixes all the bits of the id into the low
+// bits, which select the slots of the hash tables below.
+inline std::uint64_t mixId(std::uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Hash of a string (FNV-1a) which is the same in every process, unlike
+// llvm::hash_value. The ids are such hashes (e.g. of the USRs of the
+// befriending classes or of the names of the instances, see FriendHandler),
+// so they do not depend on the translation unit or on the run.
+inline std::uint64_t stableHash(llvm::StringRef s) {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return mixId(h);
+}
+
+// The id of a pair of ids, e.g. of a befriending class and a friend.
+inline std::uint64_t combineIds(std::uint64_t a, std::uint64_t b) {
+  return mixId(a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2)));
+}
+
+// Open addressing (linear probing) hash map from 64-bit ids to values. The
+// values are allocated from an arena, they are never moved, so the references
+// to them stay valid, and the iteration follows the order of insertion.
+template <typename T> class FlatIdMap {
+  struct Slot {
+    std::uint64_t id = 0;
+    // One more than the index of the value, zero marks the empty slots.
+    std::size_t index = 0;
+  };
+  std::vector<Slot> slots;
+  // The values in the order of insertion.
+  std::vector<T *> values;
+  llvm::SpecificBumpPtrAllocator<T> arena;
+
+  // Returns the slot of the id or the empty slot where it should be put.
+  std::size_t slotOf(std::uint64_t id) const {
+    const std::size_t mask = slots.size() - 1;
+    std::size_t i = static_cast<std::size_t>(mixId(id)) & mask;
+    while (slots[i].index != 0 && slots[i].id != id) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    for (const Slot &slot : old) {
+      if (slot.index) {
+        slots[slotOf(slot.id)] = slot;
+      }
+    }
+  }
+
+public:
+  using iterator =
+      llvm::pointee_iterator<typename std::vector<T *>::const_iterator, T>;
+  using const_iterator =
+      llvm::pointee_iterator<typename std::vector<T *>::const_iterator,
+                             const T>;
+
+  FlatIdMap() : slots(16) {}
+  FlatIdMap(FlatIdMap &&) = default;
+  FlatIdMap &operator=(FlatIdMap &&other) {
+    if (this != &other) {
+      // The moved arena would free the values without destroying them.
+      arena.DestroyAll();
+      slots = std::move(other.slots);
+      values = std::move(other.values);
+      arena = std::move(other.arena);
+    }
+    return *this;
+  }
+
+  // Null if the id is not in the map.
+  T *find(std::uint64_t id) {
+    const Slot &slot = slots[slotOf(id)];
+    return slot.index ? values[slot.index - 1] : nullptr;
+  }
+  const T *find(std::uint64_t id) const {
+    const Slot &slot = slots[slotOf(id)];
+    return slot.index ? values[slot.index - 1] : nullptr;
+  }
+  bool count(std::uint64_t id) const { return find(id) != nullptr; }
+
+  // Inserts the value unless the id is in the map already. Returns the
+  // value of the id and whether it was inserted.
+  std::pair<T *, bool> insert(std::uint64_t id, T value) {
+    // Keep the load factor at most 1/2.
+    if ((values.size() + 1) * 2 > slots.size()) {
+      grow();
+    }
+    Slot &slot = slots[slotOf(id)];
+    if (slot.index) {
+      return {values[slot.index - 1], false};
+    }
+    values.push_back(new (arena.Allocate()) T(std::move(value)));
+    slot.id = id;
+    slot.index = values.size();
+    return {values.back(), true};
+  }
+
+  std::size_t size() const { return values.size(); }
+  bool empty() const { return values.empty(); }
+  iterator begin() { return iterator(values.begin()); }
+  iterator end() { return iterator(values.end()); }
+  const_iterator begin() const { return const_iterator(values.begin()); }
+  const_iterator end() const { return const_iterator(values.end()); }
+};
+
+// Pool of immutable values which are stored only once. The values are
+// identified by dense 32-bit ids, id zero is the value-initialized T. The
+// values live in chunks which are never moved or freed, so the value of an id
+// is read without locking, only the interning of a value locks the pool.
+template <typename T, typename Hash = std::hash<T>> class InternPool {
+  // Chunk k holds the ids from FirstChunkSize * (2^k - 1), it is twice as
+  // large as chunk k - 1. The chunks cover every 32-bit id.
+  static constexpr unsigned FirstChunkSize = 64;
+  static constexpr unsigned NumChunks = 27;
+  std::atomic<T *> chunks[NumChunks];
+  unsigned numValues = 1;
+
+  struct DerefHash {
+    std::size_t operator()(const T *v) const { return Hash{}(*v); }
+  };
+  struct DerefEqual {
+    bool operator()(const T *a, const T *b) const { return *a == *b; }
+  };
+  std::mutex mutex;
+  // The ids of the values, the keys point into the chunks.
+  std::unordered_map<const T *, unsigned, DerefHash, DerefEqual> ids;
+
+  static unsigned chunkOf(unsigned id) {
+    return llvm::Log2_32(id / FirstChunkSize + 1);
+  }
+  static std::size_t firstIdOf(unsigned chunk) {
+    return FirstChunkSize * ((std::size_t{1} << chunk) - 1);
+  }
+
+public:
+  InternPool() {
+    for (auto &chunk : chunks) {
+      chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    T *first = new T[FirstChunkSize]();
+    chunks[0].store(first, std::memory_order_release);
+    ids.emplace(first, 0);
+  }
+  ~InternPool() {
+    for (auto &chunk : chunks) {
+      delete[] chunk.load(std::memory_order_relaxed);
+    }
+  }
+  InternPool(const InternPool &) = delete;
+  InternPool &operator=(const InternPool &) = delete;
+
+  const T &operator[](unsigned id) const {
+    const unsigned chunk = chunkOf(id);
+    return chunks[chunk].load(std::memory_order_acquire)[id - firstIdOf(chunk)];
+  }
+
+  unsigned intern(T value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = ids.find(&value);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    assert(numValues != 0 && "The ids of the pool are exhausted");
+    const unsigned id = numValues++;
+    const unsigned chunk = chunkOf(id);
+    T *values = chunks[chunk].load(std::memory_order_relaxed);
+    if (!values) {
+      values = new T[FirstChunkSize << chunk]();
+      chunks[chunk].store(values, std::memory_order_release);
+    }
+    T &stored = values[id - firstIdOf(chunk)];
+    stored = std::move(value);
+    ids.emplace(&stored, id);
+    return id;
+  }
+};
+
+// Immutable string which is stored only once, in a global pool. An interned
+// string is the 32-bit id of the pooled string, e.g. the name of a
+// befriending class is shared by all of its instances. Interned strings are
+// equal if and only if their ids are equal. The empty string is id zero, it
+// is created and copied without touching the pool.
+class InternedString {
+  unsigned id = 0;
+
+  static InternPool<std::string> &pool() {
+    // Never destroyed, the strings may be read by static destructors.
+    static auto *strings = new InternPool<std::string>;
+    return *strings;
+  }
+
+public:
+  InternedString() = default;
+  InternedString(std::string s)
+      : id(s.empty() ? 0 : pool().intern(std::move(s))) {}
+  InternedString(const char *s) : InternedString(std::string{s}) {}
+
+  const std::string &get() const { return pool()[id]; }
+  operator const std::string &() const { return get(); }
+  bool empty() const { return id == 0; }
+  unsigned getId() const { return id; }
+
+  friend bool operator==(const InternedString &a, const InternedString &b) {
+    return a.id == b.id;
+  }
+  friend bool operator!=(const InternedString &a, const InternedString &b) {
+    return a.id != b.id;
+  }
+  friend bool operator<(const InternedString &a, const InternedString &b) {
+    return a.id != b.id && a.get() < b.get();
+  }
+};
+
+// A source location which outlives its translation unit, unlike the
+// SourceLocation: the file, the line and the column, and the spelling
+// location if the location is in a macro expansion. The records are pooled
+// like the interned strings, a Location is the 32-bit id of its record and
+// zero is the empty location. The locations are rendered ("file:line:col")
+// only when they are printed, see DataIO.hpp.
+class Location {
+public:
+  struct Record {
+    InternedString file;
+    // Zero if the file holds the whole location verbatim, e.g. a stored
+    // location which could not be parsed.
+    unsigned line = 0;
+    unsigned column = 0;
+    // The id of the spelling location.
+    unsigned spelling = 0;
+
+    friend bool operator==(const Record &a, const Record &b) {
+      return a.file == b.file && a.line == b.line && a.column == b.column &&
+             a.spelling == b.spelling;
+    }
+  };
+  struct RecordHash {
+    std::size_t operator()(const Record &r) const {
+      return llvm::hash_combine(r.file.getId(), r.line, r.column, r.spelling);
+    }
+  };
+
+private:
+  unsigned id = 0;
+
+  static InternPool<Record, RecordHash> &pool() {
+    // Never destroyed, like the pool of the interned strings.
+    static auto *records = new InternPool<Record, RecordHash>;
+    return *records;
+  }
+  const Record &record() const { return pool()[id]; }
+  static Location ofId(unsigned id) {
+    Location loc;
+    loc.id = id;
+    return loc;
+  }
+
+public:
+  Location() = default;
+  Location(InternedString file, unsigned line, unsigned column)
+      : Location(file, line, column, Location()) {}
+  Location(InternedString file, unsigned line, unsigned column,
+           Location spelling) {
+    Record r;
+    r.file = file;
+    r.line = line;
+    r.column = column;
+    r.spelling = spelling.id;
+    id = pool().intern(r);
+  }
+
+  // A location which is kept as it is, it has no line and column.
+  static Location verbatim(InternedString text) {
+    return Location{text, 0, 0};
+  }
+
+  bool empty() const { return id == 0; }
+  bool isVerbatim() const { return !empty() && record().line == 0; }
+  const InternedString &file() const { return record().file; }
+  unsigned line() const { return record().line; }
+  unsigned column() const { return record().column; }
+  // Empty unless the location is in a macro expansion.
+  Location spelling() const { return ofId(record().spelling); }
+
+  // The same in every run, unlike the ids of the locations.
+  std::uint64_t hash() const {
+    if (empty()) {
+      return 0;
+    }
+    const Record &r = record();
+    return combineIds(
+        combineIds(stableHash(r.file.get()),
+                   (static_cast<std::uint64_t>(r.line) << 32) | r.column),
+        spelling().hash());
+  }
+
+  friend bool operator==(const Location &a, const Location &b) {
+    return a.id == b.id;
+  }
+  friend bool operator!=(const Location &a, const Location &b) {
+    return a.id != b.id;
+  }
+  // By the file, then by the line and the column.
+  friend bool operator<(const Location &a, const Location &b) {
+    if (a.id == b.id) {
+      return false;
+    }
+    const Record &x = a.record();
+    const Record &y = b.record();
+    if (x.file != y.file) {
+      return x.file < y.file;
+    }
+    if (x.line != y.line || x.column != y.column) {
+      return std::tie(x.line, x.column) < std::tie(y.line, y.column);
+    }
+    return ofId(x.spelling) < ofId(y.spelling);
+  }
+};
+
 struct ClassInfo {
-  SourceLocation loc;
-  std::string locStr;
-  std::string diagName;
-  ClassInfo(SourceLocation loc, std::string&& locStr, std::string&& diagName) :
-    loc(loc), locStr(std::move(locStr)), diagName(std::move(diagName))
-  {}
+  // Dense id given by the ClassRegistry.
+  unsigned id;
+  // The identity of the class, e.g. the hash of its USR.
+  std::uint64_t key;
+  Location loc;
+  InternedString diagName;
+  ClassInfo(unsigned id, std::uint64_t key, Location loc,
+            InternedString diagName)
+      : id(id), key(key), loc(loc), diagName(diagName) {}
 };
 
+// Hands out one ClassInfo for each class, with dense ids starting from zero.
+// The classes are identified by their keys, so a class gets the same
+// ClassInfo in every translation unit. The ClassInfos live as long as the
+// registry.
+class ClassRegistry {
+  FlatIdMap<ClassInfo> byKey;
+  std::vector<const ClassInfo *> byId;
+
+public:
+  // Null if the class is not registered yet.
+  const ClassInfo *find(std::uint64_t key) const { return byKey.find(key); }
+  const ClassInfo *get(std::uint64_t key, Location loc,
+                       InternedString diagName) {
+    auto inserted = byKey.insert(
+        key, ClassInfo(static_cast<unsigned>(byId.size()), key, loc,
+                       diagName));
+    if (inserted.second) {
+      byId.push_back(inserted.first);
+    }
+    return inserted.first;
+  }
+  // The class identified by its location and name, e.g. in a stored result.
+  const ClassInfo *get(Location loc, InternedString diagName) {
+    std::uint64_t key = combineIds(loc.hash(), stableHash(diagName.get()));
+    return get(key, loc, diagName);
+  }
+  const ClassInfo *operator[](unsigned id) const { return byId[id]; }
+  std::size_t size() const { return byId.size(); }
+};
+
+class MemberIndex;
+
 // Holds the number of private or protected variables, methods, types
 // in a class.
 struct ClassCounts {
   int privateVarsCount = 0;
   int privateMethodsCount = 0;
   int privateTypesCount = 0;
-  std::shared_ptr<ClassInfo> info;
+  const ClassInfo *info = nullptr;
+  // Bit positions of the members, see MemberIndex in FriendStats.hpp.
+  std::shared_ptr<MemberIndex> members;
 };
 
 struct Result {
 
+  // The befriending classes of the instances.
+  ClassRegistry classes;
+
   // Number of friend decls which refer to a class or class template
   int friendClassDeclCount = 0;
   // Number of friend decls which refer to a function or function template
@@ -34,11 +421,14 @@ struct Result {
 
   struct FuncResult {
 
-    std::string diagName;
-    SourceLocation friendDeclLoc; // The location of the friend declaration
-    std::string friendDeclLocStr;
-    SourceLocation defLoc; // The location of the definition of the friend
-    std::string defLocStr;
+    // The record is compact: the name and the locations are the 32-bit ids
+    // of pooled values, which are shared between the instances (e.g. the
+    // instances of a friend declaration have the same friendDeclLoc).
+    InternedString diagName;
+    // The location of the friend declaration
+    Location friendDeclLoc;
+    // The location of the definition of the friend
+    Location defLoc;
 
     // Below the static variables and static methods are counted in as well.
     // The number of used variables in this (friend) function
@@ -60,7 +450,29 @@ struct Result {
       int parentPrivateCount = 0;
     } types;
 
-    std::shared_ptr<ClassInfo> parentClassInfo;
+    // The befriending class, owned by the ClassRegistry of the result.
+    const ClassInfo *parentClassInfo = nullptr;
+
+    // Set if the instance is one of the sampled specializations of a
+    // template, see SampledTemplate.
+    bool sampled = false;
+
+    // The number of the instances this entry stands for. Greater than one
+    // if the equivalent specializations of a friend declaration are
+    // collapsed into one entry (see FriendHandler::setCollapsing), the
+    // statistics weight the entry by it.
+    int multiplicity = 1;
+
+    // Set if the instance is measured on the pattern of a template (see
+    // FriendHandler::setPatternMode), the members used through dependent
+    // types are matched by their names only.
+    bool approximate = false;
+
+    // The name of the befriending class.
+    const std::string &hostDiagName() const {
+      static const std::string none;
+      return parentClassInfo ? parentClassInfo->diagName.get() : none;
+    }
   };
 
   // Each friend funciton declaration might have it's connected function
@@ -69,21 +481,13 @@ struct Result {
   // templates with body (i.e if they have the definition provided).
   // Each friend function template could have different specializations with
   // their own definition.
-  using FriendDeclId = std::string;
-  using BefriendingClassInstantiationId = std::string;
-  using FunctionTemplateInstantiationId = std::string;
-  using FuncResultKey = std::pair<BefriendingClassInstantiationId,
-                                  FunctionTemplateInstantiationId>;
-  using FuncResultsForFriendDecl =
-      std::map<FuncResultKey, FuncResult>;
-  std::map<FriendDeclId, FuncResultsForFriendDecl> FuncResults;
-
-  struct ClassResult {
-    std::string diagName;
-    std::string defLocStr;
-    std::string friendDeclLocStr;
-    FuncResultsForFriendDecl memberFuncResults;
+  struct FuncDecl {
+    Location friendDeclLoc;
+    // In the order of insertion, see SortedResult in DataIO.hpp for the
+    // order of the output.
+    std::vector<FuncResult *> instances;
   };
+
   // Each friend class template could have different specializations or
   // instantiations. We handle one non-template class exactly the same as it was
   // an instantiation/specialization of a class template. We collect statistics
@@ -91,11 +495,191 @@ struct Result {
   // non-template class). Also we collect stats from member function templates.
   // We do this exactly the same as we do it with direct friend functions and
   // function templates.
-  using ClassTemplateInstantiationId = std::string;
-  using ClassResultKey = std::pair<BefriendingClassInstantiationId,
-                                  ClassTemplateInstantiationId>;
-  using ClassResultsForFriendDecl =
-      std::map<ClassResultKey, ClassResult>;
-  std::map<FriendDeclId, ClassResultsForFriendDecl> ClassResults;
+  struct ClassResult {
+    InternedString diagName;
+    Location defLoc;
+    Location friendDeclLoc;
+    // The name of the befriending class.
+    InternedString hostDiagName;
+    // In the order of insertion.
+    std::vector<FuncResult *> memberFuncResults;
+  };
+  struct ClassDecl {
+    Location friendDeclLoc;
+    // In the order of insertion.
+    std::vector<ClassResult *> classResults;
+  };
+
+  // The friend declarations by their ids.
+  FlatIdMap<FuncDecl> FuncResults;
+  FlatIdMap<ClassDecl> ClassResults;
+
+  // The instances are identified by 64-bit ids, which are derived from the
+  // ids of the friend declaration, of the befriending class and of the
+  // friend (see FriendHandler). The ids of the friend function instances
+  // and of the friend class instances are unique in the result, the ids of
+  // the member function instances are unique in their class instance.
+  // The instances are stored here, in arenas, the friend declarations refer
+  // to them.
+  FlatIdMap<FuncResult> funcInstances;
+  FlatIdMap<ClassResult> classInstances;
+  FlatIdMap<FuncResult> memberFuncInstances;
+
+  Result() = default;
+  // The friend declarations refer to the instances of this result.
+  Result(const Result &) = delete;
+  Result &operator=(const Result &) = delete;
+  Result(Result &&) = default;
+  Result &operator=(Result &&) = default;
+
+  // Registers the friend function declaration, even if it has no
+  // instances.
+  FuncDecl &addFuncDecl(std::uint64_t declId, Location friendDeclLoc) {
+    return *FuncResults.insert(declId, FuncDecl{friendDeclLoc, {}}).first;
+  }
+
+  // Adds the instance to the friend function declaration unless an instance
+  // with the same id is stored already. Returns the stored instance, null
+  // if it is a duplicate.
+  FuncResult *addFuncResult(FuncDecl &decl, std::uint64_t id,
+                            const FuncResult &funcRes) {
+    auto inserted = funcInstances.insert(id, funcRes);
+    if (!inserted.second) {
+      return nullptr;
+    }
+    decl.instances.push_back(inserted.first);
+    return inserted.first;
+  }
+
+  ClassDecl &addClassDecl(std::uint64_t declId, Location friendDeclLoc) {
+    return *ClassResults.insert(declId, ClassDecl{friendDeclLoc, {}}).first;
+  }
+
+  // Returns the class instance of the id, adds it to the friend class
+  // declaration if it is new.
+  ClassResult &addClassResult(ClassDecl &decl, std::uint64_t id,
+                              const ClassResult &classResult) {
+    auto inserted = classInstances.insert(id, classResult);
+    if (inserted.second) {
+      decl.classResults.push_back(inserted.first);
+    }
+    return *inserted.first;
+  }
+
+  // Adds the member function instance to the class instance unless an
+  // instance with the same id is there already.
+  void addMemberFuncResult(ClassResult &classResult, std::uint64_t id,
+                           const FuncResult &funcRes) {
+    auto inserted = memberFuncInstances.insert(id, funcRes);
+    if (inserted.second) {
+      classResult.memberFuncResults.push_back(inserted.first);
+    }
+  }
+
+  // A template which has more specializations than the limit, only a sample
+  // of its specializations is analyzed.
+  struct SampledTemplate {
+    std::string diagName;
+    int numSpecializations = 0;
+    int numAnalyzed = 0;
+  };
+  // The sampled templates by their location.
+  std::map<Location, SampledTemplate> sampledTemplates;
+
+  // The instances are matched by these names in a diff of two results (see
+  // ResultDiff.hpp).
+  using FuncResultKey = std::pair<std::string, std::string>;
+  using ClassResultKey = std::pair<std::string, std::string>;
 };
 
+// True if the instances use the same number of private entities of classes
+// with the same number of private entities.
+inline bool sameCounts(const Result::FuncResult &a,
+                       const Result::FuncResult &b) {
+  return a.usedPrivateVarsCount == b.usedPrivateVarsCount &&
+         a.parentPrivateVarsCount == b.parentPrivateVarsCount &&
+         a.usedPrivateMethodsCount == b.usedPrivateMethodsCount &&
+         a.parentPrivateMethodsCount == b.parentPrivateMethodsCount &&
+         a.types.usedPrivateCount == b.types.usedPrivateCount &&
+         a.types.parentPrivateCount == b.types.parentPrivateCount;
+}
+
+// Receives the friend function instances right after they are measured.
+// Used in streaming mode, when the instances are not stored in the Result,
+// rather they are folded into the statistics immediately.
+struct ResultSink {
+  virtual ~ResultSink() {}
+  virtual void funcInstance(const Result::FuncResult &funcRes) = 0;
+  // Member function instance of a friend class.
+  virtual void classFuncInstance(const Result::FuncResult &funcRes) = 0;
+};
+
+// The instances measured in one translation unit by their ids, including
+// the ones which are dropped as duplicates of the instances of other
+// translation units. See FriendHandler::setRecording and StatisticsState.
+struct Contribution {
+  using Instances = std::vector<std::pair<std::uint64_t, Result::FuncResult>>;
+  Instances funcs;
+  // Member function instances of friend classes.
+  Instances classFuncs;
+  // Member function instances of the friend class declarations whose
+  // results are kept only from the first translation unit which sees them
+  // (see FriendDeclResults::dropIfSeen), by the ids of the declarations.
+  std::vector<std::pair<std::uint64_t, Instances>> firstSeenClassFuncs;
+};
+
+// Open addressing (linear probing) hash set of 64-bit ids, e.g. hashes of
+// the keys of the results. The slots are in one contiguous array, zero marks
+// the empty slots, therefore the id zero is stored in a flag instead.
+class FlatIdSet {
+  std::vector<std::uint64_t> slots;
+  std::size_t numIds = 0;
+  bool hasZero = false;
+
+  // Returns the slot of the id or the empty slot where it should be put.
+  std::size_t slotOf(std::uint64_t id) const {
+    const std::size_t mask = slots.size() - 1;
+    std::size_t i = static_cast<std::size_t>(mixId(id)) & mask;
+    while (slots[i] != 0 && slots[i] != id) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void grow() {
+    std::vector<std::uint64_t> old(slots.size() * 2);
+    old.swap(slots);
+    for (std::uint64_t id : old) {
+      if (id) {
+        slots[slotOf(id)] = id;
+      }
+    }
+  }
+
+public:
+  FlatIdSet() : slots(16) {}
+
+  // Returns true if the id was not in the set.
+  bool insert(std::uint64_t id) {
+    if (id == 0) {
+      const bool inserted = !hasZero;
+      hasZero = true;
+      return inserted;
+    }
+    // Keep the load factor at most 1/2.
+    if ((numIds + 1) * 2 > slots.size()) {
+      grow();
+    }
+    std::size_t i = slotOf(id);
+    if (slots[i]) {
+      return false;
+    }
+    slots[i] = id;
+    ++numIds;
+    return true;
+  }
+  bool contains(std::uint64_t id) const {
+    return id == 0 ? hasZero : slots[slotOf(id)] != 0;
+  }
+  std::size_t size() const { return numIds + hasZero; }
+};
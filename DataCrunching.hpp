@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <map>
-#include <unordered_set>
+#include <vector>
 #include <unordered_map>
 #include "FriendStats.hpp"
 
@@ -24,13 +29,17 @@ inline PrivateUsage privateUsage(const Result::FuncResult &funcRes) {
   return usage;
 }
 
+// The accumulators of the friend instances take the weight of an entry,
+// e.g. the multiplicity of a collapsed entry (see
+// Result::FuncResult::multiplicity). An entry with weight w is the same as w
+// entries with weight one, but it is added in one step.
 struct Average {
   double sum = 0.0;
   int num = 0;
   int numZeroDenom = 0;
-  void operator()(const Result::FuncResult &funcRes) {
+  void operator()(const Result::FuncResult &funcRes, int weight = 1) {
     PrivateUsage usage = privateUsage(funcRes);
-    ++num;
+    num += weight;
     // If denominator is zero that means there are no priv or protected
     // entitties
     // in the class, only publicly availble entities are there.
@@ -38,12 +47,206 @@ struct Average {
     // not be friend at all, therefore we add nothing (zero) to sum in such
     // cases.
     if (usage.denominator) {
-      sum += usage.usage;
+      sum += usage.usage * weight;
+    } else {
+      numZeroDenom += weight;
+    }
+  }
+  // Removes an entry which was added before.
+  void remove(const Result::FuncResult &funcRes, int weight = 1) {
+    PrivateUsage usage = privateUsage(funcRes);
+    num -= weight;
+    if (usage.denominator) {
+      sum -= usage.usage * weight;
     } else {
-      ++numZeroDenom;
+      numZeroDenom -= weight;
     }
   }
   double get() const { return sum / num; }
+  void merge(const Average &other) {
+    sum += other.sum;
+    num += other.num;
+    numZeroDenom += other.numZeroDenom;
+  }
+  void subtract(const Average &other) {
+    sum -= other.sum;
+    num -= other.num;
+    numZeroDenom -= other.numZeroDenom;
+  }
+};
+
+// Mergeable quantile sketch (a KLL style compactor hierarchy with equal
+// capacities and deterministic compactions).
+// Values are collected at level 0. When a level holds k values, they are
+// sorted and every second of them is promoted to the next level, where each
+// value represents twice as many values. Sketches are merged by merging the
+// levels and compacting them if needed.
+//
+// Accuracy: for any value, the estimated rank (the number of added values
+// which are not greater than it) differs from the exact rank by at most
+//   n * (floor(log2(n / k)) + 1) / k,
+// if n >= k, where n is the number of added values. If n < k, the result is
+// exact. Each compaction at level h changes any rank by at most 2^h, and
+// there are at most n / (k * 2^h) compactions at level h, and only the
+// levels h <= log2(n / k) are compacted. This holds for merged sketches too.
+// E.g. with the default k = 2048 and 10 million values the returned quantile
+// is at most 0.65% (in rank) away from the exact one. The memory usage is
+// O(k * log2(n / k)).
+// A value with weight w is added at the levels of the set bits of w, that
+// is the same as adding it w times and compacting the copies without
+// error. The bound holds with n being the sum of the weights.
+class QuantileSketch {
+  std::size_t k;
+  std::uint64_t n = 0;
+  std::vector<std::vector<double>> levels;
+  // The offset of the next compaction at each level, it alternates between
+  // 0 and 1 to balance the errors.
+  std::vector<unsigned char> offsets;
+
+  void compact(std::size_t h) {
+    if (levels.size() == h + 1) {
+      levels.emplace_back();
+      offsets.push_back(0);
+    }
+    auto &buffer = levels[h];
+    auto &next = levels[h + 1];
+    std::sort(std::begin(buffer), std::end(buffer));
+    const std::size_t pairs = buffer.size() / 2;
+    const std::size_t offset = offsets[h];
+    offsets[h] ^= 1;
+    for (std::size_t i = 0; i < pairs; ++i) {
+      next.push_back(buffer[2 * i + offset]);
+    }
+    // In case of odd number of values, the largest remains on this level.
+    if (buffer.size() % 2) {
+      buffer.front() = buffer.back();
+      buffer.resize(1);
+    } else {
+      buffer.clear();
+    }
+    if (next.size() >= k) {
+      compact(h + 1);
+    }
+  }
+
+public:
+  explicit QuantileSketch(std::size_t k = 2048) : k(k), levels(1), offsets(1) {
+    assert(k >= 2);
+  }
+
+  std::uint64_t count() const { return n; }
+
+  void add(double value, std::uint64_t weight = 1) {
+    n += weight;
+    for (std::size_t h = 0; weight; ++h, weight >>= 1) {
+      if (!(weight & 1)) {
+        continue;
+      }
+      while (levels.size() <= h) {
+        levels.emplace_back();
+        offsets.push_back(0);
+      }
+      levels[h].push_back(value);
+      if (levels[h].size() >= k) {
+        compact(h);
+      }
+    }
+  }
+
+  void merge(const QuantileSketch &other) {
+    assert(k == other.k);
+    n += other.n;
+    while (levels.size() < other.levels.size()) {
+      levels.emplace_back();
+      offsets.push_back(0);
+    }
+    for (std::size_t h = 0; h < other.levels.size(); ++h) {
+      levels[h].insert(std::end(levels[h]), std::begin(other.levels[h]),
+                       std::end(other.levels[h]));
+    }
+    for (std::size_t h = 0; h < levels.size(); ++h) {
+      if (levels[h].size() >= k) {
+        compact(h);
+      }
+    }
+  }
+
+  // Returns the value with rank ceil(q * n), q is in [0, 1].
+  // Returns NaN if the sketch is empty.
+  double quantile(double q) const {
+    if (n == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    std::vector<std::pair<double, std::uint64_t>> weighted;
+    for (std::size_t h = 0; h < levels.size(); ++h) {
+      for (double value : levels[h]) {
+        weighted.emplace_back(value, std::uint64_t{1} << h);
+      }
+    }
+    std::sort(std::begin(weighted), std::end(weighted));
+    const double rank = std::max(1.0, std::ceil(q * n));
+    std::uint64_t cumulative = 0;
+    for (const auto &v : weighted) {
+      cumulative += v.second;
+      if (cumulative >= rank) {
+        return v.first;
+      }
+    }
+    return weighted.back().first;
+  }
+};
+
+// Quantiles of the private usage.
+// Like in Average, the usage is zero if there are no private entities in
+// the host class.
+struct UsageQuantiles {
+  QuantileSketch sketch;
+  void operator()(const Result::FuncResult &funcRes, int weight = 1) {
+    sketch.add(privateUsage(funcRes).usage, weight);
+  }
+  std::uint64_t count() const { return sketch.count(); }
+  double get(double q) const { return sketch.quantile(q); }
+  void merge(const UsageQuantiles &other) { sketch.merge(other.sketch); }
+};
+
+// Exact quantiles of the private usage, the counts of the distinct usage
+// values. Unlike the sketch of UsageQuantiles the entries can be removed.
+// The usage is a ratio of small counts, so there are few distinct values.
+struct ExactUsageQuantiles {
+  std::map<double, long> counts;
+  long n = 0;
+  void operator()(const Result::FuncResult &funcRes, int weight = 1) {
+    addValue(privateUsage(funcRes).usage, weight);
+  }
+  void addValue(double usage, long weight) {
+    counts[usage] += weight;
+    n += weight;
+  }
+  // Removes an entry which was added before.
+  void remove(const Result::FuncResult &funcRes, int weight = 1) {
+    auto it = counts.find(privateUsage(funcRes).usage);
+    assert(it != counts.end() && it->second >= weight);
+    if ((it->second -= weight) == 0) {
+      counts.erase(it);
+    }
+    n -= weight;
+  }
+  long count() const { return n; }
+  // The value with rank ceil(q * n), like QuantileSketch::quantile.
+  double get(double q) const {
+    if (n == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    const double rank = std::max(1.0, std::ceil(q * n));
+    long cumulative = 0;
+    for (const auto &v : counts) {
+      cumulative += v.second;
+      if (cumulative >= rank) {
+        return v.first;
+      }
+    }
+    return counts.rbegin()->first;
+  }
 };
 
 struct SelfDiagnostics {
@@ -58,14 +261,43 @@ struct SelfDiagnostics {
   }
 };
 
+// Returns the element of the class in a vector indexed by the ids of the
+// ClassRegistry. The vector grows on demand.
+template <typename T>
+T &atClassId(std::vector<T> &v, unsigned id) {
+  if (id >= v.size()) {
+    v.resize(id + 1);
+  }
+  return v[id];
+}
+
 struct HostClassesWithZeroPrivate {
-  std::unordered_set<std::shared_ptr<ClassInfo>> classes;
+  // Null if the class is not in the set.
+  std::vector<const ClassInfo *> classesById;
   void operator()(const Result::FuncResult &funcRes) {
     PrivateUsage usage = privateUsage(funcRes);
     if (usage.denominator == 0 ) {
-      classes.insert(funcRes.parentClassInfo);
+      atClassId(classesById, funcRes.parentClassInfo->id) =
+          funcRes.parentClassInfo;
+    }
+  }
+  void merge(const HostClassesWithZeroPrivate &other) {
+    for (const auto &ci : other.classesById) {
+      if (ci) {
+        atClassId(classesById, ci->id) = ci;
+      }
     }
   }
+  // The classes in the order of their ids.
+  std::vector<const ClassInfo *> getClasses() const {
+    std::vector<const ClassInfo *> classes;
+    for (const auto &ci : classesById) {
+      if (ci) {
+        classes.push_back(ci);
+      }
+    }
+    return classes;
+  }
 };
 
 template <typename T> class DiscreteDistribution {
@@ -73,31 +305,209 @@ template <typename T> class DiscreteDistribution {
   Store store;
 
 public:
-  void addValue(const T &value) { ++store[value]; }
+  void addValue(const T &value, int weight = 1) { store[value] += weight; }
+  // Removes a value which was added before.
+  void removeValue(const T &value, int weight = 1) {
+    auto it = store.find(value);
+    assert(it != store.end() && it->second >= weight);
+    if ((it->second -= weight) == 0) {
+      store.erase(it);
+    }
+  }
   const Store &get() const { return store; }
+  void merge(const DiscreteDistribution &other) {
+    for (const auto &v : other.store) {
+      store[v.first] += v.second;
+    }
+  }
+  void subtract(const DiscreteDistribution &other) {
+    for (const auto &v : other.store) {
+      auto it = store.find(v.first);
+      assert(it != store.end() && it->second >= v.second);
+      if ((it->second -= v.second) == 0) {
+        store.erase(it);
+      }
+    }
+  }
 };
 
 inline std::pair<int, int> getInterval(const double &d) {
   return std::make_pair(int(d), int(d + 1.));
 }
 
+// Fixed size, array backed histogram of private usage ratios.
+// The first bucket holds the entries with zero usage. The other buckets
+// divide the [0%, 100%] range into intervals of the given width (in
+// percent), the interval of a usage is computed the same way as
+// getInterval does. With the default width of 1% the buckets are the same
+// as the keys of a DiscreteDistribution<std::pair<int,int>> filled with
+// getInterval.
+class UsageHistogram {
+  int width;
+  // The bucket of each integer percentage in [0, 100].
+  std::vector<unsigned> bucketOfPercent;
+  std::vector<int> buckets;
+
+public:
+  explicit UsageHistogram(int width = 1)
+      : width(width), bucketOfPercent(101), buckets(100 / width + 2) {
+    assert(width > 0);
+    for (int percent = 0; percent <= 100; ++percent) {
+      bucketOfPercent[percent] = 1 + percent / width;
+    }
+  }
+
+  int getWidth() const { return width; }
+  std::size_t size() const { return buckets.size(); }
+  int count(std::size_t bucket) const { return buckets[bucket]; }
+
+  // The printable interval of the bucket.
+  std::pair<int, int> interval(std::size_t bucket) const {
+    if (bucket == 0) {
+      return getInterval(-.5);
+    }
+    int lower = static_cast<int>(bucket - 1) * width;
+    return std::make_pair(lower, lower + width);
+  }
+
+  std::size_t bucketOf(double usage) const {
+    if (usage == 0.0) {
+      return 0;
+    }
+    int percent = std::min(static_cast<int>(usage * 100), 100);
+    return bucketOfPercent[percent];
+  }
+
+  void addValue(double usage, int weight = 1) {
+    buckets[bucketOf(usage)] += weight;
+  }
+  // Removes a value which was added before.
+  void removeValue(double usage, int weight = 1) {
+    assert(buckets[bucketOf(usage)] >= weight);
+    buckets[bucketOf(usage)] -= weight;
+  }
+  // Adds count entries to the bucket, e.g. when a stored histogram is read.
+  void addToBucket(std::size_t bucket, int count) {
+    assert(bucket < buckets.size());
+    buckets[bucket] += count;
+  }
+
+  // Adds the usage ratios numerators[i]/denominators[i] to the histogram,
+  // with the weights[i] (or with weight one if weights is null).
+  // The bucket indices are computed in a separate loop without branches
+  // and function calls over contiguous arrays, so the compiler can
+  // vectorize it. The increments are done afterwards.
+  void addBatch(const int *numerators, const int *denominators,
+                std::size_t n, const int *weights = nullptr) {
+    const std::size_t chunkSize = 256;
+    unsigned indices[chunkSize];
+    const unsigned *table = bucketOfPercent.data();
+    for (std::size_t begin = 0; begin < n; begin += chunkSize) {
+      const std::size_t chunk = std::min(chunkSize, n - begin);
+      const int *num = numerators + begin;
+      const int *den = denominators + begin;
+      for (std::size_t i = 0; i < chunk; ++i) {
+        const int d = den[i] + (den[i] == 0);
+        const double usage = static_cast<double>(num[i]) / d;
+        int percent = static_cast<int>(usage * 100);
+        percent = percent < 100 ? percent : 100;
+        const unsigned nonZero = (num[i] != 0) & (den[i] != 0);
+        indices[i] = table[percent] * nonZero;
+      }
+      if (weights) {
+        for (std::size_t i = 0; i < chunk; ++i) {
+          buckets[indices[i]] += weights[begin + i];
+        }
+      } else {
+        for (std::size_t i = 0; i < chunk; ++i) {
+          ++buckets[indices[i]];
+        }
+      }
+    }
+  }
+
+  void merge(const UsageHistogram &other) {
+    assert(width == other.width);
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+      buckets[i] += other.buckets[i];
+    }
+  }
+  void subtract(const UsageHistogram &other) {
+    assert(width == other.width);
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+      assert(buckets[i] >= other.buckets[i]);
+      buckets[i] -= other.buckets[i];
+    }
+  }
+};
+
+// The entries are collected in a buffer and they are added to the histogram
+// in batches. The buffer has to be flushed before the histogram is read or
+// merged, e.g. at the end of each partition of the traversal, so reading a
+// distribution never modifies it.
 struct PercentageDistribution {
-  DiscreteDistribution<std::pair<int, int>> dist;
-  void operator()(const Result::FuncResult &funcRes) {
+  explicit PercentageDistribution(int bucketWidth = 1) : dist(bucketWidth) {}
+  void operator()(const Result::FuncResult &funcRes, int weight = 1) {
     PrivateUsage usage = privateUsage(funcRes);
-    if (usage.usage == 0.0) {
-      dist.addValue(getInterval(-.5));
-    } else {
-      dist.addValue(getInterval(usage.usage * 100));
+    numerators[buffered] = usage.numerator;
+    denominators[buffered] = usage.denominator;
+    weights[buffered] = weight;
+    if (++buffered == bufferSize) {
+      flush();
     }
   }
+  // Adds the buffered entries to the histogram.
+  void flush() {
+    dist.addBatch(numerators, denominators, buffered, weights);
+    buffered = 0;
+  }
+  const UsageHistogram &get() const {
+    assert(buffered == 0 && "flush the distribution before reading it");
+    return dist;
+  }
+  int getWidth() const { return dist.getWidth(); }
+  // Removes an entry which was added before.
+  void remove(const Result::FuncResult &funcRes, int weight = 1) {
+    flush();
+    dist.removeValue(privateUsage(funcRes).usage, weight);
+  }
+  void addToBucket(std::size_t bucket, int count) {
+    flush();
+    dist.addToBucket(bucket, count);
+  }
+  void merge(const PercentageDistribution &other) {
+    flush();
+    dist.merge(other.get());
+  }
+  void subtract(const PercentageDistribution &other) {
+    flush();
+    dist.subtract(other.get());
+  }
+
+private:
+  static const std::size_t bufferSize = 256;
+  UsageHistogram dist;
+  int numerators[bufferSize];
+  int denominators[bufferSize];
+  int weights[bufferSize];
+  std::size_t buffered = 0;
 };
 
 struct NumberOfUsedPrivsDistribution {
   DiscreteDistribution<int> dist;
-  void operator()(const Result::FuncResult &funcRes) {
+  void operator()(const Result::FuncResult &funcRes, int weight = 1) {
     PrivateUsage usage = privateUsage(funcRes);
-    dist.addValue(usage.numerator);
+    dist.addValue(usage.numerator, weight);
+  }
+  // Removes an entry which was added before.
+  void remove(const Result::FuncResult &funcRes, int weight = 1) {
+    dist.removeValue(privateUsage(funcRes).numerator, weight);
+  }
+  void merge(const NumberOfUsedPrivsDistribution &other) {
+    dist.merge(other.dist);
+  }
+  void subtract(const NumberOfUsedPrivsDistribution &other) {
+    dist.subtract(other.dist);
   }
 };
 
@@ -147,31 +557,30 @@ struct StrongCandidateBecauseMemberVars {
 
 struct MeyersCandidate {
   std::size_t count = 0;
-  bool
-  operator()(const Result::FuncResultsForFriendDecl::value_type &funcResPair) {
-    const auto &key = funcResPair.first;
-    const auto &funcRes = funcResPair.second;
+  bool operator()(const Result::FuncResult &funcRes, int weight = 1) {
+    const std::string &host = funcRes.hostDiagName();
     static ZeroPrivInFriend zpf;
     // is the befriending class a template instantiation?
-    bool match = key.first.find("<") != std::string::npos &&
-                 key.first.find(">") != std::string::npos;
+    bool match = host.find("<") != std::string::npos &&
+                 host.find(">") != std::string::npos;
     match = match && zpf(funcRes) &&
-            funcRes.defLocStr == funcRes.friendDeclLocStr; // in-class defined
+            funcRes.defLoc == funcRes.friendDeclLoc; // in-class defined
     if (match)
-      ++count;
+      count += weight;
     return match;
   }
+  void merge(const MeyersCandidate &other) { count += other.count; }
 };
 
 // possibly incorrect friend function instances
 struct PossiblyIncorrectFriend {
-  bool
-  operator()(const Result::FuncResultsForFriendDecl::value_type &funcResPair) {
-    const auto &funcRes = funcResPair.second;
+  bool operator()(const Result::FuncResult &funcRes) {
     static ZeroPrivInHost zph;
     static ZeroPrivInFriend zpf;
-    static MeyersCandidate mc;
-    return !zph(funcRes) && zpf(funcRes) && !mc(funcResPair);
+    // Not static, since it has a state (the count) and this might be called
+    // from several threads.
+    MeyersCandidate mc;
+    return !zph(funcRes) && zpf(funcRes) && !mc(funcRes);
   }
 };
 
@@ -191,35 +600,233 @@ struct IncorrectFriendClass {
   }
 };
 
+// Keeps the K entries with the largest counts in a bounded heap.
+// Ties are broken by the name, the smaller name wins, so the result does not
+// depend on the order of the entries. Adding an entry is O(log K).
+// Partial results can be merged.
+class TopK {
+public:
+  using Entry = std::pair<long, std::string>; // count, name
+
+  explicit TopK(std::size_t k = 0) : k(k) {}
+
+  std::size_t getK() const { return k; }
+
+  // Returns false if an entry with this count would be dropped for sure.
+  // Use it to avoid constructing the name of such entries.
+  bool mayAccept(long count) const {
+    return heap.size() < k || (k > 0 && count >= heap.front().first);
+  }
+
+  void add(long count, std::string name) {
+    if (!mayAccept(count)) {
+      return;
+    }
+    Entry entry{count, std::move(name)};
+    if (heap.size() < k) {
+      heap.push_back(std::move(entry));
+      std::push_heap(std::begin(heap), std::end(heap), better);
+    } else if (better(entry, heap.front())) {
+      std::pop_heap(std::begin(heap), std::end(heap), better);
+      heap.back() = std::move(entry);
+      std::push_heap(std::begin(heap), std::end(heap), better);
+    }
+  }
+
+  void merge(const TopK &other) {
+    for (const auto &entry : other.heap) {
+      add(entry.first, entry.second);
+    }
+  }
+
+  // The kept entries, the largest first.
+  std::vector<Entry> get() const {
+    std::vector<Entry> result = heap;
+    std::sort(std::begin(result), std::end(result), better);
+    return result;
+  }
+
+private:
+  static bool better(const Entry &a, const Entry &b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  }
+  std::size_t k;
+  // With the "better" comparison the worst kept entry is at the front.
+  std::vector<Entry> heap;
+};
+
+// Counts the friend instances (friend functions and member functions of
+// friend classes) of each befriending class.
+struct BefriendedHosts {
+  std::unordered_map<std::string, long> counts;
+  void operator()(const std::string &host, long weight = 1) {
+    counts[host] += weight;
+  }
+  void merge(const BefriendedHosts &other) {
+    for (const auto &v : other.counts) {
+      counts[v.first] += v.second;
+    }
+  }
+  TopK top(std::size_t k) const {
+    TopK result{k};
+    for (const auto &v : counts) {
+      result.add(v.second, v.first);
+    }
+    return result;
+  }
+};
+
 // Befriending classes where all friend functions are meyers candidates
 // and there are no friend classes
 // E.g. boost::less_than_comparable1
 class BefriendingClassesAllFriendsMC {
-  struct Bool {
-    bool r = true;
-  }; // wrapper to use default initialization
-  std::unordered_map<std::shared_ptr<ClassInfo>, Bool> classes;
+  // Bitsets indexed by the class ids.
+  std::vector<bool> seen;
+  std::vector<bool> notAllMC;
+
+  void set(std::vector<bool> &bits, unsigned id) {
+    if (id >= bits.size()) {
+      bits.resize(id + 1);
+    }
+    bits[id] = true;
+  }
+
 public:
-  void functionInstance(
-      const Result::FuncResultsForFriendDecl::value_type &funcResPair) {
-    const auto &funcRes = funcResPair.second;
-    static MeyersCandidate mc;
-    auto &ci = classes[funcRes.parentClassInfo];
-    if (mc(funcResPair)) {
-      ci.r = ci.r && true;
-    } else {
-      ci.r = false;
+  void functionInstance(const Result::FuncResult &funcRes) {
+    MeyersCandidate mc;
+    set(seen, funcRes.parentClassInfo->id);
+    if (!mc(funcRes)) {
+      set(notAllMC, funcRes.parentClassInfo->id);
     }
   }
   void classFunctionInstance(const Result::FuncResult &funcRes) {
-    classes[funcRes.parentClassInfo].r = false;
+    set(seen, funcRes.parentClassInfo->id);
+    set(notAllMC, funcRes.parentClassInfo->id);
   }
-  std::unordered_set<std::shared_ptr<ClassInfo>> getResult() {
-    std::unordered_set<std::shared_ptr<ClassInfo>> result;
-    for (const auto &v : classes) {
-      if (v.second.r)
-        result.insert(v.first);
+  void merge(const BefriendingClassesAllFriendsMC &other) {
+    for (unsigned id = 0; id < other.seen.size(); ++id) {
+      if (other.seen[id]) {
+        set(seen, id);
+      }
     }
-    return result;
+    for (unsigned id = 0; id < other.notAllMC.size(); ++id) {
+      if (other.notAllMC[id]) {
+        set(notAllMC, id);
+      }
+    }
+  }
+  bool allFriendsMC(const ClassInfo &ci) const {
+    return ci.id < seen.size() && seen[ci.id] &&
+           !(ci.id < notAllMC.size() && notAllMC[ci.id]);
+  }
+};
+
+// Splits a qualified name at the "::" separators which are not inside
+// template arguments.
+inline std::vector<std::string> splitQualifiedName(const std::string &name) {
+  std::vector<std::string> parts;
+  int templateDepth = 0;
+  std::string::size_type begin = 0;
+  for (std::string::size_type i = 0; i < name.size(); ++i) {
+    if (name[i] == '<' || name[i] == '(') {
+      ++templateDepth;
+    } else if (name[i] == '>' || name[i] == ')') {
+      --templateDepth;
+    } else if (templateDepth == 0 && name.compare(i, 2, "::") == 0) {
+      parts.push_back(name.substr(begin, i - begin));
+      begin = i + 2;
+      ++i;
+    }
+  }
+  parts.push_back(name.substr(begin));
+  return parts;
+}
+
+// Assigns a group to each friend instance, e.g. to have statistics per
+// module or per namespace.
+class Grouping {
+public:
+  enum Kind { None, Dir, Namespace, File };
+
+  // Parses "dir:<depth>", "namespace:<depth>" or "file".
+  // Returns false if the specification is invalid.
+  bool parse(const std::string &spec) {
+    auto colon = spec.find(':');
+    std::string kindStr = spec.substr(0, colon);
+    if (kindStr == "file" && colon == std::string::npos) {
+      kind = File;
+      return true;
+    }
+    if (colon == std::string::npos || colon + 1 == spec.size()) {
+      return false;
+    }
+    std::string depthStr = spec.substr(colon + 1);
+    if (depthStr.size() > 4 ||
+        depthStr.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    depth = std::stoul(depthStr);
+    if (depth == 0) {
+      return false;
+    }
+    if (kindStr == "dir") {
+      kind = Dir;
+    } else if (kindStr == "namespace") {
+      kind = Namespace;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  Kind getKind() const { return kind; }
+
+  // The group of a friend instance:
+  //  file: the file of the friend declaration,
+  //  dir: the first <depth> directories of the friend declaration's path,
+  //  namespace: the first <depth> enclosing namespaces (or classes) of the
+  //             befriending class.
+  std::string groupOf(const Result::FuncResult &funcRes) const {
+    switch (kind) {
+    case None:
+      return "";
+    case File:
+      return funcRes.friendDeclLoc.file();
+    case Dir: {
+      const std::string &file = funcRes.friendDeclLoc.file();
+      std::string dir;
+      std::string::size_type begin = 0;
+      unsigned dirs = 0;
+      while (dirs < depth) {
+        auto end = file.find('/', begin);
+        if (end == std::string::npos) {
+          break;
+        }
+        if (end > begin) {
+          ++dirs;
+        }
+        begin = end + 1;
+      }
+      dir = file.substr(0, begin);
+      return dir.empty() ? "." : dir;
+    }
+    case Namespace: {
+      auto parts = splitQualifiedName(funcRes.hostDiagName());
+      parts.pop_back(); // the class itself
+      if (parts.empty()) {
+        return "(global)";
+      }
+      std::string ns;
+      for (std::size_t i = 0; i < parts.size() && i < depth; ++i) {
+        ns += (i ? "::" : "") + parts[i];
+      }
+      return ns;
+    }
+    }
+    return "";
   }
+
+private:
+  Kind kind = None;
+  unsigned depth = 0;
 };
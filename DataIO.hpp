@@ -1,44 +1,147 @@
 #pragma once
 
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "FriendStats.hpp"
 #include "DataCrunching.hpp"
 
-inline void print(const Result::FuncResult &funcRes) {
-  llvm::outs() << "friendDeclLoc: " << funcRes.friendDeclLocStr << "\n";
-  llvm::outs() << "defLoc: " << funcRes.defLocStr << "\n";
-  llvm::outs() << "diagName: " << funcRes.diagName << "\n";
-  llvm::outs() << "usedPrivateVarsCount: " << funcRes.usedPrivateVarsCount
-               << "\n";
-  llvm::outs() << "parentPrivateVarsCount: " << funcRes.parentPrivateVarsCount
-               << "\n";
-  llvm::outs() << "usedPrivateMethodsCount: " << funcRes.usedPrivateMethodsCount
-               << "\n";
-  llvm::outs() << "parentPrivateMethodsCount: "
-               << funcRes.parentPrivateMethodsCount << "\n";
-  llvm::outs() << "types.usedPrivateCount: " << funcRes.types.usedPrivateCount
-               << "\n";
-  llvm::outs() << "types.parentPrivateCount: "
-               << funcRes.types.parentPrivateCount << "\n";
+// The locations are rendered like SourceLocation::print renders them:
+// "file:line:col", followed by " <Spelling=...>" in a macro expansion, where
+// the spelling location omits the file, or the file and the line, if they
+// are the same as in the expansion.
+inline raw_ostream &operator<<(raw_ostream &os, const Location &loc) {
+  if (loc.empty() || loc.isVerbatim()) {
+    return os << loc.file().get();
+  }
+  os << loc.file().get() << ":" << loc.line() << ":" << loc.column();
+  const Location spelling = loc.spelling();
+  if (spelling.empty()) {
+    return os;
+  }
+  os << " <Spelling=";
+  if (spelling.isVerbatim()) {
+    os << spelling.file().get();
+  } else if (spelling.file() != loc.file()) {
+    os << spelling.file().get() << ":" << spelling.line() << ":"
+       << spelling.column();
+  } else if (spelling.line() != loc.line()) {
+    os << "line:" << spelling.line() << ":" << spelling.column();
+  } else {
+    os << "col:" << spelling.column();
+  }
+  return os << ">";
+}
+
+inline std::string toString(const Location &loc) {
+  std::string s;
+  llvm::raw_string_ostream os{s};
+  os << loc;
+  return os.str();
+}
+
+// Parses "file:line:col" into the parts. If the text has only one number,
+// then that is the column and the line is not set.
+inline bool parseLocationParts(llvm::StringRef text, llvm::StringRef &file,
+                               unsigned &line, unsigned &column) {
+  auto pos = text.rfind(':');
+  if (pos == llvm::StringRef::npos ||
+      text.substr(pos + 1).getAsInteger(10, column)) {
+    return false;
+  }
+  file = text.substr(0, pos);
+  pos = file.rfind(':');
+  if (pos != llvm::StringRef::npos &&
+      !file.substr(pos + 1).getAsInteger(10, line)) {
+    file = file.substr(0, pos);
+  }
+  return true;
+}
+
+// The inverse of the rendering above. A text which is not a rendered location
+// (e.g. "<invalid loc>") is kept verbatim.
+inline Location parseLocation(llvm::StringRef text) {
+  if (text.empty()) {
+    return {};
+  }
+  llvm::StringRef expansion = text;
+  llvm::StringRef spellingText;
+  const llvm::StringRef spellingPrefix = " <Spelling=";
+  auto pos = text.find(spellingPrefix);
+  if (pos != llvm::StringRef::npos && text.endswith(">")) {
+    expansion = text.substr(0, pos);
+    spellingText = text.substr(pos + spellingPrefix.size()).drop_back();
+  }
+  llvm::StringRef file;
+  unsigned line = 0;
+  unsigned column = 0;
+  Location loc;
+  if (parseLocationParts(expansion, file, line, column) && line) {
+    Location spelling;
+    llvm::StringRef spellingFile;
+    unsigned spellingLine = line;
+    unsigned spellingColumn = 0;
+    if (!spellingText.empty() &&
+        parseLocationParts(spellingText, spellingFile, spellingLine,
+                           spellingColumn)) {
+      if (spellingFile == "col" || spellingFile == "line") {
+        spellingFile = file;
+      }
+      spelling = Location{spellingFile.str(), spellingLine, spellingColumn};
+    }
+    loc = Location{file.str(), line, column, spelling};
+  }
+  // The rendering decides, e.g. a file name might contain a colon.
+  if (loc.empty() || toString(loc) != text) {
+    return Location::verbatim(text.str());
+  }
+  return loc;
 }
 
-inline void print(const Result::FuncResultKey &key) {
-  llvm::outs() << "befriending class: " << key.first << "\n"
-               << "friendly function: " << key.second << "\n";
+inline void print(const Result::FuncResult &funcRes,
+                  raw_ostream &os = llvm::outs()) {
+  os << "friendDeclLoc: " << funcRes.friendDeclLoc << "\n";
+  os << "defLoc: " << funcRes.defLoc << "\n";
+  os << "diagName: " << funcRes.diagName << "\n";
+  os << "usedPrivateVarsCount: " << funcRes.usedPrivateVarsCount << "\n";
+  os << "parentPrivateVarsCount: " << funcRes.parentPrivateVarsCount << "\n";
+  os << "usedPrivateMethodsCount: " << funcRes.usedPrivateMethodsCount
+     << "\n";
+  os << "parentPrivateMethodsCount: " << funcRes.parentPrivateMethodsCount
+     << "\n";
+  os << "types.usedPrivateCount: " << funcRes.types.usedPrivateCount << "\n";
+  os << "types.parentPrivateCount: " << funcRes.types.parentPrivateCount
+     << "\n";
+  if (funcRes.sampled) {
+    os << "sampled: 1\n";
+  }
+  if (funcRes.multiplicity != 1) {
+    os << "multiplicity: " << funcRes.multiplicity << "\n";
+  }
+  if (funcRes.approximate) {
+    os << "approximate: 1\n";
+  }
 }
 
-inline void
-print(const Result::FuncResultsForFriendDecl::value_type &funcResPair) {
-  print(funcResPair.first);
-  print(funcResPair.second);
-  llvm::outs() << "============================================================"
-                  "================\n";
+// Prints a friend function instance with its befriending class.
+inline void printFuncInstance(const Result::FuncResult &funcRes,
+                              raw_ostream &os = llvm::outs()) {
+  os << "befriending class: " << funcRes.hostDiagName() << "\n"
+     << "friendly function: " << funcRes.diagName << "\n";
+  print(funcRes, os);
+  os << "============================================================"
+        "================\n";
 }
 
-inline void print(const ClassInfo& ci) {
-  llvm::outs() << "defLoc: " << ci.locStr << "\n";
-  llvm::outs() << "diagName: " << ci.diagName << "\n";
-  llvm::outs() << "============================================================"
-                  "================\n";
+inline void print(const ClassInfo &ci, raw_ostream &os = llvm::outs()) {
+  os << "defLoc: " << ci.loc << "\n";
+  os << "diagName: " << ci.diagName << "\n";
+  os << "============================================================"
+        "================\n";
 }
 
 inline raw_ostream &operator<<(raw_ostream &os,
@@ -47,20 +150,351 @@ inline raw_ostream &operator<<(raw_ostream &os,
   return os;
 }
 
+template <typename T>
+inline void printDistributionLine(raw_ostream &os, const T &key, int count) {
+  std::string s;
+  llvm::raw_string_ostream ss{s};
+  ss << key;
+  if (ss.str().size() < 8) {
+    os << key << "\t\t" << count << "\n";
+  } else {
+    os << key << "\t" << count << "\n";
+  }
+}
+
 template <typename T>
 inline raw_ostream &operator<<(raw_ostream &os,
                                 const DiscreteDistribution<T>& d) {
   const auto& store = d.get();
   for (const auto& v : store) {
-    std::string s;
-    llvm::raw_string_ostream ss{s};
-    ss << v.first;
-    if(ss.str().size() < 8) {
-      os << v.first << "\t\t" << v.second << "\n";
-    } else {
-      os << v.first << "\t" << v.second << "\n";
+    printDistributionLine(os, v.first, v.second);
+  }
+  return os;
+}
+
+// Prints only the non-empty buckets, in the same format as the
+// DiscreteDistribution is printed.
+inline raw_ostream &operator<<(raw_ostream &os, const UsageHistogram &h) {
+  for (std::size_t i = 0; i < h.size(); ++i) {
+    if (h.count(i)) {
+      printDistributionLine(os, h.interval(i), h.count(i));
     }
   }
   return os;
 }
 
+// ========================================================================== //
+// The order of the output.
+// The result is stored in the order of insertion, it is sorted only here,
+// when it is printed: the friend declarations by their locations, their
+// instances by the names of the befriending class and of the friend. The
+// instances with the same names stay in the order of insertion.
+
+inline std::vector<const Result::FuncDecl *>
+sortedFuncDecls(const Result &result) {
+  std::vector<const Result::FuncDecl *> decls;
+  decls.reserve(result.FuncResults.size());
+  for (const auto &decl : result.FuncResults) {
+    decls.push_back(&decl);
+  }
+  std::stable_sort(decls.begin(), decls.end(),
+                   [](const Result::FuncDecl *a, const Result::FuncDecl *b) {
+                     return a->friendDeclLoc < b->friendDeclLoc;
+                   });
+  return decls;
+}
+
+inline std::vector<const Result::ClassDecl *>
+sortedClassDecls(const Result &result) {
+  std::vector<const Result::ClassDecl *> decls;
+  decls.reserve(result.ClassResults.size());
+  for (const auto &decl : result.ClassResults) {
+    decls.push_back(&decl);
+  }
+  std::stable_sort(decls.begin(), decls.end(),
+                   [](const Result::ClassDecl *a, const Result::ClassDecl *b) {
+                     return a->friendDeclLoc < b->friendDeclLoc;
+                   });
+  return decls;
+}
+
+inline std::vector<const Result::FuncResult *>
+sortedFuncResults(const std::vector<Result::FuncResult *> &funcResults) {
+  std::vector<const Result::FuncResult *> sorted(funcResults.begin(),
+                                                 funcResults.end());
+  std::stable_sort(
+      sorted.begin(), sorted.end(),
+      [](const Result::FuncResult *a, const Result::FuncResult *b) {
+        int c = a->hostDiagName().compare(b->hostDiagName());
+        return c < 0 || (c == 0 && a->diagName < b->diagName);
+      });
+  return sorted;
+}
+
+// The instances of a friend function declaration.
+inline std::vector<const Result::FuncResult *>
+sortedFuncResults(const Result::FuncDecl &decl) {
+  return sortedFuncResults(decl.instances);
+}
+
+// The member function instances of a friend class instance.
+inline std::vector<const Result::FuncResult *>
+sortedFuncResults(const Result::ClassResult &classResult) {
+  return sortedFuncResults(classResult.memberFuncResults);
+}
+
+// The instances of a friend class declaration.
+inline std::vector<const Result::ClassResult *>
+sortedClassResults(const Result::ClassDecl &decl) {
+  std::vector<const Result::ClassResult *> sorted(decl.classResults.begin(),
+                                                  decl.classResults.end());
+  std::stable_sort(
+      sorted.begin(), sorted.end(),
+      [](const Result::ClassResult *a, const Result::ClassResult *b) {
+        return a->hostDiagName < b->hostDiagName ||
+               (a->hostDiagName == b->hostDiagName &&
+                a->diagName < b->diagName);
+      });
+  return sorted;
+}
+
+// ========================================================================== //
+// Persisting the results.
+// The result is written as lines of tab separated fields. The first field
+// tells the kind of the line:
+//   F <friendDeclId>                                  friend function decl
+//   f <friendDeclId> <host> <function> <record>       friend function inst.
+//   C <friendDeclId>                                  friend class decl
+//   c <friendDeclId> <host> <class> <diagName> <defLoc> <friendDeclLoc>
+//                                                     friend class inst.
+//   m <friendDeclId> <host> <class> <host> <function> <record>
+//                                                     member function inst.
+//   S <loc> <diagName> <numSpecializations> <numAnalyzed>
+//                                                     sampled template
+// where <record> is the fields of a Result::FuncResult. Tabs, new lines and
+// backslashes are escaped in the strings.
+
+const char *const resultStoreHeader = "friend-stats-result 4";
+
+inline std::string escapeField(const std::string &field) {
+  std::string result;
+  result.reserve(field.size());
+  for (char c : field) {
+    switch (c) {
+    case '\\':
+      result += "\\\\";
+      break;
+    case '\t':
+      result += "\\t";
+      break;
+    case '\n':
+      result += "\\n";
+      break;
+    default:
+      result += c;
+    }
+  }
+  return result;
+}
+
+inline std::string unescapeField(llvm::StringRef field) {
+  std::string result;
+  result.reserve(field.size());
+  for (std::size_t i = 0; i < field.size(); ++i) {
+    if (field[i] == '\\' && i + 1 < field.size()) {
+      ++i;
+      result += field[i] == 't' ? '\t' : field[i] == 'n' ? '\n' : field[i];
+    } else {
+      result += field[i];
+    }
+  }
+  return result;
+}
+
+inline void writeRecord(raw_ostream &os, const Result::FuncResult &funcRes) {
+  os << escapeField(funcRes.diagName) << "\t"
+     << escapeField(toString(funcRes.friendDeclLoc)) << "\t"
+     << escapeField(toString(funcRes.defLoc)) << "\t"
+     << funcRes.usedPrivateVarsCount
+     << "\t" << funcRes.parentPrivateVarsCount << "\t"
+     << funcRes.usedPrivateMethodsCount << "\t"
+     << funcRes.parentPrivateMethodsCount << "\t"
+     << funcRes.types.usedPrivateCount << "\t"
+     << funcRes.types.parentPrivateCount << "\t"
+     << escapeField(funcRes.parentClassInfo
+                        ? toString(funcRes.parentClassInfo->loc)
+                        : "")
+     << "\t" << escapeField(funcRes.hostDiagName()) << "\t"
+     << (funcRes.sampled ? 1 : 0) << "\t" << funcRes.multiplicity << "\t"
+     << (funcRes.approximate ? 1 : 0);
+}
+
+inline void writeResult(raw_ostream &os, const Result &result) {
+  os << resultStoreHeader << "\n";
+  for (const Result::FuncDecl *friendDecl : sortedFuncDecls(result)) {
+    const std::string id = escapeField(toString(friendDecl->friendDeclLoc));
+    os << "F\t" << id << "\n";
+    for (const Result::FuncResult *funcRes : sortedFuncResults(*friendDecl)) {
+      os << "f\t" << id << "\t" << escapeField(funcRes->hostDiagName())
+         << "\t" << escapeField(funcRes->diagName) << "\t";
+      writeRecord(os, *funcRes);
+      os << "\n";
+    }
+  }
+  for (const Result::ClassDecl *friendDecl : sortedClassDecls(result)) {
+    const std::string id = escapeField(toString(friendDecl->friendDeclLoc));
+    os << "C\t" << id << "\n";
+    for (const Result::ClassResult *classResult :
+         sortedClassResults(*friendDecl)) {
+      const std::string classKey = escapeField(classResult->hostDiagName) +
+                                   "\t" + escapeField(classResult->diagName);
+      os << "c\t" << id << "\t" << classKey << "\t"
+         << escapeField(classResult->diagName) << "\t"
+         << escapeField(toString(classResult->defLoc)) << "\t"
+         << escapeField(toString(classResult->friendDeclLoc)) << "\n";
+      for (const Result::FuncResult *funcRes :
+           sortedFuncResults(*classResult)) {
+        os << "m\t" << id << "\t" << classKey << "\t"
+           << escapeField(funcRes->hostDiagName()) << "\t"
+           << escapeField(funcRes->diagName) << "\t";
+        writeRecord(os, *funcRes);
+        os << "\n";
+      }
+    }
+  }
+  for (const auto &sampledTemplate : result.sampledTemplates) {
+    os << "S\t" << escapeField(toString(sampledTemplate.first)) << "\t"
+       << escapeField(sampledTemplate.second.diagName) << "\t"
+       << sampledTemplate.second.numSpecializations << "\t"
+       << sampledTemplate.second.numAnalyzed << "\n";
+  }
+}
+
+// Reads the result written by writeResult.
+// Returns false and sets the error message if the content is malformed.
+class ResultReader {
+  // The parsed locations by their fields, most of the locations are repeated
+  // in the file.
+  llvm::StringMap<Location> locations;
+
+  Location locationOf(llvm::StringRef field) {
+    auto inserted = locations.try_emplace(field);
+    if (inserted.second) {
+      inserted.first->second = parseLocation(unescapeField(field));
+    }
+    return inserted.first->second;
+  }
+
+  bool readRecord(const llvm::SmallVectorImpl<llvm::StringRef> &fields,
+                  std::size_t first, Result::FuncResult &funcRes,
+                  ClassRegistry &classes) {
+    if (fields.size() != first + 14) {
+      return false;
+    }
+    funcRes.diagName = unescapeField(fields[first]);
+    funcRes.friendDeclLoc = locationOf(fields[first + 1]);
+    funcRes.defLoc = locationOf(fields[first + 2]);
+    int *counts[] = {&funcRes.usedPrivateVarsCount,
+                     &funcRes.parentPrivateVarsCount,
+                     &funcRes.usedPrivateMethodsCount,
+                     &funcRes.parentPrivateMethodsCount,
+                     &funcRes.types.usedPrivateCount,
+                     &funcRes.types.parentPrivateCount};
+    for (std::size_t i = 0; i < 6; ++i) {
+      if (fields[first + 3 + i].getAsInteger(10, *counts[i])) {
+        return false;
+      }
+    }
+    funcRes.parentClassInfo = classes.get(locationOf(fields[first + 9]),
+                                          unescapeField(fields[first + 10]));
+    int sampled = 0;
+    if (fields[first + 11].getAsInteger(10, sampled)) {
+      return false;
+    }
+    funcRes.sampled = sampled != 0;
+    int approximate = 0;
+    if (fields[first + 12].getAsInteger(10, funcRes.multiplicity) ||
+        fields[first + 13].getAsInteger(10, approximate)) {
+      return false;
+    }
+    funcRes.approximate = approximate != 0;
+    return true;
+  }
+
+  // The ids of the instances are derived from the names which identify them
+  // in the file, the same way as FriendHandler::instanceId does.
+  static std::uint64_t idOf(std::uint64_t parentId, llvm::StringRef host,
+                            llvm::StringRef name) {
+    return combineIds(combineIds(parentId, stableHash(host)),
+                      stableHash(name));
+  }
+
+public:
+  bool read(llvm::StringRef content, Result &result, std::string &error) {
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    content.split(lines, "\n", -1, false);
+    if (lines.empty() || lines[0] != resultStoreHeader) {
+      error = "not a friend-stats result";
+      return false;
+    }
+    for (std::size_t i = 1; i < lines.size(); ++i) {
+      llvm::SmallVector<llvm::StringRef, 24> fields;
+      lines[i].split(fields, "\t");
+      bool ok = fields.size() >= 2;
+      llvm::StringRef kind = fields[0];
+      const Location id = ok ? locationOf(fields[1]) : Location{};
+      const std::uint64_t declId = id.hash();
+      if (ok && kind == "F") {
+        result.addFuncDecl(declId, id);
+      } else if (ok && kind == "f" && fields.size() > 4) {
+        Result::FuncResult funcRes;
+        ok = readRecord(fields, 4, funcRes, result.classes);
+        result.addFuncResult(
+            result.addFuncDecl(declId, id),
+            idOf(declId, unescapeField(fields[2]), unescapeField(fields[3])),
+            funcRes);
+      } else if (ok && kind == "C") {
+        result.addClassDecl(declId, id);
+      } else if (ok && (kind == "c" || kind == "m") && fields.size() > 3) {
+        Result::ClassResult classResult;
+        const std::string host = unescapeField(fields[2]);
+        const std::string name = unescapeField(fields[3]);
+        const std::uint64_t classId = idOf(declId, host, name);
+        classResult.hostDiagName = host;
+        classResult.diagName = name;
+        if (kind == "c" && fields.size() == 7) {
+          classResult.diagName = unescapeField(fields[4]);
+          classResult.defLoc = locationOf(fields[5]);
+          classResult.friendDeclLoc = locationOf(fields[6]);
+          result.addClassResult(result.addClassDecl(declId, id), classId,
+                                classResult);
+        } else if (kind == "m" && fields.size() > 6) {
+          Result::FuncResult funcRes;
+          ok = readRecord(fields, 6, funcRes, result.classes);
+          auto &stored = result.addClassResult(result.addClassDecl(declId, id),
+                                               classId, classResult);
+          result.addMemberFuncResult(stored,
+                                     idOf(classId, unescapeField(fields[4]),
+                                          unescapeField(fields[5])),
+                                     funcRes);
+        } else {
+          ok = false;
+        }
+      } else if (ok && kind == "S" && fields.size() == 5) {
+        auto &sampledTemplate = result.sampledTemplates[id];
+        sampledTemplate.diagName = unescapeField(fields[2]);
+        ok = !fields[3].getAsInteger(10, sampledTemplate.numSpecializations) &&
+             !fields[4].getAsInteger(10, sampledTemplate.numAnalyzed);
+      } else {
+        ok = false;
+      }
+      if (!ok) {
+        error = "malformed line " + std::to_string(i + 1);
+        return false;
+      }
+    }
+    result.friendFuncDeclCount = result.FuncResults.size();
+    result.friendClassDeclCount = result.ClassResults.size();
+    return true;
+  }
+};
@@ -1,11 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <numeric>
 #include <set>
+#include <thread>
+#include <vector>
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/ASTContext.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/AST/TypeVisitor.h"
+#include "clang/Index/USRGeneration.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Regex.h"
 
 #include "Data.hpp"
 
@@ -13,19 +34,52 @@
 using namespace clang;
 using namespace clang::ast_matchers;
 
-auto init_debug = []{
-	auto ptr = std::getenv("FRIEND_STATS_DEBUG");
-	std::string value{ptr ? ptr : ""};
-	if (value == "yes") {
-		return true;
-	}
-    return false;
+// Debug tracing by categories.
+// The tracing is compiled in only if FRIEND_STATS_TRACE is defined (cmake
+// -DFRIEND_STATS_TRACE=ON), otherwise the trace statements compile away.
+// When it is compiled in, the traced categories are selected at runtime
+// with the FRIEND_STATS_DEBUG environment variable, e.g.
+// FRIEND_STATS_DEBUG=types,dedupe. "yes" or "all" selects every category.
+enum TraceCategory : unsigned {
+  TraceAst = 1u << 0,     // dump of the translation units
+  TraceTypes = 1u << 1,   // used private types
+  TraceMembers = 1u << 2, // used private members
+  TraceClasses = 1u << 3, // friend classes and their members
+  TraceDedupe = 1u << 4,  // duplicate friend function instances
 };
-const bool debug = init_debug();
 
-inline llvm::raw_ostream &debug_stream() {
-  return debug ? llvm::outs() : llvm::nulls();
+#ifdef FRIEND_STATS_TRACE
+inline unsigned initTraceCategories() {
+  auto ptr = std::getenv("FRIEND_STATS_DEBUG");
+  llvm::SmallVector<llvm::StringRef, 8> names;
+  llvm::StringRef(ptr ? ptr : "").split(names, ",", -1, false);
+  unsigned result = 0;
+  for (llvm::StringRef name : names) {
+    result |= llvm::StringSwitch<unsigned>(name.trim())
+                  .Cases("yes", "all", ~0u)
+                  .Case("ast", TraceAst)
+                  .Case("types", TraceTypes)
+                  .Case("members", TraceMembers)
+                  .Case("classes", TraceClasses)
+                  .Case("dedupe", TraceDedupe)
+                  .Default(0);
+  }
+  return result;
 }
+const unsigned traceCategories = initTraceCategories();
+#define FS_TRACING(category) LLVM_UNLIKELY(traceCategories & Trace##category)
+#else
+#define FS_TRACING(category) false
+#endif
+
+// Prints the streamed values if the category is traced, e.g.
+// FS_TRACE(Types, "TD: " << TD << "\n");
+#define FS_TRACE(category, values)                                             \
+  do {                                                                         \
+    if (FS_TRACING(category)) {                                                \
+      llvm::outs() << values;                                                  \
+    }                                                                          \
+  } while (false)
 
 template <typename T> bool privOrProt(const T *x) {
   return x->getAccess() == AS_private || x->getAccess() == AS_protected;
@@ -96,6 +150,25 @@ inline bool isConcreteClass(const CXXRecordDecl *RD) {
   return true;
 }
 
+// False if the given cxx record is an instantiation of a class template or
+// it is declared in an instantiation. True for non-template classes, for
+// explicit specializations and for the patterns of the templates (see
+// FriendHandler::setPatternMode).
+inline bool isPatternClass(const CXXRecordDecl *RD) {
+  for (const DeclContext *DC = RD; DC; DC = DC->getParent()) {
+    if (const auto *CTSD = dyn_cast<ClassTemplateSpecializationDecl>(DC)) {
+      if (isTemplateInstantiation(CTSD->getSpecializationKind())) {
+        return false;
+      }
+    } else if (const auto *FD = dyn_cast<FunctionDecl>(DC)) {
+      if (FD->isTemplateInstantiation()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 inline int numberOfPrivOrProtMethods(const CXXRecordDecl *RD) {
   int res = 0;
 
@@ -147,26 +220,158 @@ public:
   }
 };
 
-class StaticVarsVisitor : public RecursiveASTVisitor<StaticVarsVisitor> {
-  const CXXRecordDecl *Class;
-  std::set<Decl *> countedDecls;
+// The members and types a function definition refers to. It does not depend
+// on the befriending class, so it is built once for each function definition
+// (see FunctionSummaryCache) and evaluated for each befriending class.
+struct FunctionAccessSummary {
+  // Fields and methods referred by MemberExprs.
+  llvm::SetVector<const ValueDecl *> memberExprDecls;
+  // Methods and variables referred by DeclRefExprs. This covers static
+  // methods, static variables and operator calls.
+  llvm::SetVector<const ValueDecl *> declRefDecls;
+  // Types of the value declarations (the return type of functions),
+  // typedefs and default initialized fields.
+  llvm::SetVector<QualType> types;
+  // Called constructors.
+  llvm::SetVector<const CXXConstructorDecl *> constructors;
+  // Names of the members referred through dependent types, these are in the
+  // patterns of the templates only.
+  llvm::SetVector<DeclarationName> dependentMemberNames;
+};
+
+// Collects the referred members of a function into the summary.
+class MemberRefCollector : public RecursiveASTVisitor<MemberRefCollector> {
+  FunctionAccessSummary &summary;
 
 public:
-  std::size_t getResult() const { return countedDecls.size(); }
-  StaticVarsVisitor(const CXXRecordDecl *Class) : Class(Class) {}
+  MemberRefCollector(FunctionAccessSummary &summary) : summary(summary) {}
+
+  bool VisitMemberExpr(MemberExpr *ME) {
+    if (const FieldDecl *FD =
+            dyn_cast_or_null<const FieldDecl>(ME->getMemberDecl())) {
+      summary.memberExprDecls.insert(FD);
+    } else if (const CXXMethodDecl *MD =
+                   dyn_cast_or_null<const CXXMethodDecl>(ME->getMemberDecl())) {
+      summary.memberExprDecls.insert(MD);
+    }
+    return true;
+  }
+
   bool VisitDeclRefExpr(DeclRefExpr *DRef) {
-    if (VarDecl *D = dyn_cast<VarDecl>(DRef->getDecl())) {
-      if (Class == D->getDeclContext() && privOrProt(D)) {
-        countedDecls.insert(D);
-      }
+    if (CXXMethodDecl *MD = dyn_cast<CXXMethodDecl>(DRef->getDecl())) {
+      summary.declRefDecls.insert(MD);
+    } else if (VarDecl *D = dyn_cast<VarDecl>(DRef->getDecl())) {
+      summary.declRefDecls.insert(D);
+    }
+    return true;
+  }
+
+  bool VisitCXXDependentScopeMemberExpr(CXXDependentScopeMemberExpr *E) {
+    summary.dependentMemberNames.insert(E->getMember());
+    return true;
+  }
+
+  bool VisitUnresolvedMemberExpr(UnresolvedMemberExpr *E) {
+    summary.dependentMemberNames.insert(E->getMemberName());
+    return true;
+  }
+
+  bool VisitDependentScopeDeclRefExpr(DependentScopeDeclRefExpr *E) {
+    summary.dependentMemberNames.insert(E->getDeclName());
+    return true;
+  }
+};
+
+// Collects the used types and constructors of a function into the summary.
+// Unlike the MemberRefCollector, it visits the implicit code too.
+class TypeRefCollector : public RecursiveASTVisitor<TypeRefCollector> {
+  FunctionAccessSummary &summary;
+
+public:
+  TypeRefCollector(FunctionAccessSummary &summary) : summary(summary) {}
+
+  bool VisitValueDecl(ValueDecl *D) {
+    QualType QT = D->getType();
+    if (FS_TRACING(Types)) {
+      llvm::outs() << "ValueDecl\n";
+      QT->dump();
+    }
+
+    const Type *T = QT.getTypePtr();
+    if (const FunctionProtoType *FP = T->getAs<FunctionProtoType>()) {
+      QualType RetType = FP->getReturnType();
+      summary.types.insert(RetType);
+      return true;
+    }
+
+    summary.types.insert(QT);
+    // The return value indicates whether we want the visitation to proceed.
+    // Return false to stop the traversal of the AST.
+    return true;
+  }
+
+  bool VisitTypedefNameDecl(TypedefNameDecl *TD) {
+
+    if (FS_TRACING(Types))
+      TD->getUnderlyingType()->dump();
+
+    summary.types.insert(TD->getUnderlyingType());
+
+    return true;
+  }
+
+  bool shouldVisitImplicitCode() const { return true; }
+
+  bool VisitCXXConstructExpr(const CXXConstructExpr *CE) {
+    FS_TRACE(Types, "CXXConstructExpr: " << CE << "\n");
+    summary.constructors.insert(CE->getConstructor());
+    return true;
+  }
+
+  bool VisitCXXDefaultInitExpr(const CXXDefaultInitExpr *E) {
+    const FieldDecl *FD = E->getField();
+    QualType QT = FD->getType();
+    if (FS_TRACING(Types)) {
+      llvm::outs() << "QT: ";
+      QT->dump();
     }
+    summary.types.insert(QT);
     return true;
   }
 };
 
-class TypeHandlerVisitor : public RecursiveASTVisitor<TypeHandlerVisitor> {
+// Builds the summaries of the function definitions when they are first
+// needed. The summaries point into the AST, so the cache must be cleared
+// at the start of each translation unit.
+class FunctionSummaryCache {
+  llvm::DenseMap<const FunctionDecl *, std::unique_ptr<FunctionAccessSummary>>
+      summaries;
+
+public:
+  const FunctionAccessSummary &get(const FunctionDecl *FuncDefinition) {
+    auto &summary = summaries[FuncDefinition];
+    if (!summary) {
+      summary.reset(new FunctionAccessSummary);
+      // The visitors define only Visit* methods, so RecursiveASTVisitor
+      // traverses the statements of the body with its own work queue
+      // instead of native recursion. Do not override Traverse*Stmt methods
+      // in them, that would switch back to recursion.
+      MemberRefCollector memberRefCollector{*summary};
+      memberRefCollector.TraverseFunctionDecl(
+          const_cast<FunctionDecl *>(FuncDefinition));
+      TypeRefCollector typeRefCollector{*summary};
+      typeRefCollector.TraverseFunctionDecl(
+          const_cast<FunctionDecl *>(FuncDefinition));
+    }
+    return *summary;
+  }
+  void clear() { summaries.clear(); }
+};
+
+// Counts the private types of the befriending class which are used in a
+// function, from the types and constructors of its summary.
+class UsedTypesCounter {
   const CXXRecordDecl *Class; // The befriending class
-  Result::FuncResult::Types typesResult;
   std::set<const TypeDecl *> countedTypes;
 
   Decl *GetTypeDecl(QualType QT) {
@@ -194,11 +399,17 @@ class TypeHandlerVisitor : public RecursiveASTVisitor<TypeHandlerVisitor> {
     return nullptr;
   }
 
+public:
+  UsedTypesCounter(const CXXRecordDecl *Class) : Class(Class) {}
+
+  std::size_t getResult() const { return countedTypes.size(); }
+
   void HandleType(QualType QT) {
     QT = QT.getUnqualifiedType();
     Decl *D = GetTypeDecl(QT);
     if (!D) {
-      if (debug) debug_stream() << "not Type Decl " << "\n";
+      FS_TRACE(Types, "not Type Decl "
+                          << "\n");
       return;
     }
     TypeDecl *TD = cast<TypeDecl>(D);
@@ -208,11 +419,11 @@ class TypeHandlerVisitor : public RecursiveASTVisitor<TypeHandlerVisitor> {
 
     auto insert = [&TD, this](QualType QT) {
       if (privOrProt(TD)) {
-        if (debug) {
-          debug_stream() << "TD: " << TD << "\n";
-          debug_stream() << "QT.canonical: "
-                         << QT.getCanonicalType().getTypePtr() << "\n";
-          debug_stream() << "QT.TypePtr: " << QT.getTypePtr() << "\n";
+        if (FS_TRACING(Types)) {
+          llvm::outs() << "TD: " << TD << "\n";
+          llvm::outs() << "QT.canonical: "
+                       << QT.getCanonicalType().getTypePtr() << "\n";
+          llvm::outs() << "QT.TypePtr: " << QT.getTypePtr() << "\n";
         }
         countedTypes.insert(TD);
       }
@@ -246,47 +457,7 @@ class TypeHandlerVisitor : public RecursiveASTVisitor<TypeHandlerVisitor> {
     }
   }
 
-public:
-  TypeHandlerVisitor(const CXXRecordDecl *Class) : Class(Class) {}
-
-  std::size_t getResult() const { return countedTypes.size(); }
-
-  bool VisitValueDecl(ValueDecl *D) {
-    QualType QT = D->getType();
-    if (debug){
-      debug_stream() << "ValueDecl\n";
-      QT->dump();
-    }
-
-    const Type *T = QT.getTypePtr();
-    if (const FunctionProtoType *FP = T->getAs<FunctionProtoType>()) {
-      QualType RetType = FP->getReturnType();
-      HandleType(RetType);
-      return true;
-    }
-
-    HandleType(QT);
-    // The return value indicates whether we want the visitation to proceed.
-    // Return false to stop the traversal of the AST.
-    return true;
-  }
-
-  bool VisitTypedefNameDecl(TypedefNameDecl *TD) {
-
-    if (debug)
-      TD->getUnderlyingType()->dump();
-
-    QualType QT = TD->getUnderlyingType();
-    HandleType(QT);
-
-    return true;
-  }
-
-  bool shouldVisitImplicitCode() const { return true; }
-
-  bool VisitCXXConstructExpr(const CXXConstructExpr *CE) {
-    debug_stream() << "CXXConstructExpr: " << CE << "\n";
-    const auto *CD = CE->getConstructor();
+  void HandleConstructor(const CXXConstructorDecl *CD) {
     const DeclContext *iDC = dyn_cast<DeclContext>(CD);
     while (iDC->getParent()) {
       if (auto *RD = dyn_cast<RecordDecl>(iDC->getParent())) {
@@ -294,84 +465,258 @@ public:
           if (const auto iRD = dyn_cast<RecordDecl>(iDC)) {
             if (privOrProt(iRD)) {
               const Type *T = iRD->getTypeForDecl();
-              debug_stream() << "T: " << T << "\n";
-              if (debug)
+              if (FS_TRACING(Types)) {
+                llvm::outs() << "T: " << T << "\n";
                 T->dump();
+              }
               countedTypes.insert(iRD);
             }
           }
-          return true;
+          return;
         }
       }
       iDC = iDC->getParent();
     }
-    return true;
-  }
-
-  bool VisitCXXDefaultInitExpr(const CXXDefaultInitExpr *E) {
-    const FieldDecl *FD = E->getField();
-    QualType QT = FD->getType();
-    debug_stream() << "QT: ";
-    if (debug)
-      QT->dump();
-    HandleType(QT);
-    return true;
   }
 };
 
-class MemberHandlerVisitor : public RecursiveASTVisitor<MemberHandlerVisitor> {
-  const CXXRecordDecl *Class;
-  std::set<const FieldDecl *> fields;
-  std::set<const CXXMethodDecl *> methods;
+// Looks for the first private field, static variable or method of the
+// befriending class used in a function, with the same rules as
+// countUsedMembers. The traversal stops there.
+class PrivateMemberFinder : public RecursiveASTVisitor<PrivateMemberFinder> {
+  const CXXRecordDecl *Class; // The befriending class
 
 public:
-  MemberHandlerVisitor(const CXXRecordDecl *Class) : Class(Class) {}
+  bool usedVar = false;
+  bool usedMethod = false;
 
+  explicit PrivateMemberFinder(const CXXRecordDecl *Class) : Class(Class) {}
+
+  // Returning false stops the traversal.
   bool VisitMemberExpr(MemberExpr *ME) {
     if (const FieldDecl *FD =
             dyn_cast_or_null<const FieldDecl>(ME->getMemberDecl())) {
-      const RecordDecl *Parent = FD->getParent();
-      if (Parent == Class && privOrProt(FD)) {
-        fields.insert(FD);
+      if (FD->getParent() == Class && privOrProt(FD)) {
+        usedVar = true;
       }
     } else if (const CXXMethodDecl *MD =
                    dyn_cast_or_null<const CXXMethodDecl>(ME->getMemberDecl())) {
-      const CXXRecordDecl *Parent = MD->getParent();
-      if (Parent == Class && privOrProt(MD)) {
-        methods.insert(MD);
+      if (MD->getParent() == Class && privOrProt(MD)) {
+        usedMethod = true;
       }
     }
-    return true;
+    return !usedVar && !usedMethod;
   }
 
-  // It handles static methods and operator call expressions as well.
   bool VisitDeclRefExpr(DeclRefExpr *DRef) {
-    if (CXXMethodDecl *MD = dyn_cast<CXXMethodDecl>(DRef->getDecl())) {
-      if (Class == MD->getDeclContext() && privOrProt(MD)) {
-        methods.insert(MD);
+    ValueDecl *D = DRef->getDecl();
+    if (D->getDeclContext() == Class && privOrProt(D)) {
+      if (isa<CXXMethodDecl>(D)) {
+        usedMethod = true;
+      } else if (isa<VarDecl>(D)) {
+        usedVar = true;
       }
     }
-    return true;
+    return !usedVar && !usedMethod;
+  }
+};
+
+// Looks for the first private type of the befriending class used in a
+// function, with the same rules as the TypeRefCollector and the
+// UsedTypesCounter. The traversal stops there.
+class PrivateTypeFinder : public RecursiveASTVisitor<PrivateTypeFinder> {
+  UsedTypesCounter typesCounter;
+
+public:
+  explicit PrivateTypeFinder(const CXXRecordDecl *Class)
+      : typesCounter(Class) {}
+
+  bool usedType() const { return typesCounter.getResult() > 0; }
+
+  bool shouldVisitImplicitCode() const { return true; }
+
+  // Returning false stops the traversal.
+  bool VisitValueDecl(ValueDecl *D) {
+    QualType QT = D->getType();
+    if (const FunctionProtoType *FP = QT->getAs<FunctionProtoType>()) {
+      QT = FP->getReturnType();
+    }
+    typesCounter.HandleType(QT);
+    return !usedType();
   }
 
-  const Result::FuncResult getResult() const {
-    Result::FuncResult funcResult;
-    funcResult.usedPrivateVarsCount = fields.size();
-    funcResult.usedPrivateMethodsCount = methods.size();
-    return funcResult;
+  bool VisitTypedefNameDecl(TypedefNameDecl *TD) {
+    typesCounter.HandleType(TD->getUnderlyingType());
+    return !usedType();
+  }
+
+  bool VisitCXXConstructExpr(const CXXConstructExpr *CE) {
+    typesCounter.HandleConstructor(CE->getConstructor());
+    return !usedType();
+  }
+
+  bool VisitCXXDefaultInitExpr(const CXXDefaultInitExpr *E) {
+    typesCounter.HandleType(E->getField()->getType());
+    return !usedType();
   }
 };
 
+// Assigns a bit to each field, static variable and method of a class.
+// The members used by a function are collected into a bitset, the numbers
+// of the used private members are the popcounts of that bitset and-ed with
+// the masks of the private variables and methods.
+// Members which are not known when the index is built (e.g. a
+// redeclaration of a method) have no bit, countUsedMembers counts them
+// separately. The index is not modified after it is built, so the threads
+// of the parallel analysis can share it.
+class MemberIndex {
+  llvm::DenseMap<const Decl *, unsigned> bits;
+  llvm::BitVector privateVars;
+  llvm::BitVector privateMethods;
+
+  template <typename T> void add(const T *D, bool isVar) {
+    if (bits.count(D)) {
+      return;
+    }
+    unsigned bit = bits.size();
+    bits.insert({D, bit});
+    privateVars.resize(bit + 1);
+    privateMethods.resize(bit + 1);
+    if (privOrProt(D)) {
+      (isVar ? privateVars : privateMethods).set(bit);
+    }
+  }
+
+  unsigned countUsed(const llvm::BitVector &used,
+                     const llvm::BitVector &mask) const {
+    llvm::BitVector result = used;
+    result.resize(mask.size());
+    result &= mask;
+    return result.count();
+  }
+
+public:
+  explicit MemberIndex(const CXXRecordDecl *RD) {
+    for (const FieldDecl *FD : RD->fields()) {
+      add(FD, true);
+    }
+    for (const Decl *D : RD->decls()) {
+      if (const VarDecl *VD = dyn_cast<VarDecl>(D)) {
+        add(VD, true);
+      }
+    }
+    for (const CXXMethodDecl *MD : RD->methods()) {
+      add(MD, false);
+    }
+    for (const FunctionTemplateDecl *FTD : getFunctionTemplateRange(RD)) {
+      for (const FunctionDecl *Spec : FTD->specializations()) {
+        if (const CXXMethodDecl *MD = dyn_cast<CXXMethodDecl>(Spec)) {
+          add(MD, false);
+        }
+      }
+    }
+  }
+
+  // Returns the bit of the member, or -1 if the member is unknown.
+  int bitOf(const ValueDecl *D) const {
+    auto it = bits.find(D);
+    return it != bits.end() ? static_cast<int>(it->second) : -1;
+  }
+
+  unsigned size() const { return bits.size(); }
+
+  unsigned usedPrivateVars(const llvm::BitVector &used) const {
+    return countUsed(used, privateVars);
+  }
+  unsigned usedPrivateMethods(const llvm::BitVector &used) const {
+    return countUsed(used, privateMethods);
+  }
+};
+
+// Counts the used private fields, static variables and methods of the
+// befriending class, from the referred members of the summary.
+// If byName is set, then the members referred through dependent types are
+// resolved by their names. If Class is the pattern of a class template, then
+// the members of its specializations are resolved by their names too. Thus
+// a member of another class with the same name is counted as well.
+inline Result::FuncResult countUsedMembers(const FunctionAccessSummary &summary,
+                                           const CXXRecordDecl *Class,
+                                           const MemberIndex &index,
+                                           bool byName = false) {
+  // The members of Class used in the function.
+  llvm::BitVector used(index.size());
+  // The used private members which are not in the index.
+  llvm::SmallPtrSet<const ValueDecl *, 4> otherVars;
+  llvm::SmallPtrSet<const ValueDecl *, 4> otherMethods;
+  auto use = [&](const ValueDecl *D, bool isVar) {
+    int bit = index.bitOf(D);
+    if (bit >= 0) {
+      used.set(bit);
+    } else if (privOrProt(D)) {
+      (isVar ? otherVars : otherMethods).insert(D);
+    }
+  };
+  const ClassTemplateDecl *classTemplate =
+      byName ? Class->getDescribedClassTemplate() : nullptr;
+  // The names of the members to be resolved.
+  llvm::SmallPtrSet<const void *, 4> names;
+  if (byName) {
+    for (DeclarationName name : summary.dependentMemberNames) {
+      names.insert(name.getAsOpaquePtr());
+    }
+  }
+  auto useMemberOf = [&](const ValueDecl *D, const DeclContext *DC,
+                         bool isVar) {
+    if (DC == Class) {
+      use(D, isVar);
+    } else if (classTemplate) {
+      const auto *CTSD = dyn_cast<ClassTemplateSpecializationDecl>(DC);
+      if (CTSD && CTSD->getSpecializedTemplate() == classTemplate) {
+        names.insert(D->getDeclName().getAsOpaquePtr());
+      }
+    }
+  };
+  for (const ValueDecl *D : summary.memberExprDecls) {
+    if (const FieldDecl *FD = dyn_cast<FieldDecl>(D)) {
+      useMemberOf(FD, FD->getParent(), true);
+    } else if (const CXXMethodDecl *MD = dyn_cast<CXXMethodDecl>(D)) {
+      useMemberOf(MD, MD->getParent(), false);
+    }
+  }
+  for (const ValueDecl *D : summary.declRefDecls) {
+    useMemberOf(D, D->getDeclContext(), !isa<CXXMethodDecl>(D));
+  }
+  if (!names.empty()) {
+    for (const Decl *D : Class->decls()) {
+      const auto *VD = dyn_cast<ValueDecl>(D);
+      if (!VD || !names.count(VD->getDeclName().getAsOpaquePtr())) {
+        continue;
+      }
+      if (isa<FieldDecl>(VD) || isa<VarDecl>(VD)) {
+        use(VD, true);
+      } else if (isa<CXXMethodDecl>(VD)) {
+        use(VD, false);
+      }
+    }
+  }
+  Result::FuncResult funcResult;
+  funcResult.usedPrivateVarsCount =
+      index.usedPrivateVars(used) + otherVars.size();
+  funcResult.usedPrivateMethodsCount =
+      index.usedPrivateMethods(used) + otherMethods.size();
+  return funcResult;
+}
+
 auto const TuMatcher = decl().bind("decl");
 struct TuHandler : public MatchFinder::MatchCallback {
   virtual void run(const MatchFinder::MatchResult &Result) {
-    if (!debug)
+    if (!FS_TRACING(Ast))
       return;
     if (const Decl *D = Result.Nodes.getNodeAs<Decl>("decl")) {
       if (const TranslationUnitDecl *TUD = dyn_cast<TranslationUnitDecl>(D)) {
         TUD->dump();
-        debug_stream() << "==========================================="
-                       << "\n";
+        llvm::outs() << "==========================================="
+                     << "\n";
       }
     }
   }
@@ -380,41 +725,399 @@ struct TuHandler : public MatchFinder::MatchCallback {
 auto const FriendMatcher =
     friendDecl(hasParent(recordDecl().bind("class"))).bind("friend");
 
+// Returns at most max of the specializations, evenly spread: the i-th one
+// is the (i * n / max)-th specialization. Zero means no limit. The choice
+// depends only on the order of the specializations, so the sampling is
+// deterministic.
+template <typename T, typename Range>
+std::vector<T *> sampleSpecializations(const Range &specs, unsigned max) {
+  std::vector<T *> all(specs.begin(), specs.end());
+  if (max == 0 || all.size() <= max) {
+    return all;
+  }
+  std::vector<T *> sample;
+  sample.reserve(max);
+  for (std::size_t i = 0; i < max; ++i) {
+    sample.push_back(all[i * all.size() / max]);
+  }
+  return sample;
+}
+
+// Compiles the pattern of a filter. An empty pattern leaves the regex unset.
+// Returns false and sets the error if the pattern is not a valid regular
+// expression.
+inline bool compileFilter(const std::string &pattern,
+                          std::shared_ptr<llvm::Regex> &regex,
+                          std::string &error) {
+  if (pattern.empty()) {
+    return true;
+  }
+  regex = std::make_shared<llvm::Regex>(pattern);
+  return regex->isValid(error);
+}
+
+// Selects the files whose friend declarations are analyzed. A file is in
+// scope if its path matches the header filter (if any) and it does not match
+// the exclude path (if any), e.g. vendored third party code can be excluded.
+class PathFilter {
+  std::shared_ptr<llvm::Regex> headerFilter;
+  std::shared_ptr<llvm::Regex> excludePath;
+
+public:
+  // Returns false and sets the error if one of the patterns is not a valid
+  // regular expression. Empty patterns are not used.
+  bool parse(const std::string &headerFilterPattern,
+             const std::string &excludePathPattern, std::string &error) {
+    return compileFilter(headerFilterPattern, headerFilter, error) &&
+           compileFilter(excludePathPattern, excludePath, error);
+  }
+
+  bool empty() const { return !headerFilter && !excludePath; }
+
+  bool excluded(llvm::StringRef path) const {
+    return excludePath && excludePath->match(path);
+  }
+
+  bool inScope(llvm::StringRef path) const {
+    return (!headerFilter || headerFilter->match(path)) && !excluded(path);
+  }
+};
+
+// Selects the befriending classes and the friends by their qualified names,
+// e.g. "^boost::asio::" to investigate one subsystem. The names are without
+// template arguments.
+class NameFilter {
+  std::shared_ptr<llvm::Regex> onlyClass;
+  std::shared_ptr<llvm::Regex> onlyFriend;
+  // The literal prefix of the class pattern if it is anchored at the start.
+  std::string classPrefix;
+
+  // The alternatives of the pattern, split at the unescaped '|' characters
+  // outside of groups and bracket expressions.
+  static std::vector<std::string> alternatives(const std::string &pattern) {
+    std::vector<std::string> result(1);
+    int depth = 0;
+    bool bracket = false;
+    for (std::size_t i = 0; i < pattern.size(); ++i) {
+      char c = pattern[i];
+      if (c == '\\' && i + 1 < pattern.size()) {
+        result.back() += c;
+        c = pattern[++i];
+      } else if (bracket) {
+        bracket = c != ']';
+      } else if (c == '[') {
+        bracket = true;
+        // A ']' right after the opening bracket is a literal.
+        if (i + 1 < pattern.size() && pattern[i + 1] == ']') {
+          result.back() += c;
+          c = pattern[++i];
+        }
+      } else if (c == '(') {
+        ++depth;
+      } else if (c == ')') {
+        --depth;
+      } else if (c == '|' && depth == 0) {
+        result.emplace_back();
+        continue;
+      }
+      result.back() += c;
+    }
+    return result;
+  }
+
+  // The common literal prefix of the alternatives, e.g. "boost::" for
+  // "^boost::asio::|^boost::beast::". Empty if an alternative is not
+  // anchored.
+  static std::string literalPrefix(const std::string &pattern) {
+    std::vector<std::string> alts = alternatives(pattern);
+    std::string prefix = literalPrefixOfAlternative(alts.front());
+    for (std::size_t i = 1; i < alts.size() && !prefix.empty(); ++i) {
+      std::string other = literalPrefixOfAlternative(alts[i]);
+      std::size_t n = 0;
+      while (n < prefix.size() && n < other.size() && prefix[n] == other[n]) {
+        ++n;
+      }
+      prefix.resize(n);
+    }
+    return prefix;
+  }
+
+  static std::string literalPrefixOfAlternative(const std::string &pattern) {
+    if (pattern.empty() || pattern[0] != '^') {
+      return "";
+    }
+    std::size_t end = pattern.find_first_of(".[]()*+?{}|\\$^", 1);
+    if (end == std::string::npos) {
+      return pattern.substr(1);
+    }
+    // The character before a quantifier is optional.
+    if (end > 1 && std::strchr("*?{", pattern[end])) {
+      --end;
+    }
+    return pattern.substr(1, end - 1);
+  }
+
+public:
+  // Returns false and sets the error if one of the patterns is not a valid
+  // regular expression. Empty patterns are not used.
+  bool parse(const std::string &onlyClassPattern,
+             const std::string &onlyFriendPattern, std::string &error) {
+    classPrefix = literalPrefix(onlyClassPattern);
+    return compileFilter(onlyClassPattern, onlyClass, error) &&
+           compileFilter(onlyFriendPattern, onlyFriend, error);
+  }
+
+  bool empty() const { return !onlyClass && !onlyFriend; }
+
+  bool classInScope(llvm::StringRef qualifiedName) const {
+    return !onlyClass || onlyClass->match(qualifiedName);
+  }
+
+  bool friendInScope(llvm::StringRef qualifiedName) const {
+    return !onlyFriend || onlyFriend->match(qualifiedName);
+  }
+
+  // False if no class of the namespace (or of its nested namespaces) can be
+  // in scope, i.e. the namespace can be skipped entirely.
+  bool mayContainClasses(llvm::StringRef namespaceQualifiedName) const {
+    std::string prefix = namespaceQualifiedName.str() + "::";
+    return llvm::StringRef(prefix).startswith(classPrefix) ||
+           llvm::StringRef(classPrefix).startswith(prefix);
+  }
+};
+
+// The facts to be collected, derived from the requested reports (see
+// planAnalysis in main.cpp). The FriendHandler skips the phases whose facts
+// are not needed. The counts of the befriending classes are always
+// collected.
+struct AnalysisPlan {
+  // The used private members and types of the friend functions. Without it
+  // the bodies are not traversed at all and the used counts are zero.
+  bool usage = true;
+  // The exact used counts. Without them it is decided only whether a
+  // function uses any private variable, method and type, the traversal
+  // stops at the first one and the used counts are at most one. That is
+  // enough for ZeroPrivInFriend and IncorrectFriendClassFunctionInstance.
+  bool exactUsage = true;
+  // The locations of the definitions of the friends. Without them only a
+  // friend function defined in its friend declaration gets a location (the
+  // location of the declaration, as MeyersCandidate expects).
+  bool defLocations = true;
+};
+
+// The results of one friend declaration. The friend declarations are
+// evaluated into these, then FriendHandler::commit inserts them into the
+// result in the order of the friend declarations. This way the evaluation
+// can run on more threads, see FriendHandler::setAnalysisThreads.
+struct FriendDeclResults {
+  // The id of the friend declaration, the hash of its location.
+  std::uint64_t friendDeclId = 0;
+  Location friendDeclLoc;
+  // Set if the friend declaration refers to a class or a class template,
+  // such a declaration is registered even if it has no results.
+  bool isClass = false;
+  // The results of a friend class are dropped if the same friend
+  // declaration has been processed already.
+  bool dropIfSeen = false;
+  // The instances by their ids, see FriendHandler::instanceId.
+  using FuncInstances =
+      std::vector<std::pair<std::uint64_t, Result::FuncResult>>;
+  struct ClassInstance {
+    std::uint64_t id;
+    Result::ClassResult classResult;
+    FuncInstances memberFuncResults;
+  };
+  std::vector<ClassInstance> classResults;
+  FuncInstances funcResults;
+  std::vector<std::pair<Location, Result::SampledTemplate>> sampledTemplates;
+};
+
 class FriendHandler : public MatchFinder::MatchCallback {
   Result result;
   SourceManager *sourceManager = nullptr;
+  // SourceManager caches the last looked up file and line, so the threads of
+  // the parallel evaluation look up the locations one by one.
+  std::mutex sourceManagerMutex;
+  // The locations of the translation unit by the raw encodings of their
+  // SourceLocations, and the names of its files. Guarded by
+  // sourceManagerMutex.
+  llvm::DenseMap<std::uint64_t, Location> locations;
+  llvm::DenseMap<const char *, InternedString> fileNames;
+
+  // In streaming mode the friend function instances are handed over to the
+  // sink right after they are measured and they are not stored in the
+  // result. Only the ids of the instances are kept to filter out duplicates.
+  ResultSink *sink = nullptr;
+  FlatIdSet seenKeys;
+  FlatIdSet seenFriendFuncDecls;
+  FlatIdSet seenFriendClassDecls;
+  // In collapsing mode the instances of a friend declaration with the same
+  // befriending class and the same counts are stored as one entry.
+  bool collapsing = false;
+  // The entries by the fingerprints of their friend declaration,
+  // befriending class and counts.
+  llvm::DenseMap<std::uint64_t, Result::FuncResult *> collapseTargets;
+  // The ids of the instances which are collapsed into another entry.
+  FlatIdSet collapsedKeys;
+  // In recording mode the instances of the translation unit are recorded
+  // before the duplicates are dropped.
+  bool recording = false;
+  Contribution contribution;
+  // The friend class declarations in Contribution::firstSeenClassFuncs.
+  FlatIdSet recordedClassDecls;
+  // The function bodies are traversed once per translation unit, even if a
+  // friend class template has many befriending classes.
+  FunctionSummaryCache summaries;
+  // The counts and the member indexes of the befriending classes of the
+  // translation unit, computed once per class even if it has many friend
+  // declarations.
+  llvm::DenseMap<const CXXRecordDecl *, ClassCounts> hostCounts;
+
+  PathFilter pathFilter;
+  // Whether the files of the translation unit are in scope, by the hash
+  // values of their FileIDs.
+  llvm::DenseMap<unsigned, bool> filesInScope;
+  NameFilter nameFilter;
+  // Whether the befriending classes of the translation unit are in scope.
+  llvm::DenseMap<const CXXRecordDecl *, bool> hostsInScope;
+
+  // With more analysis threads the friend declarations are evaluated at the
+  // end of the translation unit, when the AST is not modified any more.
+  unsigned analysisThreads = 1;
+  // In batching mode the friend declarations are evaluated at the end of the
+  // translation unit too, grouped by their befriending class and friend.
+  bool batching = false;
+  // The limit of the analyzed specializations of a template.
+  unsigned maxSpecializations = 0;
+  // In pattern mode the templates are analyzed once, on their patterns,
+  // instead of on each specialization.
+  bool patternMode = false;
+  AnalysisPlan plan;
+  struct PendingFriendDecl {
+    const CXXRecordDecl *hostRD;
+    const FriendDecl *FD;
+    ClassCounts classCounts;
+    // The order of the first pending friend declaration of the befriending
+    // class and of the friend.
+    unsigned hostRank;
+    unsigned friendRank;
+  };
+  std::vector<PendingFriendDecl> pending;
+  // The ranks of the befriending classes and of the friends of the pending
+  // friend declarations.
+  llvm::DenseMap<const CXXRecordDecl *, unsigned> pendingHosts;
+  llvm::DenseMap<const void *, unsigned> pendingFriends;
+
+  // The state of the evaluation on one thread.
+  struct Evaluator {
+    FunctionSummaryCache &summaries;
+    // The serial evaluation skips the friend instances which are already in
+    // the result. The parallel evaluation does not read the result, there
+    // commit drops the duplicates. In recording mode nothing is skipped.
+    bool skipStored;
+  };
 
 public:
+  // Set the sink to switch on the streaming mode.
+  void setSink(ResultSink *s) { sink = s; }
+
+  // Analyze only the friend declarations in the files which are in the scope
+  // of the filter.
+  void setPathFilter(PathFilter f) { pathFilter = std::move(f); }
+
+  // Collect only the facts of the plan.
+  void setPlan(const AnalysisPlan &p) { plan = p; }
+
+  // Analyze only the befriending classes and the friends whose qualified
+  // names are in the scope of the filter.
+  void setNameFilter(NameFilter f) { nameFilter = std::move(f); }
+
+  // False if no befriending class of the namespace is in the scope of the
+  // name filter, the FriendIndexer does not traverse such namespaces.
+  // The names of the classes in an inline namespace might be printed
+  // without the namespace, so inline namespaces are always traversed.
+  bool mayContainHosts(const NamespaceDecl *ND) const {
+    return nameFilter.empty() || ND->isInline() ||
+           nameFilter.mayContainClasses(ND->getQualifiedNameAsString());
+  }
 
-  ClassCounts getClassCounts(const CXXRecordDecl *RD) {
-    ClassCounts classCounts;
-
-    // TODO This could be done with decls_begin, since CXXRecordDecl is a
-    // DeclContext. That might be more efficient, since that way we would
-    // not traverse the full tree of RD.
-    PrivTypeCounter privTypeCounter;
-    privTypeCounter.TraverseCXXRecordDecl(const_cast<CXXRecordDecl *>(RD));
+  // Evaluate the friend declarations of each translation unit on n threads.
+  void setAnalysisThreads(unsigned n) { analysisThreads = n ? n : 1; }
+
+  // Store the equivalent specializations of a friend function declaration
+  // as one entry with a multiplicity. It has no effect in streaming mode.
+  void setCollapsing(bool c) { collapsing = c; }
+
+  // Analyze at most n specializations of each template, zero means no
+  // limit.
+  void setMaxSpecializations(unsigned n) { maxSpecializations = n; }
+
+  // Analyze the patterns of the befriending class templates and of the
+  // friend templates instead of their instantiations. The members used
+  // through dependent types are resolved by their names, so the results are
+  // approximate (see Result::FuncResult::approximate).
+  void setPatternMode(bool p) { patternMode = p; }
+
+  // Evaluate the friend declarations of the same befriending class together
+  // at the end of each translation unit, ordered by their friends.
+  void setBatching(bool b) { batching = b; }
+
+  // Record the instances of each translation unit, also the ones which are
+  // stored already (those are measured again). See takeContribution.
+  void setRecording(bool r) { recording = r; }
+
+  // The instances recorded since the last call.
+  Contribution takeContribution() {
+    Contribution taken = std::move(contribution);
+    contribution = Contribution{};
+    recordedClassDecls = FlatIdSet{};
+    return taken;
+  }
 
-    classCounts.privateTypesCount = privTypeCounter.getResult();
-    classCounts.privateVarsCount = numberOfPrivOrProtFields(RD);
-    classCounts.privateMethodsCount = numberOfPrivOrProtMethods(RD);
+  // The cached summaries, locations and files refer to the previous
+  // translation unit.
+  void onStartOfTranslationUnit() override {
+    summaries.clear();
+    locations.clear();
+    fileNames.clear();
+    hostCounts.clear();
+    filesInScope.clear();
+    hostsInScope.clear();
+  }
 
-    classCounts.info = std::make_shared<ClassInfo>(
-        RD->getLocation(), RD->getLocation().printToString(*sourceManager),
-        getDiagName(RD));
+  void onEndOfTranslationUnit() override { evaluatePending(); }
 
-    return classCounts;
+  // The counts of the befriending class, computed at its first friend
+  // declaration in the translation unit.
+  const ClassCounts &getClassCounts(const CXXRecordDecl *RD) {
+    auto it = hostCounts.find(RD);
+    if (it == hostCounts.end()) {
+      it = hostCounts.insert({RD, computeClassCounts(RD)}).first;
+    }
+    return it->second;
   }
 
   virtual void run(const MatchFinder::MatchResult &Result) {
-
-    sourceManager = Result.SourceManager;
-
     // The class which hosts the friend declaration.
     // This is a DeclContext.
     const CXXRecordDecl *hostRD =
         Result.Nodes.getNodeAs<clang::CXXRecordDecl>("class");
-    if (!hostRD) {
+    const FriendDecl *FD = Result.Nodes.getNodeAs<clang::FriendDecl>("friend");
+    if (!hostRD || !FD) {
+      return;
+    }
+    handleFriendDecl(hostRD, FD, *Result.SourceManager);
+  }
+
+  // Handles one friend declaration of the host class. Called either by the
+  // MatchFinder (see run) or by the FriendIndexer.
+  void handleFriendDecl(const CXXRecordDecl *hostRD, const FriendDecl *FD,
+                        SourceManager &SM) {
+    sourceManager = &SM;
+
+    // Out of scope friend declarations are dropped before anything is
+    // computed for them.
+    if (!inScope(FD->getLocation(), SM)) {
       return;
     }
 
@@ -424,19 +1127,161 @@ public:
     // non-template class.
     // We want to collect statistics only on instantiations/specializations.
     // We are not interested in not used templates.
-    if (!isConcreteClass(hostRD)) {
+    // In pattern mode it is the other way around, the templates are
+    // analyzed instead of their instantiations.
+    if (!(patternMode ? isPatternClass(hostRD) : isConcreteClass(hostRD))) {
       return;
     }
 
-    debug_stream() << "CXXRecordDecl with friend: " << hostRD << "\n";
+    if (!nameFilter.empty() && !namesInScope(hostRD, FD)) {
+      return;
+    }
 
-    const FriendDecl *FD = Result.Nodes.getNodeAs<clang::FriendDecl>("friend");
-    if (!FD) {
+    FS_TRACE(Classes, "CXXRecordDecl with friend: " << hostRD << "\n");
+
+    if (analysisThreads > 1 || batching) {
+      deferFriendDecl(hostRD, FD);
       return;
     }
 
-    ClassCounts classCounts = getClassCounts(hostRD);
+    Evaluator ev{summaries, !recording};
+    FriendDeclResults results;
+    evaluate(ev, hostRD, FD, getClassCounts(hostRD), results);
+    commit(results);
+  }
+  const Result &getResult() const { return result; }
+
+private:
+  ClassCounts computeClassCounts(const CXXRecordDecl *RD) {
+    ClassCounts classCounts;
+
+    // TODO This could be done with decls_begin, since CXXRecordDecl is a
+    // DeclContext. That might be more efficient, since that way we would
+    // not traverse the full tree of RD.
+    PrivTypeCounter privTypeCounter;
+    privTypeCounter.TraverseCXXRecordDecl(const_cast<CXXRecordDecl *>(RD));
+
+    classCounts.privateTypesCount = privTypeCounter.getResult();
+    classCounts.privateVarsCount = numberOfPrivOrProtFields(RD);
+    classCounts.privateMethodsCount = numberOfPrivOrProtMethods(RD);
+    classCounts.members = std::make_shared<MemberIndex>(RD);
+
+    // The location and the name are computed only for a new class.
+    const std::uint64_t key = entityId(RD);
+    classCounts.info = result.classes.find(key);
+    if (!classCounts.info) {
+      classCounts.info = result.classes.get(
+          key, locationOf(RD->getLocation()), getDiagName(RD));
+    }
 
+    return classCounts;
+  }
+
+  // Do not collect stats of friend decls in system headers and in the files
+  // which are out of the scope of the path filter. Decided once for each
+  // file of the translation unit.
+  bool inScope(SourceLocation loc, SourceManager &SM) {
+    SourceLocation expansionLoc = SM.getExpansionLoc(loc);
+    FileID fileId = SM.getFileID(expansionLoc);
+    auto it = filesInScope.find(fileId.getHashValue());
+    if (it != filesInScope.end()) {
+      return it->second;
+    }
+    bool result = !SM.isInSystemHeader(expansionLoc) &&
+                  (pathFilter.empty() ||
+                   pathFilter.inScope(SM.getFilename(expansionLoc)));
+    filesInScope.insert({fileId.getHashValue(), result});
+    return result;
+  }
+
+  // Checks the qualified names of the befriending class and of the friend
+  // against the name filter, before anything is computed for them.
+  bool namesInScope(const CXXRecordDecl *hostRD, const FriendDecl *FD) {
+    auto it = hostsInScope.find(hostRD);
+    if (it == hostsInScope.end()) {
+      it = hostsInScope
+               .insert({hostRD, nameFilter.classInScope(
+                                    hostRD->getQualifiedNameAsString())})
+               .first;
+    }
+    if (!it->second) {
+      return false;
+    }
+    if (const NamedDecl *ND = FD->getFriendDecl()) {
+      return nameFilter.friendInScope(ND->getQualifiedNameAsString());
+    }
+    QualType QT = FD->getFriendType()->getType();
+    if (const RecordDecl *RD = getRecordDecl(QT)) {
+      return nameFilter.friendInScope(RD->getQualifiedNameAsString());
+    }
+    return nameFilter.friendInScope(QT.getAsString());
+  }
+
+  // The friend function, class or class template of the friend declaration.
+  static const void *friendOf(const FriendDecl *FD) {
+    if (const NamedDecl *ND = FD->getFriendDecl()) {
+      return ND->getCanonicalDecl();
+    }
+    return FD->getFriendType()->getType().getCanonicalType().getTypePtr();
+  }
+
+  // The specializations of a template are reached through a pointer to the
+  // data shared by its redeclarations, which is allocated lazily from the
+  // ASTContext. These allocate it for every template which the evaluation
+  // of a friend class reads: the friend class, its nested classes and
+  // class templates and their member function templates, before the
+  // threads read them.
+  static void prepareSpecializations(const ClassTemplateDecl *CTD) {
+    prepareSpecializations(CTD->getTemplatedDecl());
+    for (const ClassTemplateSpecializationDecl *Spec : CTD->specializations()) {
+      prepareSpecializations(Spec);
+    }
+  }
+
+  static void prepareSpecializations(const CXXRecordDecl *RD) {
+    for (const FunctionTemplateDecl *FTD : getFunctionTemplateRange(RD)) {
+      FTD->specializations();
+    }
+    for (const Decl *D : RD->decls()) {
+      if (const auto *CTD = dyn_cast<ClassTemplateDecl>(D)) {
+        prepareSpecializations(CTD);
+      } else if (const auto *Nested = dyn_cast<CXXRecordDecl>(D)) {
+        if (!Nested->isInjectedClassName()) {
+          prepareSpecializations(Nested);
+        }
+      }
+    }
+  }
+
+  // Collects the friend declaration for evaluatePending. The counts of the
+  // befriending class are computed here, the threads only read them.
+  void deferFriendDecl(const CXXRecordDecl *hostRD, const FriendDecl *FD) {
+    unsigned hostRank = pendingHosts.size();
+    hostRank = pendingHosts.insert({hostRD, hostRank}).first->second;
+
+    if (NamedDecl *ND = FD->getFriendDecl()) {
+      if (const auto *CTD = dyn_cast<ClassTemplateDecl>(ND)) {
+        prepareSpecializations(CTD);
+      } else if (const auto *FTD = dyn_cast<FunctionTemplateDecl>(ND)) {
+        FTD->specializations();
+      }
+    } else if (const RecordDecl *RD =
+                   getRecordDecl(FD->getFriendType()->getType())) {
+      if (const auto *CXXRD = dyn_cast<CXXRecordDecl>(RD)) {
+        prepareSpecializations(CXXRD);
+      }
+    }
+
+    unsigned friendRank = pendingFriends.size();
+    friendRank =
+        pendingFriends.insert({friendOf(FD), friendRank}).first->second;
+    pending.push_back(
+        {hostRD, FD, getClassCounts(hostRD), hostRank, friendRank});
+  }
+
+  void evaluate(Evaluator &ev, const CXXRecordDecl *hostRD,
+                const FriendDecl *FD, const ClassCounts &classCounts,
+                FriendDeclResults &results) {
     const ClassTemplateDecl *CTD = nullptr;
     if (NamedDecl *ND = FD->getFriendDecl()) {
       CTD = dyn_cast<ClassTemplateDecl>(ND);
@@ -444,56 +1289,343 @@ public:
 
     auto srcLoc = FD->getLocation();
 
-    // Do not collect stats of friend decls in system headers
-    auto fullSrcLoc = FullSourceLoc(srcLoc, *Result.SourceManager);
-    if (fullSrcLoc.isInSystemHeader()) {
-      return;
-    }
-
     if (FD->getFriendType()) { // friend decl is class
-      handleFriendClass(hostRD, FD, srcLoc, classCounts, Result);
+      handleFriendClass(ev, hostRD, FD, srcLoc, classCounts, results);
     } else if (CTD) { // friend decl is class template
-      handleFriendClassTemplate(hostRD, CTD, srcLoc, classCounts);
+      handleFriendClassTemplate(ev, hostRD, CTD, srcLoc, classCounts, results);
     } else { // friend decl is function or function template
-      handleFriendFunction(hostRD, FD, srcLoc, classCounts, Result);
+      handleFriendFunction(ev, hostRD, FD, srcLoc, classCounts, results);
     }
-    result.friendFuncDeclCount = result.FuncResults.size();
-    result.friendClassDeclCount = result.ClassResults.size();
   }
-  const Result &getResult() const { return result; }
 
-private:
-  static void insertIntoClassResultsForFriendDecl(
-      Result::BefriendingClassInstantiationId hostId,
-      Result::ClassResult classResult,
-      Result::ClassResultsForFriendDecl &classResultsForFriendDecl) {
-
-    auto key = std::make_pair(hostId, classResult.diagName);
-
-    // This class spec has been investigated already.
-    auto it = classResultsForFriendDecl.find(key);
-    if (it != std::end(classResultsForFriendDecl)) { // do the merge
-      Result::FuncResultsForFriendDecl &origRes = it->second.memberFuncResults;
-      Result::FuncResultsForFriendDecl &newRes = classResult.memberFuncResults;
-      // Add those function template specs which are not present yet.
-      for (auto &x : newRes) {
-        origRes.insert(std::move(x));
+  // Evaluates the deferred friend declarations of the translation unit on
+  // the analysis threads. The results are inserted in the order of the
+  // friend declarations, so the result does not depend on the number of
+  // threads or on batching.
+  void evaluatePending() {
+    if (pending.empty()) {
+      return;
+    }
+    // The friend declarations in the order of evaluation. In batching mode
+    // the friend declarations of a befriending class are evaluated together
+    // (by the same thread), ordered by their friends, so the counts of the
+    // class and the summaries of the friends are at hand.
+    std::vector<std::size_t> order(pending.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (batching) {
+      std::stable_sort(order.begin(), order.end(),
+                       [this](std::size_t a, std::size_t b) {
+                         return std::make_pair(pending[a].hostRank,
+                                               pending[a].friendRank) <
+                                std::make_pair(pending[b].hostRank,
+                                               pending[b].friendRank);
+                       });
+    }
+    // The first positions of the units of work in order.
+    std::vector<std::size_t> unitBegins;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      if (!batching || i == 0 ||
+          pending[order[i]].hostRank != pending[order[i - 1]].hostRank) {
+        unitBegins.push_back(i);
+      }
+    }
+    unitBegins.push_back(order.size());
+
+    std::vector<FriendDeclResults> results(pending.size());
+    std::atomic<std::size_t> next{0};
+    auto worker = [this, &order, &unitBegins, &results, &next]() {
+      // The summaries are not shared between the threads.
+      FunctionSummaryCache threadSummaries;
+      // Without other threads the result can be read.
+      Evaluator ev{threadSummaries, analysisThreads == 1 && !recording};
+      for (std::size_t u = next++; u + 1 < unitBegins.size(); u = next++) {
+        for (std::size_t i = unitBegins[u]; i < unitBegins[u + 1]; ++i) {
+          const PendingFriendDecl &p = pending[order[i]];
+          evaluate(ev, p.hostRD, p.FD, p.classCounts, results[order[i]]);
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < analysisThreads; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+      t.join();
+    }
+    pending.clear();
+    pendingHosts.clear();
+    pendingFriends.clear();
+    for (auto &r : results) {
+      commit(r);
+    }
+  }
+
+  // Inserts the results of a friend declaration into the result (or hands
+  // them over to the sink).
+  void commit(FriendDeclResults &results) {
+    if (recording) {
+      record(results);
+    }
+    if (results.isClass &&
+        !(results.dropIfSeen && hasClassResults(results.friendDeclId))) {
+      Result::ClassDecl *classDecl = addClassResults(results);
+      for (auto &classInstance : results.classResults) {
+        insertClassResult(classDecl, classInstance);
+      }
+    }
+    for (auto &sampledTemplate : results.sampledTemplates) {
+      result.sampledTemplates.insert(std::move(sampledTemplate));
+    }
+    for (const auto &funcInstance : results.funcResults) {
+      const Result::FuncResult &funcRes = funcInstance.second;
+      if (isDuplicateFuncResult(funcInstance.first)) {
+        FS_TRACE(Dedupe, "DUPLICATE: " << funcRes.hostDiagName() << " "
+                                       << funcRes.diagName << "\n");
+        continue;
+      }
+      insertFuncResult(results, funcInstance.first, funcRes);
+      FS_TRACE(Dedupe, "INSERT function: " << funcRes.hostDiagName() << " "
+                                           << funcRes.diagName << "\n");
+    }
+    if (sink) {
+      result.friendFuncDeclCount = seenFriendFuncDecls.size();
+      result.friendClassDeclCount = seenFriendClassDecls.size();
+    } else {
+      result.friendFuncDeclCount = result.FuncResults.size();
+      result.friendClassDeclCount = result.ClassResults.size();
+    }
+  }
+
+  // Appends the instances of the friend declaration to the contribution of
+  // the translation unit. Like in commit, only the first results of a
+  // friend class declaration which drops the later ones are kept, the state
+  // drops them across the translation units (see StatisticsState).
+  void record(const FriendDeclResults &results) {
+    Contribution::Instances *classFuncs = &contribution.classFuncs;
+    if (results.isClass && results.dropIfSeen) {
+      classFuncs = nullptr;
+      if (recordedClassDecls.insert(results.friendDeclId)) {
+        contribution.firstSeenClassFuncs.emplace_back(
+            results.friendDeclId, Contribution::Instances{});
+        classFuncs = &contribution.firstSeenClassFuncs.back().second;
+      }
+    }
+    for (const auto &classInstance : results.classResults) {
+      if (classFuncs) {
+        classFuncs->insert(classFuncs->end(),
+                           classInstance.memberFuncResults.begin(),
+                           classInstance.memberFuncResults.end());
       }
+    }
+    contribution.funcs.insert(contribution.funcs.end(),
+                              results.funcResults.begin(),
+                              results.funcResults.end());
+  }
+
+  // The location which outlives the translation unit. Each SourceLocation
+  // is looked up once per translation unit, e.g. the definition of a
+  // function template is shared by its specializations.
+  Location locationOf(SourceLocation loc) {
+    std::lock_guard<std::mutex> lock(sourceManagerMutex);
+    auto it = locations.find(loc.getRawEncoding());
+    if (it != locations.end()) {
+      return it->second;
+    }
+    Location location;
+    if (!loc.isValid()) {
+      location = Location::verbatim("<invalid loc>");
+    } else if (loc.isMacroID()) {
+      const Location expansion =
+          fileLocationOf(sourceManager->getExpansionLoc(loc));
+      location = expansion.isVerbatim()
+                     ? expansion
+                     : Location{expansion.file(), expansion.line(),
+                                expansion.column(),
+                                fileLocationOf(
+                                    sourceManager->getSpellingLoc(loc))};
     } else {
-      classResultsForFriendDecl.insert({key, std::move(classResult)});
+      location = fileLocationOf(loc);
+    }
+    locations.insert({loc.getRawEncoding(), location});
+    return location;
+  }
+
+  // Called with sourceManagerMutex locked.
+  Location fileLocationOf(SourceLocation loc) {
+    const PresumedLoc PLoc = sourceManager->getPresumedLoc(loc);
+    if (PLoc.isInvalid()) {
+      return Location::verbatim("<invalid sloc>");
+    }
+    InternedString &file = fileNames[PLoc.getFilename()];
+    if (file.empty()) {
+      file = PLoc.getFilename();
+    }
+    return Location{file, PLoc.getLine(), PLoc.getColumn()};
+  }
+
+  // Returns the specializations of the template to be analyzed. If the
+  // template has more specializations than the limit, then the sampled
+  // specializations are returned and the template is recorded.
+  template <typename T, typename Range>
+  std::vector<T *> specializationsOf(const NamedDecl *templ,
+                                     const Range &specs,
+                                     FriendDeclResults &results,
+                                     bool &sampled) {
+    std::vector<T *> sample =
+        sampleSpecializations<T>(specs, maxSpecializations);
+    std::size_t total = std::distance(specs.begin(), specs.end());
+    sampled = sample.size() < total;
+    if (sampled) {
+      Result::SampledTemplate sampledTemplate;
+      sampledTemplate.diagName = getDiagName(templ);
+      sampledTemplate.numSpecializations = total;
+      sampledTemplate.numAnalyzed = sample.size();
+      results.sampledTemplates.emplace_back(locationOf(templ->getLocation()),
+                                            std::move(sampledTemplate));
+    }
+    return sample;
+  }
+
+  // Returns the functions of the function template to be analyzed, either
+  // its pattern or its (sampled) specializations.
+  std::vector<FunctionDecl *> functionsOf(const FunctionTemplateDecl *FTD,
+                                          FriendDeclResults &results,
+                                          bool &sampled) {
+    if (patternMode) {
+      return {FTD->getTemplatedDecl()};
+    }
+    return specializationsOf<FunctionDecl>(FTD, FTD->specializations(),
+                                           results, sampled);
+  }
+
+  // The id of an entity: the hash of its USR, which is the same in every
+  // translation unit (and in every run). The name is hashed if the entity
+  // has no USR.
+  std::uint64_t entityId(const NamedDecl *ND) {
+    llvm::SmallString<128> usr;
+    bool failed;
+    {
+      // The USRs of the entities with internal linkage contain their
+      // locations.
+      std::lock_guard<std::mutex> lock(sourceManagerMutex);
+      failed = clang::index::generateUSRForDecl(ND, usr);
+    }
+    return failed ? stableHash(getDiagName(ND)) : stableHash(usr);
+  }
+
+  // The id of an instance of the friend declaration: of a friend function,
+  // of a friend class or of a member function of a friend class instance
+  // (parentId is then the id of the class instance).
+  // The instances are deduplicated by the names of the befriending class
+  // and of the friend (and by the friend declaration), so e.g. the
+  // overloads of a member function are one instance. The same ids are
+  // derived from the names of a stored result, see ResultReader.
+  static std::uint64_t instanceId(std::uint64_t parentId,
+                                  const ClassCounts &classCounts,
+                                  const NamedDecl *friendND) {
+    return combineIds(
+        combineIds(parentId, stableHash(classCounts.info->diagName.get())),
+        stableHash(getDiagName(friendND)));
+  }
+
+  bool hasClassResults(std::uint64_t friendDeclId) {
+    if (sink) {
+      return seenFriendClassDecls.contains(friendDeclId);
     }
+    return result.ClassResults.count(friendDeclId);
+  }
+
+  // Registers the friend class declaration even if there are no results for
+  // it. Returns null in streaming mode.
+  Result::ClassDecl *addClassResults(const FriendDeclResults &results) {
+    if (sink) {
+      seenFriendClassDecls.insert(results.friendDeclId);
+      return nullptr;
+    }
+    return &result.addClassDecl(results.friendDeclId, results.friendDeclLoc);
+  }
+
+  // The member functions of a class instance are merged into the stored
+  // instance, only the new ones are added.
+  void insertClassResult(Result::ClassDecl *classDecl,
+                         const FriendDeclResults::ClassInstance &instance) {
+    if (!classDecl) {
+      for (const auto &funcInstance : instance.memberFuncResults) {
+        if (seenKeys.insert(funcInstance.first)) {
+          sink->classFuncInstance(funcInstance.second);
+        }
+      }
+      return;
+    }
+    Result::ClassResult &classResult =
+        result.addClassResult(*classDecl, instance.id, instance.classResult);
+    for (const auto &funcInstance : instance.memberFuncResults) {
+      result.addMemberFuncResult(classResult, funcInstance.first,
+                                 funcInstance.second);
+    }
+  }
+
+  // Whether the member function instance is stored already. Used only by
+  // the serial evaluation.
+  bool isStoredMemberFuncResult(std::uint64_t id) {
+    if (sink) {
+      return seenKeys.contains(id);
+    }
+    return result.memberFuncInstances.count(id);
+  }
+
+  bool isDuplicateFuncResult(std::uint64_t id) {
+    if (sink) {
+      return seenKeys.contains(id);
+    }
+    return collapsedKeys.contains(id) || result.funcInstances.count(id);
+  }
+
+  void insertFuncResult(const FriendDeclResults &results, std::uint64_t id,
+                        const Result::FuncResult &funcRes) {
+    if (sink) {
+      seenFriendFuncDecls.insert(results.friendDeclId);
+      if (seenKeys.insert(id)) {
+        sink->funcInstance(funcRes);
+      }
+      return;
+    }
+    Result::FuncDecl &funcDecl =
+        result.addFuncDecl(results.friendDeclId, results.friendDeclLoc);
+    if (!collapsing) {
+      result.addFuncResult(funcDecl, id, funcRes);
+      return;
+    }
+    const std::uint64_t fingerprint = llvm::hash_combine(
+        results.friendDeclId, funcRes.parentClassInfo->key,
+        funcRes.usedPrivateVarsCount, funcRes.parentPrivateVarsCount,
+        funcRes.usedPrivateMethodsCount, funcRes.parentPrivateMethodsCount,
+        funcRes.types.usedPrivateCount, funcRes.types.parentPrivateCount,
+        funcRes.sampled);
+    auto it = collapseTargets.find(fingerprint);
+    if (it != collapseTargets.end()) {
+      Result::FuncResult &target = *it->second;
+      if (target.parentClassInfo == funcRes.parentClassInfo &&
+          target.sampled == funcRes.sampled && sameCounts(target, funcRes)) {
+        target.multiplicity += funcRes.multiplicity;
+        collapsedKeys.insert(id);
+        return;
+      }
+    }
+    collapseTargets.insert(
+        {fingerprint, result.addFuncResult(funcDecl, id, funcRes)});
   }
 
   struct NestedClassVisitor : RecursiveASTVisitor<NestedClassVisitor> {
-    NestedClassVisitor(
-        const CXXRecordDecl *hostRD, const CXXRecordDecl *friendCXXRD,
-        const SourceLocation friendDeclLoc, const ClassCounts &classCounts,
-        const SourceManager *sourceManager,
-        Result::ClassResultsForFriendDecl &classResultsForFriendDecl)
-        : hostRD(hostRD), hostId(getDiagName(hostRD)), friendCXXRD(friendCXXRD),
-          friendDeclLoc(friendDeclLoc), classCounts(classCounts),
-          sourceManager(sourceManager),
-          classResultsForFriendDecl(classResultsForFriendDecl) {}
+    NestedClassVisitor(const CXXRecordDecl *hostRD,
+                       const CXXRecordDecl *friendCXXRD,
+                       const SourceLocation friendDeclLoc,
+                       const ClassCounts &classCounts, Evaluator &ev,
+                       FriendHandler &handler, FriendDeclResults &results)
+        : hostRD(hostRD), friendCXXRD(friendCXXRD),
+          friendDeclLoc(friendDeclLoc), classCounts(classCounts), ev(ev),
+          handler(handler), results(results) {}
 
     bool VisitCXXRecordDecl(CXXRecordDecl *CXXRD) {
       // Do not visit the parent friend class.
@@ -502,37 +1634,40 @@ private:
         return true;
       }
 
-      debug_stream() << "NestedClassVisitor/CXXRD :" << CXXRD << "\n";
-
-      if (const ClassTemplateDecl *CTD = CXXRD->getDescribedClassTemplate()) {
-        debug_stream() << "NestedClassVisitor/CTD :" << CTD << "\n";
-        for (const auto *spec : CTD->specializations()) {
-          insertIntoClassResultsForFriendDecl(
-              hostId, getClassInstantiationStats(hostRD, spec, friendDeclLoc,
-                                                 classCounts, sourceManager),
-              classResultsForFriendDecl);
+      FS_TRACE(Classes, "NestedClassVisitor/CXXRD :" << CXXRD << "\n");
+
+      // In pattern mode the nested class template is analyzed on its
+      // pattern, that is CXXRD.
+      const ClassTemplateDecl *CTD = CXXRD->getDescribedClassTemplate();
+      if (CTD && !handler.patternMode) {
+        FS_TRACE(Classes, "NestedClassVisitor/CTD :" << CTD << "\n");
+        bool sampled = false;
+        for (const auto *spec :
+             handler.specializationsOf<ClassTemplateSpecializationDecl>(
+                 CTD, CTD->specializations(), results, sampled)) {
+          results.classResults.push_back(handler.getClassInstantiationStats(
+              ev, hostRD, spec, friendDeclLoc, classCounts, results,
+              sampled));
         }
       } else {
-        Result::ClassResult classResult = getClassInstantiationStats(
-            hostRD, CXXRD, friendDeclLoc, classCounts, sourceManager);
-        insertIntoClassResultsForFriendDecl(hostId, std::move(classResult),
-                                            classResultsForFriendDecl);
+        results.classResults.push_back(handler.getClassInstantiationStats(
+            ev, hostRD, CXXRD, friendDeclLoc, classCounts, results));
       }
       return true;
     }
 
   private:
     const CXXRecordDecl *hostRD = nullptr;
-    Result::BefriendingClassInstantiationId hostId;
     const CXXRecordDecl *friendCXXRD = nullptr;
     const SourceLocation friendDeclLoc;
     const ClassCounts &classCounts;
-    const SourceManager *sourceManager = nullptr;
-    Result::ClassResultsForFriendDecl &classResultsForFriendDecl;
+    Evaluator &ev;
+    FriendHandler &handler;
+    FriendDeclResults &results;
   };
 
   // TODO Make it templated on RecordDecl/TypedefNameDecl
-  // See TypeHandlerVisitor::GetTypeDecl
+  // See UsedTypesCounter::GetTypeDecl
   // When there is no declaration for the type it will return a nullptr.
   RecordDecl *getRecordDecl(QualType QT) {
     const Type *T = QT.getTypePtr();
@@ -557,10 +1692,13 @@ private:
   // has a body.
   // Returns the declaration of the body if there is one and if we want to
   // collect stats for this specific function decl.
-  static const FunctionDecl *getFuncStatistics(
-      const CXXRecordDecl *hostRD, const FunctionDecl *FuncD,
-      const SourceLocation friendDeclLoc, const ClassCounts &classCounts,
-      const SourceManager *sourceManager, Result::FuncResult &funcRes) {
+  const FunctionDecl *
+  getFuncStatistics(Evaluator &ev, const CXXRecordDecl *hostRD,
+                    const FunctionDecl *FuncD,
+                    const SourceLocation friendDeclLoc,
+                    const Location &friendDeclLocation,
+                    const ClassCounts &classCounts,
+                    Result::FuncResult &funcRes) {
     // Do not include in the stats the trivial compiler generated constructors,
     // dtors, and assignments.
     if (FuncD->isTrivial()) {
@@ -582,62 +1720,100 @@ private:
       return nullptr;
     }
 
-    // TODO implement these visitors in one visitor,
-    // so we would traverse the tree only once!
-    MemberHandlerVisitor memberHandlerVisitor{hostRD};
-    memberHandlerVisitor.TraverseFunctionDecl(
-        const_cast<FunctionDecl *>(FuncDefinition));
-    StaticVarsVisitor staticVarsVisitor{hostRD};
-    staticVarsVisitor.TraverseFunctionDecl(
-        const_cast<FunctionDecl *>(FuncDefinition));
-    TypeHandlerVisitor Visitor{hostRD};
-    debug_stream() << "FuncDefinition: " << FuncDefinition << "\n";
-    Visitor.TraverseFunctionDecl(const_cast<FunctionDecl *>(FuncDefinition));
-
-    // This is order dependent
-    // TODO funcRes.members = ...
-    funcRes = memberHandlerVisitor.getResult();
-    funcRes.usedPrivateVarsCount += staticVarsVisitor.getResult();
-    funcRes.types.usedPrivateCount = Visitor.getResult();
-
-    assert(sourceManager);
-    funcRes.friendDeclLoc = friendDeclLoc;
-    funcRes.friendDeclLocStr = friendDeclLoc.printToString(*sourceManager);
-    funcRes.defLoc = FuncDefinition->getLocation();
-    funcRes.defLocStr = funcRes.defLoc.printToString(*sourceManager);
+    // The templates are analyzed on their patterns in pattern mode.
+    const bool approximate =
+        hostRD->isDependentContext() || FuncDefinition->isDependentContext();
+
+    if (plan.usage && !plan.exactUsage && !approximate) {
+      // The types are looked for only if no private member is used.
+      PrivateMemberFinder memberFinder{hostRD};
+      memberFinder.TraverseFunctionDecl(
+          const_cast<FunctionDecl *>(FuncDefinition));
+      funcRes.usedPrivateVarsCount = memberFinder.usedVar;
+      funcRes.usedPrivateMethodsCount = memberFinder.usedMethod;
+      if (!memberFinder.usedVar && !memberFinder.usedMethod) {
+        PrivateTypeFinder typeFinder{hostRD};
+        typeFinder.TraverseFunctionDecl(
+            const_cast<FunctionDecl *>(FuncDefinition));
+        funcRes.types.usedPrivateCount = typeFinder.usedType();
+      }
+    } else if (plan.usage) {
+      // The body is traversed only once, even if the function is evaluated
+      // for many befriending classes.
+      const FunctionAccessSummary &summary = ev.summaries.get(FuncDefinition);
+      FS_TRACE(Members, "FuncDefinition: " << FuncDefinition << "\n");
+      UsedTypesCounter typesCounter{hostRD};
+      for (QualType QT : summary.types) {
+        typesCounter.HandleType(QT);
+      }
+      for (const CXXConstructorDecl *CD : summary.constructors) {
+        typesCounter.HandleConstructor(CD);
+      }
+
+      // This is order dependent
+      // TODO funcRes.members = ...
+      funcRes = countUsedMembers(summary, hostRD, *classCounts.members,
+                                 approximate);
+      funcRes.types.usedPrivateCount = typesCounter.getResult();
+    }
+
+    funcRes.friendDeclLoc = friendDeclLocation;
+    if (plan.defLocations) {
+      funcRes.defLoc = locationOf(FuncDefinition->getLocation());
+    } else if (FuncDefinition->getLocation() == friendDeclLoc) {
+      funcRes.defLoc = funcRes.friendDeclLoc;
+    }
 
     // TODO use ClassCounts inside FuncResult
     funcRes.parentPrivateVarsCount = classCounts.privateVarsCount;
     funcRes.parentPrivateMethodsCount = classCounts.privateMethodsCount;
     funcRes.types.parentPrivateCount = classCounts.privateTypesCount;
     funcRes.parentClassInfo = classCounts.info;
+    funcRes.approximate = approximate;
 
     funcRes.diagName = getDiagName(FuncD);
 
     return FuncDefinition;
   }
 
-  static Result::ClassResult getClassInstantiationStats(
-      const CXXRecordDecl *hostRD, const CXXRecordDecl *friendCXXRD,
-      const SourceLocation &friendDeclLoc, const ClassCounts &classCounts,
-      const SourceManager *sourceManager) {
-
-    Result::ClassResult classResult;
+  // If sampled is set, the class is one of the sampled specializations of a
+  // class template.
+  FriendDeclResults::ClassInstance getClassInstantiationStats(
+      Evaluator &ev, const CXXRecordDecl *hostRD,
+      const CXXRecordDecl *friendCXXRD, const SourceLocation &friendDeclLoc,
+      const ClassCounts &classCounts, FriendDeclResults &results,
+      bool sampled = false) {
+
+    FriendDeclResults::ClassInstance instance;
+    instance.id = instanceId(results.friendDeclId, classCounts, friendCXXRD);
+    Result::ClassResult &classResult = instance.classResult;
     classResult.diagName = getDiagName(friendCXXRD);
-    classResult.defLocStr =
-        friendCXXRD->getLocation().printToString(*sourceManager);
-    classResult.friendDeclLocStr = friendDeclLoc.printToString(*sourceManager);
-
-    for (const auto &method : friendCXXRD->methods()) {
-      debug_stream() << "method: " << method << "\n";
+    if (plan.defLocations) {
+      classResult.defLoc = locationOf(friendCXXRD->getLocation());
+    }
+    classResult.friendDeclLoc = results.friendDeclLoc;
+    classResult.hostDiagName = classCounts.info->diagName;
+
+    // The stored member functions are not measured again.
+    auto addMemberFuncResult = [&](const FunctionDecl *FuncD,
+                                   bool memberSampled) {
+      const std::uint64_t id = instanceId(instance.id, classCounts, FuncD);
+      if (ev.skipStored && isStoredMemberFuncResult(id)) {
+        return;
+      }
       Result::FuncResult memberFuncRes;
-      auto res = getFuncStatistics(hostRD, method, friendDeclLoc, classCounts,
-                                   sourceManager, memberFuncRes);
+      auto res = getFuncStatistics(ev, hostRD, FuncD, friendDeclLoc,
+                                   results.friendDeclLoc, classCounts,
+                                   memberFuncRes);
       if (res) {
-        auto funcDiagName = memberFuncRes.diagName;
-        classResult.memberFuncResults.insert(
-            {{getDiagName(hostRD), funcDiagName}, std::move(memberFuncRes)});
+        memberFuncRes.sampled = memberSampled;
+        instance.memberFuncResults.emplace_back(id, std::move(memberFuncRes));
       }
+    };
+
+    for (const auto &method : friendCXXRD->methods()) {
+      FS_TRACE(Classes, "method: " << method << "\n");
+      addMemberFuncResult(method, sampled);
     }
 
     // Go over all the member function templates (methods templates).
@@ -645,141 +1821,141 @@ private:
     // non-template methods.
     for (const FunctionTemplateDecl *FTD :
          getFunctionTemplateRange(friendCXXRD)) {
-      for (const auto &Spec : FTD->specializations()) {
-        Result::FuncResult memberFuncRes;
-        auto res = getFuncStatistics(hostRD, Spec, friendDeclLoc, classCounts,
-                                     sourceManager, memberFuncRes);
-        if (res) {
-          auto funcDiagName = memberFuncRes.diagName;
-          classResult.memberFuncResults.insert(
-              {{getDiagName(hostRD), funcDiagName}, std::move(memberFuncRes)});
-        }
+      bool specsSampled = false;
+      for (const auto &Spec : functionsOf(FTD, results, specsSampled)) {
+        addMemberFuncResult(Spec, sampled || specsSampled);
       }
     }
 
-    return classResult;
+    return instance;
   }
 
-  void handleFriendClassTemplate(const CXXRecordDecl *hostRD,
+  // Sets the id of the friend declaration.
+  void identify(FriendDeclResults &results, SourceLocation friendDeclLoc) {
+    results.friendDeclLoc = locationOf(friendDeclLoc);
+    results.friendDeclId = results.friendDeclLoc.hash();
+  }
+
+  void handleFriendClassTemplate(Evaluator &ev, const CXXRecordDecl *hostRD,
                                  const ClassTemplateDecl *CTD,
                                  const SourceLocation &friendDeclLoc,
-                                 const ClassCounts &classCounts) {
-
-    std::string friendDeclLocStr = friendDeclLoc.printToString(*sourceManager);
-    Result::ClassResultsForFriendDecl &classResultsForFriendDecl =
-        result.ClassResults[friendDeclLocStr];
-    auto hostId = getDiagName(hostRD);
-    for (const ClassTemplateSpecializationDecl *CTSD : CTD->specializations()) {
-      debug_stream() << "CTSD: " << CTSD << "\n";
-      const CXXRecordDecl *CXXRD = dyn_cast<CXXRecordDecl>(CTSD);
-      debug_stream() << "CXXRD: " << CXXRD << "\n";
-      Result::ClassResult classResult = getClassInstantiationStats(
-          hostRD, CXXRD, friendDeclLoc, classCounts, sourceManager);
-      insertIntoClassResultsForFriendDecl(hostId, std::move(classResult),
-                                          classResultsForFriendDecl);
+                                 const ClassCounts &classCounts,
+                                 FriendDeclResults &results) {
+
+    identify(results, friendDeclLoc);
+    results.isClass = true;
+    bool sampled = false;
+    std::vector<const CXXRecordDecl *> classes;
+    if (patternMode) {
+      classes.push_back(CTD->getTemplatedDecl());
+    } else {
+      for (const ClassTemplateSpecializationDecl *CTSD :
+           specializationsOf<ClassTemplateSpecializationDecl>(
+               CTD, CTD->specializations(), results, sampled)) {
+        FS_TRACE(Classes, "CTSD: " << CTSD << "\n");
+        classes.push_back(CTSD);
+      }
+    }
+    for (const CXXRecordDecl *CXXRD : classes) {
+      FS_TRACE(Classes, "CXXRD: " << CXXRD << "\n");
+      results.classResults.push_back(getClassInstantiationStats(
+          ev, hostRD, CXXRD, friendDeclLoc, classCounts, results, sampled));
       NestedClassVisitor nestedClassVisitor{
-          hostRD,      CXXRD,         friendDeclLoc,
-          classCounts, sourceManager, classResultsForFriendDecl};
+          hostRD, CXXRD, friendDeclLoc, classCounts, ev, *this, results};
       nestedClassVisitor.TraverseCXXRecordDecl(
           const_cast<CXXRecordDecl *>(CXXRD));
     }
   }
 
-  void handleFriendClass(const CXXRecordDecl *hostRD, const FriendDecl *FD,
+  void handleFriendClass(Evaluator &ev, const CXXRecordDecl *hostRD,
+                         const FriendDecl *FD,
                          const SourceLocation &friendDeclLoc,
                          const ClassCounts &classCounts,
-                         const MatchFinder::MatchResult &Result) {
-    debug_stream() << "handleFriendClass"
-                   << "\n";
-    std::string friendDeclLocStr = friendDeclLoc.printToString(*sourceManager);
-    auto it = result.ClassResults.find(friendDeclLocStr);
-    if (it != std::end(result.ClassResults)) {
+                         FriendDeclResults &results) {
+    FS_TRACE(Classes, "handleFriendClass"
+                          << "\n");
+    identify(results, friendDeclLoc);
+    results.dropIfSeen = true;
+    if (ev.skipStored && hasClassResults(results.friendDeclId)) {
       return;
     }
 
     TypeSourceInfo *TInfo = FD->getFriendType();
     QualType QT = TInfo->getType();
-    if (debug) {
+    if (FS_TRACING(Classes)) {
       QT->dump();
     }
     RecordDecl *friendRD = getRecordDecl(QT);
     if (!friendRD) {
       return;
     }
-    debug_stream() << "friendRD: " << friendRD << "\n";
+    FS_TRACE(Classes, "friendRD: " << friendRD << "\n");
 
     CXXRecordDecl *friendCXXRD = dyn_cast<CXXRecordDecl>(friendRD);
     if (!friendCXXRD) {
       return;
     }
 
-    Result::ClassResult classResult = getClassInstantiationStats(
-        hostRD, friendCXXRD, friendDeclLoc, classCounts, sourceManager);
-    Result::ClassResultsForFriendDecl &classResultsForFriendDecl =
-        result.ClassResults[friendDeclLocStr];
-    auto hostId = getDiagName(hostRD);
-    insertIntoClassResultsForFriendDecl(hostId, std::move(classResult),
-                                        classResultsForFriendDecl);
+    results.isClass = true;
+    results.classResults.push_back(getClassInstantiationStats(
+        ev, hostRD, friendCXXRD, friendDeclLoc, classCounts, results));
 
     NestedClassVisitor nestedClassVisitor{
-        hostRD,      friendCXXRD,   friendDeclLoc,
-        classCounts, sourceManager, classResultsForFriendDecl};
+        hostRD, friendCXXRD, friendDeclLoc, classCounts, ev, *this, results};
     nestedClassVisitor.TraverseCXXRecordDecl(friendCXXRD);
   }
 
-  void handleFriendFunction(const CXXRecordDecl *hostRD, const FriendDecl *FD,
+  void handleFriendFunction(Evaluator &ev, const CXXRecordDecl *hostRD,
+                            const FriendDecl *FD,
                             const SourceLocation &friendDeclLoc,
                             const ClassCounts &classCounts,
-                            const MatchFinder::MatchResult &Result) {
+                            FriendDeclResults &results) {
 
-    std::string friendDeclLocStr = friendDeclLoc.printToString(*sourceManager);
-    auto it = result.FuncResults.find(friendDeclLocStr);
+    identify(results, friendDeclLoc);
 
     NamedDecl *ND = FD->getFriendDecl();
     if (!ND) {
       return;
     }
 
-    auto hostId = getDiagName(hostRD);
-
-    auto isDuplicate = [hostId, it, this](const FunctionDecl *FD) {
-      auto diagName = getDiagName(FD);
-      auto key = std::make_pair(hostId, diagName);
-      if (it != std::end(result.FuncResults)) {
-        debug_stream() << "diagName: " << diagName << "\n";
-        auto &funcResultsPerSrcLoc = it->second;
-        if (funcResultsPerSrcLoc.count(key) > 0) {
-          debug_stream() << "DUPLICATE: " << hostId << " " << diagName
-                         << "\n";
-          return true;
-        }
-      }
-      return false;
-    };
-
-    Result::FuncResult funcRes;
-
-    auto handleFuncD =
-        [hostRD, &friendDeclLoc, &friendDeclLocStr, &classCounts, &isDuplicate,
-         hostId, this, &funcRes](FunctionDecl *FuncD) {
-      if (isDuplicate(FuncD))
+    // Set if FuncD is one of the sampled specializations of a template.
+    bool sampled = false;
+
+    auto handleFuncD = [&ev, hostRD, &friendDeclLoc, &classCounts, this,
+                        &results, &sampled](FunctionDecl *FuncD) {
+      const std::uint64_t id =
+          instanceId(results.friendDeclId, classCounts, FuncD);
+      FS_TRACE(Dedupe, "diagName: " << getDiagName(FuncD) << "\n");
+      // Stored instances are not measured again. commit checks the
+      // duplicates anyway.
+      if (ev.skipStored && isDuplicateFuncResult(id)) {
         return;
-      auto FuncDefinition = getFuncStatistics(
-          hostRD, FuncD, friendDeclLoc, classCounts, sourceManager, funcRes);
+      }
+      Result::FuncResult funcRes;
+      auto FuncDefinition =
+          getFuncStatistics(ev, hostRD, FuncD, friendDeclLoc,
+                            results.friendDeclLoc, classCounts, funcRes);
       if (FuncDefinition) {
-        auto diagName = getDiagName(FuncD);
-        auto &funcResultsPerSrcLoc = result.FuncResults[friendDeclLocStr];
-        auto key = std::make_pair(hostId, diagName);
-        funcResultsPerSrcLoc.insert({key, funcRes});
-        debug_stream() << "INSERT function: " << hostId << " "
-                       << diagName << "\n";
+        funcRes.sampled = sampled;
+        results.funcResults.emplace_back(id, std::move(funcRes));
       }
     };
 
     if (FunctionDecl *FuncD = dyn_cast<FunctionDecl>(ND)) {
-      handleFuncD(FuncD);
+      // In the pattern of a class template a specialization of a function
+      // template (e.g. friend void func<T>(A &)) is dependent, it has no
+      // body. The pattern of the function template is analyzed instead.
+      const DependentFunctionTemplateSpecializationInfo *info =
+          patternMode ? FuncD->getDependentSpecializationInfo() : nullptr;
+      if (info) {
+        for (unsigned i = 0; i < info->getNumTemplates(); ++i) {
+          handleFuncD(info->getTemplate(i)->getTemplatedDecl());
+        }
+      } else {
+        handleFuncD(FuncD);
+      }
     } else if (FunctionTemplateDecl *FTD = dyn_cast<FunctionTemplateDecl>(ND)) {
-      for (FunctionDecl *spec : FTD->specializations()) {
+      for (FunctionDecl *spec : functionsOf(FTD, results, sampled)) {
 
         // Note,
         // Internally clang uses the same class to represent a function template
@@ -805,8 +1981,63 @@ private:
       }
     }
     // We want to handle only the instantiatiions! Therefore we do not
-    // investigate the primary template.
-    // handleFuncD(FTD->getTemplatedDecl());
+    // investigate the primary template, except in pattern mode (see
+    // functionsOf).
+  }
+};
+
+// Finds the friend declarations without the generic MatchFinder: no parent
+// map is built and no matchers are tried on the nodes. Only the classes
+// which have friends are inspected, their friend declarations are handed
+// over to the FriendHandler in declaration order, the same way as the
+// FriendMatcher would do.
+class FriendIndexer : public ASTConsumer,
+                      public RecursiveASTVisitor<FriendIndexer> {
+  FriendHandler &handler;
+  SourceManager *sourceManager = nullptr;
+
+public:
+  explicit FriendIndexer(FriendHandler &handler) : handler(handler) {}
+
+  // The friend declarations of template instantiations are needed too.
+  bool shouldVisitTemplateInstantiations() const { return true; }
+  bool shouldVisitImplicitCode() const { return true; }
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    sourceManager = &Context.getSourceManager();
+    handler.onStartOfTranslationUnit();
+    TraverseDecl(Context.getTranslationUnitDecl());
+    handler.onEndOfTranslationUnit();
+  }
+
+  // The namespaces without befriending classes in the scope of the name
+  // filter are skipped.
+  bool TraverseNamespaceDecl(NamespaceDecl *ND) {
+    if (!handler.mayContainHosts(ND)) {
+      return true;
+    }
+    return RecursiveASTVisitor<FriendIndexer>::TraverseNamespaceDecl(ND);
+  }
+
+  bool VisitCXXRecordDecl(CXXRecordDecl *RD) {
+    if (!RD->hasDefinition() || !RD->hasFriends()) {
+      return true;
+    }
+    // friend_begin() lists the friends in reverse order.
+    for (const Decl *D : RD->decls()) {
+      if (const FriendDecl *FD = dyn_cast<FriendDecl>(D)) {
+        handler.handleFriendDecl(RD, FD, *sourceManager);
+      }
+    }
+    return true;
   }
 };
 
+// Creates the FriendIndexer for each translation unit, to be used with
+// newFrontendActionFactory.
+struct FriendIndexerFactory {
+  FriendHandler &handler;
+  std::unique_ptr<ASTConsumer> newASTConsumer() {
+    return std::unique_ptr<ASTConsumer>(new FriendIndexer(handler));
+  }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <map>
+#include <utility>
+#include <vector>
+#include "DataCrunching.hpp"
+#include "DataIO.hpp"
+
+// Differences of two results, e.g. of two versions of the same library.
+// Source locations usually change between versions, therefore the instances
+// are matched by their names: friend function instances by the befriending
+// class and the function, member functions of friend classes additionally by
+// the befriending class and the friend class. The instances with the same
+// names (e.g. of different friend declarations) are paired in the order of
+// the output.
+struct ResultDiff {
+  struct Instance {
+    Result::ClassResultKey classKey; // Empty for friend function instances.
+    Result::FuncResultKey key;
+    const Result::FuncResult *oldRes = nullptr;
+    const Result::FuncResult *newRes = nullptr;
+  };
+  struct Changes {
+    std::vector<Instance> added;
+    std::vector<Instance> removed;
+    // Instances which are present in both results with different counts.
+    std::vector<Instance> changed;
+  };
+  Changes funcs;
+  Changes classFuncs;
+};
+
+// Every instance of the result, the instances with the same names are in the
+// order of the output (a multimap inserts after the equal keys).
+using InstanceIndex =
+    std::multimap<std::pair<Result::ClassResultKey, Result::FuncResultKey>,
+                  const Result::FuncResult *>;
+
+inline Result::FuncResultKey keyOf(const Result::FuncResult &funcRes) {
+  return {funcRes.hostDiagName(), funcRes.diagName};
+}
+
+inline InstanceIndex indexFuncInstances(const Result &result) {
+  InstanceIndex index;
+  for (const Result::FuncDecl *friendDecl : sortedFuncDecls(result)) {
+    for (const Result::FuncResult *funcRes : sortedFuncResults(*friendDecl)) {
+      index.insert({{{}, keyOf(*funcRes)}, funcRes});
+    }
+  }
+  return index;
+}
+
+inline InstanceIndex indexClassFuncInstances(const Result &result) {
+  InstanceIndex index;
+  for (const Result::ClassDecl *friendDecl : sortedClassDecls(result)) {
+    for (const Result::ClassResult *classResult :
+         sortedClassResults(*friendDecl)) {
+      const Result::ClassResultKey classKey{classResult->hostDiagName,
+                                            classResult->diagName};
+      for (const Result::FuncResult *funcRes :
+           sortedFuncResults(*classResult)) {
+        index.insert({{classKey, keyOf(*funcRes)}, funcRes});
+      }
+    }
+  }
+  return index;
+}
+
+// The surplus instances of a name are removed or added.
+inline ResultDiff::Changes diffInstances(const InstanceIndex &oldIndex,
+                                         const InstanceIndex &newIndex) {
+  ResultDiff::Changes changes;
+  auto oldIt = oldIndex.begin();
+  auto newIt = newIndex.begin();
+  auto makeInstance = [](const InstanceIndex::value_type &v) {
+    ResultDiff::Instance instance;
+    instance.classKey = v.first.first;
+    instance.key = v.first.second;
+    return instance;
+  };
+  while (oldIt != oldIndex.end() || newIt != newIndex.end()) {
+    if (newIt == newIndex.end() ||
+        (oldIt != oldIndex.end() && oldIt->first < newIt->first)) {
+      auto instance = makeInstance(*oldIt);
+      instance.oldRes = oldIt->second;
+      changes.removed.push_back(instance);
+      ++oldIt;
+    } else if (oldIt == oldIndex.end() || newIt->first < oldIt->first) {
+      auto instance = makeInstance(*newIt);
+      instance.newRes = newIt->second;
+      changes.added.push_back(instance);
+      ++newIt;
+    } else {
+      if (!sameCounts(*oldIt->second, *newIt->second) ||
+          oldIt->second->multiplicity != newIt->second->multiplicity) {
+        auto instance = makeInstance(*newIt);
+        instance.oldRes = oldIt->second;
+        instance.newRes = newIt->second;
+        changes.changed.push_back(instance);
+      }
+      ++oldIt;
+      ++newIt;
+    }
+  }
+  return changes;
+}
+
+inline ResultDiff diffResults(const Result &oldResult,
+                              const Result &newResult) {
+  ResultDiff diff;
+  diff.funcs = diffInstances(indexFuncInstances(oldResult),
+                             indexFuncInstances(newResult));
+  diff.classFuncs = diffInstances(indexClassFuncInstances(oldResult),
+                                  indexClassFuncInstances(newResult));
+  return diff;
+}
+
+// The distributions of a result which are compared in a diff. Every stored
+// entry is counted, weighted by its multiplicity, like in the statistics of
+// the tool (see DataTraversal).
+// The summary of the new result is derived from the summary of the old one
+// by applying the diff, instead of summarizing the new result too. Both
+// results are still read and indexed for the diff, see StatisticsState for
+// statistics which are updated across runs.
+struct ResultSummary {
+  struct Part {
+    Average average;
+    PercentageDistribution percentageDist;
+    NumberOfUsedPrivsDistribution usedPrivsDistribution;
+    void operator()(const Result::FuncResult &funcRes) {
+      if (!SelfDiagnostics{}(funcRes)) {
+        return;
+      }
+      average(funcRes, funcRes.multiplicity);
+      percentageDist(funcRes, funcRes.multiplicity);
+      usedPrivsDistribution(funcRes, funcRes.multiplicity);
+    }
+    // Removes an entry which was added before.
+    void remove(const Result::FuncResult &funcRes) {
+      if (!SelfDiagnostics{}(funcRes)) {
+        return;
+      }
+      average.remove(funcRes, funcRes.multiplicity);
+      percentageDist.remove(funcRes, funcRes.multiplicity);
+      usedPrivsDistribution.remove(funcRes, funcRes.multiplicity);
+    }
+    void apply(const ResultDiff::Changes &changes) {
+      for (const auto &instance : changes.removed) {
+        remove(*instance.oldRes);
+      }
+      for (const auto &instance : changes.changed) {
+        remove(*instance.oldRes);
+        (*this)(*instance.newRes);
+      }
+      for (const auto &instance : changes.added) {
+        (*this)(*instance.newRes);
+      }
+      percentageDist.flush();
+    }
+  };
+  Part func;
+  Part clazz;
+  explicit ResultSummary(const Result &result) {
+    for (const Result::FuncDecl *friendDecl : sortedFuncDecls(result)) {
+      for (const Result::FuncResult *funcRes :
+           sortedFuncResults(*friendDecl)) {
+        func(*funcRes);
+      }
+    }
+    for (const Result::ClassDecl *friendDecl : sortedClassDecls(result)) {
+      for (const Result::ClassResult *classResult :
+           sortedClassResults(*friendDecl)) {
+        for (const Result::FuncResult *funcRes :
+             sortedFuncResults(*classResult)) {
+          clazz(*funcRes);
+        }
+      }
+    }
+    func.percentageDist.flush();
+    clazz.percentageDist.flush();
+  }
+  // Turns the summary of the old result of the diff into the summary of the
+  // new result.
+  void apply(const ResultDiff &diff) {
+    func.apply(diff.funcs);
+    clazz.apply(diff.classFuncs);
+  }
+};
+
+inline void printInstance(const ResultDiff::Instance &instance,
+                          raw_ostream &os) {
+  if (!instance.classKey.first.empty()) {
+    os << "friend class: " << instance.classKey.second << "\n";
+  }
+  os << "befriending class: " << instance.key.first << "\n"
+     << "friendly function: " << instance.key.second << "\n";
+}
+
+inline void printCountChange(const char *name, int oldCount, int newCount,
+                             raw_ostream &os) {
+  if (oldCount != newCount) {
+    os << name << ": " << oldCount << " -> " << newCount << "\n";
+  }
+}
+
+inline void printChanges(const char *what, const ResultDiff::Changes &changes,
+                         raw_ostream &os) {
+  os << "########## Added " << what << " ##########\n";
+  for (const auto &instance : changes.added) {
+    printInstance(instance, os);
+    print(*instance.newRes, os);
+  }
+  os << "########## Removed " << what << " ##########\n";
+  for (const auto &instance : changes.removed) {
+    printInstance(instance, os);
+    print(*instance.oldRes, os);
+  }
+  os << "########## Changed " << what << " ##########\n";
+  for (const auto &instance : changes.changed) {
+    printInstance(instance, os);
+    const auto &o = *instance.oldRes;
+    const auto &n = *instance.newRes;
+    printCountChange("usedPrivateVarsCount", o.usedPrivateVarsCount,
+                     n.usedPrivateVarsCount, os);
+    printCountChange("parentPrivateVarsCount", o.parentPrivateVarsCount,
+                     n.parentPrivateVarsCount, os);
+    printCountChange("usedPrivateMethodsCount", o.usedPrivateMethodsCount,
+                     n.usedPrivateMethodsCount, os);
+    printCountChange("parentPrivateMethodsCount", o.parentPrivateMethodsCount,
+                     n.parentPrivateMethodsCount, os);
+    printCountChange("types.usedPrivateCount", o.types.usedPrivateCount,
+                     n.types.usedPrivateCount, os);
+    printCountChange("types.parentPrivateCount", o.types.parentPrivateCount,
+                     n.types.parentPrivateCount, os);
+    printCountChange("multiplicity", o.multiplicity, n.multiplicity, os);
+  }
+}
+
+// Prints "key old new delta" for every key which is present in any of the
+// distributions.
+template <typename Key>
+void printDistributionDiff(const std::map<Key, int> &oldDist,
+                           const std::map<Key, int> &newDist,
+                           raw_ostream &os) {
+  std::map<Key, std::pair<int, int>> both;
+  for (const auto &v : oldDist) {
+    both[v.first].first = v.second;
+  }
+  for (const auto &v : newDist) {
+    both[v.first].second = v.second;
+  }
+  for (const auto &v : both) {
+    os << v.first << "\t" << v.second.first << "\t" << v.second.second << "\t"
+       << v.second.second - v.second.first << "\n";
+  }
+}
+
+inline std::map<std::pair<int, int>, int>
+nonEmptyBuckets(const UsageHistogram &dist) {
+  std::map<std::pair<int, int>, int> buckets;
+  for (std::size_t i = 0; i < dist.size(); ++i) {
+    if (dist.count(i)) {
+      buckets[dist.interval(i)] = dist.count(i);
+    }
+  }
+  return buckets;
+}
+
+inline void printSummaryDiff(const char *what,
+                             const ResultSummary::Part &oldPart,
+                             const ResultSummary::Part &newPart,
+                             raw_ostream &os) {
+  os << "Number of sane " << what << " instances: " << oldPart.average.num
+     << " -> " << newPart.average.num << "\n";
+  os << "Average usage of priv entities (vars, funcs, types) in " << what
+     << ": " << oldPart.average.get() * 100 << " % -> "
+     << newPart.average.get() * 100 << " %\n";
+  os << "Usage of priv entities (in percentage) distribution in " << what
+     << " (interval, old, new, delta):\n";
+  printDistributionDiff(nonEmptyBuckets(oldPart.percentageDist.get()),
+                        nonEmptyBuckets(newPart.percentageDist.get()), os);
+  os << "Number of used priv entities distribution in " << what
+     << " (count, old, new, delta):\n";
+  printDistributionDiff(oldPart.usedPrivsDistribution.dist.get(),
+                        newPart.usedPrivsDistribution.dist.get(), os);
+}
+
+inline void printDiff(const Result &oldResult, const Result &newResult,
+                      raw_ostream &os = llvm::outs()) {
+  ResultDiff diff = diffResults(oldResult, newResult);
+  printChanges("friend function instances", diff.funcs, os);
+  printChanges("friend class member function instances", diff.classFuncs, os);
+
+  os << "########## Diff statistics ##########\n";
+  auto printCounts = [&os](const char *what,
+                           const ResultDiff::Changes &changes) {
+    os << what << " added: " << changes.added.size()
+       << ", removed: " << changes.removed.size()
+       << ", changed: " << changes.changed.size() << "\n";
+  };
+  printCounts("Friend function instances", diff.funcs);
+  printCounts("Friend class member function instances", diff.classFuncs);
+
+  ResultSummary oldSummary(oldResult);
+  ResultSummary newSummary = oldSummary;
+  newSummary.apply(diff);
+  printSummaryDiff("friend functions", oldSummary.func, newSummary.func, os);
+  printSummaryDiff("friend classes", oldSummary.clazz, newSummary.clazz, os);
+}
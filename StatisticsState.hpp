@@ -0,0 +1,587 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "llvm/Support/Format.h"
+#include "DataCrunching.hpp"
+#include "DataIO.hpp"
+
+// The statistics of the friend instances kept across runs, so that when
+// only some of the translation units are analyzed again, the statistics are
+// updated instead of being computed again from all the instances.
+// The state holds the accumulators and the instances contributed by each
+// translation unit. An instance contributed by more translation units (e.g.
+// one in a header) is counted once, as long as any of them contributes it.
+// The results of a friend class declaration which the analysis keeps only
+// from the first translation unit which sees it (see
+// FriendDeclResults::dropIfSeen) are counted only for the first of its
+// translation units, in the order in which they were added to the state.
+// Replacing the contribution of a translation unit takes time proportional
+// to the size of its old and new contributions (and of the counted results
+// of its friend class declarations of this kind). Reading and writing the
+// state is linear in its size.
+class StatisticsState {
+public:
+  // The instance as it is counted in the statistics, without its names and
+  // locations.
+  struct Instance {
+    Result::FuncResult funcRes;
+    // MeyersCandidate needs the names and the locations, so it is evaluated
+    // when the instance is contributed.
+    bool meyersCandidate = false;
+    // The number of translation units which contribute the instance.
+    int refs = 0;
+  };
+
+  // The accumulators of the statistics which are printed by
+  // DataTraversal::conclusion. Unlike DataTraversal::Accumulators, all of
+  // them are invertible, e.g. the quantiles are exact.
+  struct Part {
+    explicit Part(int bucketWidth) : percentageDist(bucketWidth) {}
+    Average average;
+    ExactUsageQuantiles quantiles;
+    PercentageDistribution percentageDist;
+    NumberOfUsedPrivsDistribution usedPrivsDistribution;
+    // Only the count is used, see Instance::meyersCandidate.
+    MeyersCandidate meyersCandidate;
+
+    // The entries which fail the self diagnostics are skipped, like in the
+    // traversal.
+    void add(const Instance &instance) {
+      const Result::FuncResult &funcRes = instance.funcRes;
+      if (!SelfDiagnostics{}(funcRes)) {
+        return;
+      }
+      const int weight = funcRes.multiplicity;
+      average(funcRes, weight);
+      quantiles(funcRes, weight);
+      percentageDist(funcRes, weight);
+      usedPrivsDistribution(funcRes, weight);
+      if (instance.meyersCandidate) {
+        meyersCandidate.count += weight;
+      }
+    }
+    // Removes an instance which was added before.
+    void remove(const Instance &instance) {
+      const Result::FuncResult &funcRes = instance.funcRes;
+      if (!SelfDiagnostics{}(funcRes)) {
+        return;
+      }
+      const int weight = funcRes.multiplicity;
+      average.remove(funcRes, weight);
+      quantiles.remove(funcRes, weight);
+      percentageDist.remove(funcRes, weight);
+      usedPrivsDistribution.remove(funcRes, weight);
+      if (instance.meyersCandidate) {
+        meyersCandidate.count -= weight;
+      }
+    }
+  };
+
+  explicit StatisticsState(int bucketWidth = 1)
+      : func(bucketWidth), clazz(bucketWidth) {}
+  // firstSeenUnits points into units, the moved nodes stay the same.
+  StatisticsState(const StatisticsState &) = delete;
+  StatisticsState &operator=(const StatisticsState &) = delete;
+  StatisticsState(StatisticsState &&) = default;
+  StatisticsState &operator=(StatisticsState &&) = default;
+
+  int getBucketWidth() const { return func.percentageDist.getWidth(); }
+  // An option of the analysis which changes the measured instances, e.g.
+  // a filter. The state is only updated by runs with the same options.
+  void setOption(const std::string &name, const std::string &value) {
+    options[name] = value;
+  }
+  // The number of the translation units which contribute any instance.
+  std::size_t numUnits() const { return units.size(); }
+
+  // Replaces the contribution of the translation unit. The instances which
+  // are not contributed by any translation unit any more are removed from
+  // the accumulators and the new instances are added. An instance which is
+  // contributed by other translation units too takes its new counts. A new
+  // translation unit comes after the units of the state, one which is
+  // replaced keeps its place.
+  void replace(const std::string &unit, const Contribution &contribution) {
+    auto inserted = units.insert({unit, Unit{}});
+    Unit &ids = inserted.first->second;
+    if (inserted.second) {
+      ids.order = nextOrder++;
+    }
+    release(ids.funcs, funcInstances, func);
+    release(ids.classFuncs, classFuncInstances, clazz);
+    ids.funcs = acquire(contribution.funcs, true, funcInstances, func);
+    ids.classFuncs =
+        acquire(contribution.classFuncs, false, classFuncInstances, clazz);
+    replaceFirstSeen(ids, contribution.firstSeenClassFuncs);
+    if (ids.funcs.empty() && ids.classFuncs.empty() &&
+        ids.firstSeen.empty()) {
+      units.erase(inserted.first);
+    }
+    func.percentageDist.flush();
+    clazz.percentageDist.flush();
+  }
+
+  void write(raw_ostream &os) const;
+  bool read(llvm::StringRef content, std::string &error);
+
+  // The friend function instances.
+  Part func;
+  // The member function instances of friend classes.
+  Part clazz;
+
+private:
+  using Instances = std::unordered_map<std::uint64_t, Instance>;
+  // The ids of the instances contributed by a translation unit.
+  struct Unit {
+    // The place of the unit in the state, see firstSeenUnits.
+    long order = 0;
+    std::vector<std::uint64_t> funcs;
+    std::vector<std::uint64_t> classFuncs;
+    // The member function instances (only their counts) of the friend class
+    // declarations which are counted for their first unit only, by the ids
+    // of the declarations. See Contribution::firstSeenClassFuncs.
+    std::map<std::uint64_t, Contribution::Instances> firstSeen;
+  };
+  // The units which contribute a friend class declaration of
+  // Unit::firstSeen, by their order. The instances of the first one are
+  // the ones in the accumulators.
+  using FirstSeenUnits = std::map<long, const Unit *>;
+
+  static void release(const std::vector<std::uint64_t> &ids,
+                      Instances &instances, Part &part) {
+    for (std::uint64_t id : ids) {
+      auto it = instances.find(id);
+      assert(it != instances.end() && it->second.refs > 0);
+      if (--it->second.refs == 0) {
+        part.remove(it->second);
+        instances.erase(it);
+      }
+    }
+  }
+
+  // Returns the ids of the contributed instances, each once.
+  static std::vector<std::uint64_t>
+  acquire(const Contribution::Instances &contributed, bool isFunc,
+          Instances &instances, Part &part) {
+    std::vector<std::uint64_t> ids;
+    FlatIdSet seen;
+    for (const auto &v : contributed) {
+      if (!seen.insert(v.first)) {
+        continue;
+      }
+      ids.push_back(v.first);
+      Instance &instance = instances[v.first];
+      if (instance.refs++ > 0) {
+        part.remove(instance);
+      }
+      instance.funcRes = countsOf(v.second);
+      instance.meyersCandidate = isFunc && MeyersCandidate{}(v.second);
+      part.add(instance);
+    }
+    return ids;
+  }
+
+  // Replaces the friend class declarations of Unit::firstSeen. The counted
+  // instances of the affected declarations are released, then the ones of
+  // their (possibly new) first units are acquired.
+  void replaceFirstSeen(
+      Unit &unit,
+      const std::vector<std::pair<std::uint64_t, Contribution::Instances>>
+          &contributed) {
+    std::map<std::uint64_t, Contribution::Instances> firstSeen;
+    for (const auto &decl : contributed) {
+      // A file might be compiled by more commands, the first one counts.
+      auto inserted = firstSeen.insert({decl.first, {}});
+      if (!inserted.second) {
+        continue;
+      }
+      FlatIdSet seen;
+      for (const auto &v : decl.second) {
+        if (seen.insert(v.first)) {
+          inserted.first->second.emplace_back(v.first, countsOf(v.second));
+        }
+      }
+    }
+    std::vector<std::uint64_t> affected;
+    for (const auto &v : unit.firstSeen) {
+      affected.push_back(v.first);
+    }
+    for (const auto &v : firstSeen) {
+      if (!unit.firstSeen.count(v.first)) {
+        affected.push_back(v.first);
+      }
+    }
+    for (std::uint64_t declId : affected) {
+      FirstSeenUnits &declUnits = firstSeenUnits[declId];
+      if (!declUnits.empty()) {
+        const Unit &first = *declUnits.begin()->second;
+        release(idsOf(first.firstSeen.at(declId)), classFuncInstances, clazz);
+      }
+      declUnits.erase(unit.order);
+    }
+    unit.firstSeen = std::move(firstSeen);
+    for (const auto &v : unit.firstSeen) {
+      firstSeenUnits[v.first][unit.order] = &unit;
+    }
+    for (std::uint64_t declId : affected) {
+      auto it = firstSeenUnits.find(declId);
+      if (it->second.empty()) {
+        firstSeenUnits.erase(it);
+        continue;
+      }
+      const Unit &first = *it->second.begin()->second;
+      acquire(first.firstSeen.at(declId), false, classFuncInstances, clazz);
+    }
+  }
+
+  static std::vector<std::uint64_t>
+  idsOf(const Contribution::Instances &instances) {
+    std::vector<std::uint64_t> ids;
+    ids.reserve(instances.size());
+    for (const auto &v : instances) {
+      ids.push_back(v.first);
+    }
+    return ids;
+  }
+
+  static Result::FuncResult countsOf(const Result::FuncResult &funcRes) {
+    Result::FuncResult counts;
+    counts.usedPrivateVarsCount = funcRes.usedPrivateVarsCount;
+    counts.parentPrivateVarsCount = funcRes.parentPrivateVarsCount;
+    counts.usedPrivateMethodsCount = funcRes.usedPrivateMethodsCount;
+    counts.parentPrivateMethodsCount = funcRes.parentPrivateMethodsCount;
+    counts.types = funcRes.types;
+    counts.multiplicity = funcRes.multiplicity;
+    return counts;
+  }
+
+  static void writeCounts(raw_ostream &os, const Result::FuncResult &counts);
+  static bool readCounts(const llvm::SmallVectorImpl<llvm::StringRef> &fields,
+                         std::size_t first, Result::FuncResult &counts);
+  static void writePart(raw_ostream &os, const char *kind, const Part &part);
+  static void writeInstances(raw_ostream &os, const char *kind,
+                             const Instances &instances);
+  // The X and x lines belong to the unit and to the declaration of the
+  // lines before them.
+  bool readLine(const llvm::SmallVectorImpl<llvm::StringRef> &fields,
+                Unit *&unit, Contribution::Instances *&firstSeen);
+
+  Instances funcInstances;
+  Instances classFuncInstances;
+  // By the main files of the translation units.
+  std::map<std::string, Unit> units;
+  long nextOrder = 0;
+  // By their names, without the leading dash.
+  std::map<std::string, std::string> options;
+  // By the ids of the friend class declarations.
+  std::unordered_map<std::uint64_t, FirstSeenUnits> firstSeenUnits;
+};
+
+// ========================================================================== //
+// Persisting the state.
+// The state is written as lines of tab separated fields, like the result
+// store (see writeResult). The first field tells the kind of the line:
+//   W <bucketWidth>                                  percentage bucket width
+//   O <name> <value>                                 option, see setOption
+//   A <part> <sum> <num> <numZeroDenom> <meyersCandidates>
+//                                                    averages and counts
+//   H <part> <bucket> <count>                        percentage histogram
+//   P <part> <usedPrivs> <count>                     used privs distribution
+//   Q <part> <usage> <count>                         usage quantiles
+//   i <part> <id> <counts> <multiplicity> <meyersCandidate> <refs>
+//                                                    instance
+//   U <unit> <function ids> <member function ids>    translation unit
+//   X <declId>                                       first seen friend
+//                                                    class declaration
+//   x <id> <counts> <multiplicity>                   its member function
+// where <part> is f for the friend functions and m for the member functions
+// of friend classes, <counts> is the six counts of a Result::FuncResult and
+// the ids are separated by spaces. The units are in their order, each one
+// is followed by its first seen friend class declarations (see
+// Unit::firstSeen), each of those by its instances.
+
+const char *const statisticsStateHeader = "friend-stats-state 2";
+
+inline void StatisticsState::writeCounts(raw_ostream &os,
+                                         const Result::FuncResult &counts) {
+  os << counts.usedPrivateVarsCount << "\t" << counts.parentPrivateVarsCount
+     << "\t" << counts.usedPrivateMethodsCount << "\t"
+     << counts.parentPrivateMethodsCount << "\t"
+     << counts.types.usedPrivateCount << "\t"
+     << counts.types.parentPrivateCount << "\t" << counts.multiplicity;
+}
+
+// Reads the six counts and the multiplicity from the fields from first.
+inline bool StatisticsState::readCounts(
+    const llvm::SmallVectorImpl<llvm::StringRef> &fields, std::size_t first,
+    Result::FuncResult &counts) {
+  int *values[] = {&counts.usedPrivateVarsCount,
+                   &counts.parentPrivateVarsCount,
+                   &counts.usedPrivateMethodsCount,
+                   &counts.parentPrivateMethodsCount,
+                   &counts.types.usedPrivateCount,
+                   &counts.types.parentPrivateCount,
+                   &counts.multiplicity};
+  for (std::size_t i = 0; i < 7; ++i) {
+    if (fields[first + i].getAsInteger(10, *values[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void StatisticsState::writePart(raw_ostream &os, const char *kind,
+                                       const Part &part) {
+  os << "A\t" << kind << "\t" << llvm::format("%.17g", part.average.sum)
+     << "\t" << part.average.num << "\t" << part.average.numZeroDenom << "\t"
+     << part.meyersCandidate.count << "\n";
+  const UsageHistogram &histogram = part.percentageDist.get();
+  for (std::size_t i = 0; i < histogram.size(); ++i) {
+    if (histogram.count(i)) {
+      os << "H\t" << kind << "\t" << i << "\t" << histogram.count(i) << "\n";
+    }
+  }
+  for (const auto &v : part.usedPrivsDistribution.dist.get()) {
+    os << "P\t" << kind << "\t" << v.first << "\t" << v.second << "\n";
+  }
+  for (const auto &v : part.quantiles.counts) {
+    os << "Q\t" << kind << "\t" << llvm::format("%.17g", v.first) << "\t"
+       << v.second << "\n";
+  }
+}
+
+inline void StatisticsState::writeInstances(raw_ostream &os,
+                                            const char *kind,
+                                            const Instances &instances) {
+  // In the order of the ids, so the same state is written the same way.
+  std::vector<const Instances::value_type *> sorted;
+  sorted.reserve(instances.size());
+  for (const auto &v : instances) {
+    sorted.push_back(&v);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const Instances::value_type *a, const Instances::value_type *b) {
+              return a->first < b->first;
+            });
+  for (const auto *v : sorted) {
+    os << "i\t" << kind << "\t" << v->first << "\t";
+    writeCounts(os, v->second.funcRes);
+    os << "\t" << (v->second.meyersCandidate ? 1 : 0) << "\t"
+       << v->second.refs << "\n";
+  }
+}
+
+inline void StatisticsState::write(raw_ostream &os) const {
+  os << statisticsStateHeader << "\n";
+  os << "W\t" << getBucketWidth() << "\n";
+  for (const auto &option : options) {
+    os << "O\t" << option.first << "\t" << escapeField(option.second)
+       << "\n";
+  }
+  writePart(os, "f", func);
+  writePart(os, "m", clazz);
+  writeInstances(os, "f", funcInstances);
+  writeInstances(os, "m", classFuncInstances);
+  auto writeIds = [&os](const std::vector<std::uint64_t> &ids) {
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+      os << (i ? " " : "") << ids[i];
+    }
+  };
+  // In their order, so a state which is read keeps the order of its units.
+  using UnitEntry = std::map<std::string, Unit>::value_type;
+  std::vector<const UnitEntry *> sorted;
+  sorted.reserve(units.size());
+  for (const auto &unit : units) {
+    sorted.push_back(&unit);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const UnitEntry *a, const UnitEntry *b) {
+              return a->second.order < b->second.order;
+            });
+  for (const auto *unit : sorted) {
+    os << "U\t" << escapeField(unit->first) << "\t";
+    writeIds(unit->second.funcs);
+    os << "\t";
+    writeIds(unit->second.classFuncs);
+    os << "\n";
+    for (const auto &decl : unit->second.firstSeen) {
+      os << "X\t" << decl.first << "\n";
+      for (const auto &v : decl.second) {
+        os << "x\t" << v.first << "\t";
+        writeCounts(os, v.second);
+        os << "\n";
+      }
+    }
+  }
+}
+
+inline bool StatisticsState::readLine(
+    const llvm::SmallVectorImpl<llvm::StringRef> &fields, Unit *&unit,
+    Contribution::Instances *&firstSeen) {
+  llvm::StringRef kind = fields[0];
+  if (kind == "U") {
+    if (fields.size() != 4) {
+      return false;
+    }
+    auto inserted = units.insert({unescapeField(fields[1]), Unit{}});
+    if (!inserted.second) {
+      return false;
+    }
+    unit = &inserted.first->second;
+    unit->order = nextOrder++;
+    firstSeen = nullptr;
+    std::vector<std::uint64_t> *ids[] = {&unit->funcs, &unit->classFuncs};
+    for (std::size_t i = 0; i < 2; ++i) {
+      llvm::SmallVector<llvm::StringRef, 16> idFields;
+      fields[2 + i].split(idFields, " ", -1, false);
+      for (llvm::StringRef idField : idFields) {
+        std::uint64_t id = 0;
+        if (idField.getAsInteger(10, id)) {
+          return false;
+        }
+        ids[i]->push_back(id);
+      }
+    }
+    return true;
+  }
+  if (kind == "X") {
+    std::uint64_t declId = 0;
+    if (!unit || fields.size() != 2 || fields[1].getAsInteger(10, declId) ||
+        unit->firstSeen.count(declId)) {
+      return false;
+    }
+    firstSeen = &unit->firstSeen[declId];
+    firstSeenUnits[declId][unit->order] = unit;
+    return true;
+  }
+  if (kind == "x") {
+    std::uint64_t id = 0;
+    Result::FuncResult counts;
+    if (!firstSeen || fields.size() != 9 || fields[1].getAsInteger(10, id) ||
+        !readCounts(fields, 2, counts)) {
+      return false;
+    }
+    firstSeen->emplace_back(id, counts);
+    return true;
+  }
+  if (kind == "O") {
+    if (fields.size() != 3) {
+      return false;
+    }
+    auto it = options.find(fields[1].str());
+    return it != options.end() && it->second == unescapeField(fields[2]);
+  }
+  if (kind == "W") {
+    int width = 0;
+    return fields.size() == 2 && !fields[1].getAsInteger(10, width) &&
+           width == getBucketWidth();
+  }
+  if (fields.size() < 2 || (fields[1] != "f" && fields[1] != "m")) {
+    return false;
+  }
+  const bool isFunc = fields[1] == "f";
+  Part &part = isFunc ? func : clazz;
+  if (kind == "A" && fields.size() == 6) {
+    long meyersCandidates = 0;
+    if (fields[2].getAsDouble(part.average.sum) ||
+        fields[3].getAsInteger(10, part.average.num) ||
+        fields[4].getAsInteger(10, part.average.numZeroDenom) ||
+        fields[5].getAsInteger(10, meyersCandidates)) {
+      return false;
+    }
+    part.meyersCandidate.count = meyersCandidates;
+    return true;
+  }
+  if (kind == "H" && fields.size() == 4) {
+    std::size_t bucket = 0;
+    int count = 0;
+    if (fields[2].getAsInteger(10, bucket) ||
+        bucket >= part.percentageDist.get().size() ||
+        fields[3].getAsInteger(10, count)) {
+      return false;
+    }
+    part.percentageDist.addToBucket(bucket, count);
+    return true;
+  }
+  if (kind == "P" && fields.size() == 4) {
+    int usedPrivs = 0;
+    int count = 0;
+    if (fields[2].getAsInteger(10, usedPrivs) ||
+        fields[3].getAsInteger(10, count)) {
+      return false;
+    }
+    part.usedPrivsDistribution.dist.addValue(usedPrivs, count);
+    return true;
+  }
+  if (kind == "Q" && fields.size() == 4) {
+    double usage = 0.0;
+    long count = 0;
+    if (fields[2].getAsDouble(usage) || fields[3].getAsInteger(10, count)) {
+      return false;
+    }
+    part.quantiles.addValue(usage, count);
+    return true;
+  }
+  if (kind == "i" && fields.size() == 12) {
+    std::uint64_t id = 0;
+    if (fields[2].getAsInteger(10, id)) {
+      return false;
+    }
+    Instance &instance = (isFunc ? funcInstances : classFuncInstances)[id];
+    if (!readCounts(fields, 3, instance.funcRes)) {
+      return false;
+    }
+    int meyersCandidate = 0;
+    if (fields[10].getAsInteger(10, meyersCandidate) ||
+        fields[11].getAsInteger(10, instance.refs) || instance.refs <= 0) {
+      return false;
+    }
+    instance.meyersCandidate = meyersCandidate != 0;
+    return true;
+  }
+  return false;
+}
+
+// Reads the state written by write into an empty state. Returns false and
+// sets the error message if the content is malformed or if it was written
+// with another percentage bucket width or other options.
+inline bool StatisticsState::read(llvm::StringRef content,
+                                  std::string &error) {
+  llvm::SmallVector<llvm::StringRef, 0> lines;
+  content.split(lines, "\n", -1, false);
+  if (lines.empty() || lines[0] != statisticsStateHeader) {
+    error = "not a friend-stats state";
+    return false;
+  }
+  Unit *unit = nullptr;
+  Contribution::Instances *firstSeen = nullptr;
+  std::set<std::string> readOptions;
+  for (std::size_t i = 1; i < lines.size(); ++i) {
+    llvm::SmallVector<llvm::StringRef, 12> fields;
+    lines[i].split(fields, "\t");
+    if (!readLine(fields, unit, firstSeen)) {
+      if (fields[0] == "W") {
+        error = "the state was written with another -percentage_bucket_width";
+      } else if (fields[0] == "O" && fields.size() > 1) {
+        error = "the state was written with another -" + fields[1].str();
+      } else {
+        error = "malformed line " + std::to_string(i + 1);
+      }
+      return false;
+    }
+    if (fields[0] == "O") {
+      readOptions.insert(fields[1].str());
+    }
+  }
+  for (const auto &option : options) {
+    if (!readOptions.count(option.first)) {
+      error = "the state was written with another -" + option.first;
+      return false;
+    }
+  }
+  return true;
+}
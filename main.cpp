@@ -1,14 +1,24 @@
+#include <algorithm>
+#include <atomic>
 #include <sstream> // to print results in percentage
+#include <thread>
+#include <tuple>
+#include <vector>
 // Declares clang::SyntaxOnlyAction.
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 // Declares llvm::cl::extrahelp.
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
 
 #include "FriendStats.hpp"
 #include "DataCrunching.hpp"
 #include "DataIO.hpp"
+#include "ResultDiff.hpp"
+#include "StatisticsState.hpp"
 
 using namespace clang::tooling;
 using namespace llvm;
@@ -25,7 +35,9 @@ static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
 
 // A help message for this specific tool can be added afterwards.
 static cl::extrahelp
-    MoreHelp("\nThis tool collects statistics about friend declarations");
+    MoreHelp("\nThis tool collects statistics about friend declarations\n"
+             "\nUse 'friend-stats diff <old> <new>' to compare two results "
+             "saved with -dump.\n");
 
 static cl::opt<bool> UseCompilationDbFiles(
     "db", cl::desc("Run the tool on all files of the compilation db"),
@@ -66,6 +78,144 @@ static cl::opt<bool> PrintIncorrectFriendClasses(
     cl::desc("Print friend classes which don't use any private entities."),
     cl::ValueOptional, cl::cat(MyToolCategory));
 
+static cl::opt<bool> Streaming(
+    "streaming",
+    cl::desc("Fold the friend instances into the statistics right after they "
+             "are measured, instead of storing them. Uses much less memory, "
+             "but can be used only to get the statistics."),
+    cl::ValueOptional, cl::cat(MyToolCategory));
+
+static cl::opt<int> PercentageBucketWidth(
+    "percentage_bucket_width",
+    cl::desc("Width of the buckets of the private usage (in percentage) "
+             "distributions. Default is 1 percent."),
+    cl::init(1), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> GroupBy(
+    "group-by",
+    cl::desc("Print the statistics also per group. The group of a friend "
+             "instance is given by the location of the friend declaration "
+             "(dir:<depth> for the first <depth> directories of the path, "
+             "file for the file) or by the befriending class "
+             "(namespace:<depth> for the first <depth> enclosing "
+             "namespaces)."),
+    cl::value_desc("dir:<depth>|namespace:<depth>|file"),
+    cl::cat(MyToolCategory));
+
+static cl::opt<std::string> HeaderFilter(
+    "header-filter",
+    cl::desc("Analyze only the friend declarations in the files whose path "
+             "matches this regular expression."),
+    cl::value_desc("regex"), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> ExcludePath(
+    "exclude-path",
+    cl::desc("Do not analyze the friend declarations in the files whose path "
+             "matches this regular expression (e.g. third party code), and "
+             "skip the translation units whose main file matches it."),
+    cl::value_desc("regex"), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> OnlyClass(
+    "only-class",
+    cl::desc("Analyze only the befriending classes whose qualified name "
+             "(without template arguments) matches this regular expression, "
+             "e.g. ^boost::asio::"),
+    cl::value_desc("regex"), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> OnlyFriend(
+    "only-friend",
+    cl::desc("Analyze only the friend functions and classes whose qualified "
+             "name (without template arguments) matches this regular "
+             "expression."),
+    cl::value_desc("regex"), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> TopHosts(
+    "top_hosts",
+    cl::desc("Print the <K> befriending classes with the most friend "
+             "function instances (including member functions of friend "
+             "classes)."),
+    cl::value_desc("K"), cl::init(0), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> TopFriendFuncs(
+    "top_friend_funcs",
+    cl::desc("Print the <K> friend function instances which use the most "
+             "private entities."),
+    cl::value_desc("K"), cl::init(0), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> TopFriendClasses(
+    "top_friend_classes",
+    cl::desc("Print the <K> friend class instances with the most member "
+             "function instances."),
+    cl::value_desc("K"), cl::init(0), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> DumpFile(
+    "dump",
+    cl::desc("Save the collected friend instances into <file>. Two saved "
+             "results can be compared with 'friend-stats diff <old> <new>'."),
+    cl::value_desc("file"), cl::cat(MyToolCategory));
+
+static cl::opt<std::string> StateFile(
+    "state",
+    cl::desc("Keep the statistics in <file> across runs. The instances of "
+             "the analyzed translation units replace their instances from "
+             "the previous runs, the statistics are updated and printed "
+             "for all the translation units of the state."),
+    cl::value_desc("file"), cl::cat(MyToolCategory));
+
+static cl::opt<bool> UseFriendMatcher(
+    "friend_matcher",
+    cl::desc("Find the friend declarations with the generic AST matchers "
+             "instead of the dedicated friend indexer. The results are the "
+             "same, this is slower, useful for comparison."),
+    cl::ValueOptional, cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> StackSize(
+    "stack_size",
+    cl::desc("Stack size (in MB) of the thread which parses and analyzes the "
+             "translation units. Default is 512 MB."),
+    cl::init(512), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> TraversalThreads(
+    "traversal_threads",
+    cl::desc("Number of threads used to process the collected data. "
+             "Default is the number of hardware threads."),
+    cl::init(0), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> AnalysisThreads(
+    "analysis_threads",
+    cl::desc("Number of threads used to evaluate the friend declarations of "
+             "a translation unit, after it is parsed. Default is 1, i.e. the "
+             "friend declarations are evaluated right when they are found."),
+    cl::init(1), cl::cat(MyToolCategory));
+
+static cl::opt<unsigned> MaxSpecializations(
+    "max_specializations",
+    cl::desc("Analyze at most <N> specializations of each template (evenly "
+             "spread over its specializations). The templates which have "
+             "more specializations are listed. Default is 0, no limit."),
+    cl::value_desc("N"), cl::init(0), cl::cat(MyToolCategory));
+
+static cl::opt<bool> AnalyzePatterns(
+    "analyze_patterns",
+    cl::desc("Analyze the templates once, on their patterns, instead of on "
+             "each of their specializations. Faster, but the results are "
+             "approximate."),
+    cl::ValueOptional, cl::cat(MyToolCategory));
+
+static cl::opt<bool> CollapseSpecializations(
+    "collapse_specializations",
+    cl::desc("Store the specializations of a friend function template which "
+             "have the same counts as one entry with a multiplicity. The "
+             "statistics are weighted by the multiplicity."),
+    cl::ValueOptional, cl::cat(MyToolCategory));
+
+static cl::opt<bool> BatchFriends(
+    "batch_friends",
+    cl::desc("Evaluate the friend declarations at the end of each "
+             "translation unit, grouped by their befriending class and "
+             "friend. The result is the same."),
+    cl::ValueOptional, cl::cat(MyToolCategory));
+
 class ProgressIndicator : public SourceFileCallbacks {
   const std::size_t numFiles = 0;
   std::size_t processedFiles = 0;
@@ -82,118 +232,425 @@ public:
   }
 };
 
+// Collects the instances recorded by the handler (see
+// FriendHandler::setRecording) by translation unit, for -state. The
+// translation units are in the order of the analysis, like in the result.
+class ContributionCollector : public ProgressIndicator {
+  FriendHandler &handler;
+  std::string currentFile;
+  std::map<std::string, std::size_t> indexes;
+
+public:
+  ContributionCollector(std::size_t numFiles, FriendHandler &handler)
+      : ProgressIndicator(numFiles), handler(handler) {}
+  bool handleBeginSource(CompilerInstance &CI, StringRef Filename) override {
+    currentFile = Filename;
+    return ProgressIndicator::handleBeginSource(CI, Filename);
+  }
+  // A file might be compiled by more commands, their instances are merged.
+  void handleEndSource() override {
+    Contribution recorded = handler.takeContribution();
+    auto inserted = indexes.insert({currentFile, contributions.size()});
+    if (inserted.second) {
+      contributions.emplace_back(currentFile, std::move(recorded));
+      return;
+    }
+    Contribution &to = contributions[inserted.first->second].second;
+    to.funcs.insert(to.funcs.end(), recorded.funcs.begin(),
+                    recorded.funcs.end());
+    to.classFuncs.insert(to.classFuncs.end(), recorded.classFuncs.begin(),
+                         recorded.classFuncs.end());
+    to.firstSeenClassFuncs.insert(to.firstSeenClassFuncs.end(),
+                                  recorded.firstSeenClassFuncs.begin(),
+                                  recorded.firstSeenClassFuncs.end());
+  }
+  std::vector<std::pair<std::string, Contribution>> contributions;
+};
+
 inline std::string to_percentage(double d) {
   std::stringstream ss;
   ss << std::fixed << d * 100 << " %";
   return ss.str();
 }
 
-class DataTraversal {
+class DataTraversal : public ResultSink {
 public:
-  DataTraversal(const Result &result) : result(result) {}
+  DataTraversal(const Result &result, unsigned numThreads, int bucketWidth,
+                const Grouping &grouping)
+      : result(result), numThreads(numThreads ? numThreads : 1),
+        bucketWidth(bucketWidth), grouping(grouping),
+        needStatistics(!NoStatistics),
+        needHostClasses(!NoStatistics || PrintHostClassesWithZeroPrivate),
+        acc(bucketWidth) {}
   void operator()() {
-    traverseFriendFuncData();
-    traverseFriendClassData();
+    traverse();
+    // In streaming mode the instances are folded into these directly.
+    acc.flush();
+    for (auto &g : groups) {
+      g.second.flush();
+    }
     if (PrintHostClassesWithZeroPrivate)
       printHostClassesWithZeroPrivate();
-    if (!NoStatistics)
-      conclusion();
+    printTopK();
+    if (!NoStatistics) {
+      if (state)
+        conclusion(*state);
+      else
+        conclusion(acc);
+      if (grouping.getKind() != Grouping::None)
+        groupConclusions();
+    }
+  }
+
+  // Print the statistics of the state instead of the statistics of the
+  // result.
+  void setState(const StatisticsState *s) { state = s; }
+
+  // In streaming mode the instances are folded into the statistics as soon
+  // as they are measured.
+  void funcInstance(const Result::FuncResult &funcRes) override {
+    foldFuncInstance(funcRes, acc, groups, llvm::outs());
+  }
+  void classFuncInstance(const Result::FuncResult &funcRes) override {
+    IncorrectFriendClass incorrectFriendClass;
+    foldClassFuncInstance(funcRes, acc, groups, incorrectFriendClass,
+                          llvm::outs());
   }
 
 private:
   const Result &result;
+  const unsigned numThreads;
+  // The width of the buckets of the percentage distributions.
+  const int bucketWidth;
+  const Grouping &grouping;
   SelfDiagnostics diags;
-  HostClassesWithZeroPrivate hostClassesWithZeroPriv;
-  BefriendingClassesAllFriendsMC befriendingClassesAllFriendsMC;
-  struct Func {
-    Average average;
-    PercentageDistribution percentageDist;
-    NumberOfUsedPrivsDistribution usedPrivsDistribution;
-    ZeroPrivInHost zeroPrivInHost;
-    ZeroPrivInFriend zeroPrivInFriend;
-    MeyersCandidate meyersCandidate;
-    PossiblyIncorrectFriend possiblyIncorrect;
-  } func;
-  struct Class {
-    Average average;
-    PercentageDistribution percentageDist;
-    NumberOfUsedPrivsDistribution usedPrivsDistribution;
-  } clazz;
-
-  void traverseFriendFuncData() {
-    for (const auto &v : result.FuncResults) {
-      for (const auto funcResPair : v.second) {
-        const auto &funcRes = funcResPair.second;
-        if (diags(funcRes)) {
-          func.average(funcRes);
-          func.percentageDist(funcRes);
-          func.usedPrivsDistribution(funcRes);
-
-          if (PrintZeroPrivInHost && func.zeroPrivInHost(funcRes)) {
-            print(funcResPair);
-          }
-          if (PrintZeroPrivInFriend && func.zeroPrivInFriend(funcRes)) {
-            print(funcResPair);
-          }
-
-          auto mc = func.meyersCandidate(funcResPair);
-          if (PrintMeyersCandidates && mc) {
-            llvm::outs() << "Meyers candidate:\n";
-            print(funcResPair);
-          }
-
-          if (PrintPossiblyIncorrectFriend &&
-              func.possiblyIncorrect(funcResPair)) {
-            llvm::outs()
-                << "Warning: possibly incorrect friend function instance:\n";
-            print(funcResPair);
-          }
-
-          hostClassesWithZeroPriv(funcRes);
-          befriendingClassesAllFriendsMC.functionInstance(funcResPair);
-
-        } else {
-          llvm::outs() << "WRONG MEASURE here:\n" << funcRes.friendDeclLocStr
-                       << "\n";
-          print(funcResPair);
-          llvm::outs() << "SKIPPING ENTRY FROM STATISTICS\n\n";
-        }
+  // The distributions are accumulated only for the statistics, the host
+  // classes with zero private entities for the statistics and their
+  // listing.
+  const bool needStatistics;
+  const bool needHostClasses;
+  const StatisticsState *state = nullptr;
+
+  // The mergeable state of the traversal. Each partition of the result has
+  // its own instance, these are merged at the end of the traversal.
+  struct Accumulators {
+    explicit Accumulators(int bucketWidth)
+        : heaviestFriendFuncs(TopFriendFuncs),
+          largestFriendClasses(TopFriendClasses) {
+      func.percentageDist = PercentageDistribution{bucketWidth};
+      clazz.percentageDist = PercentageDistribution{bucketWidth};
+    }
+    HostClassesWithZeroPrivate hostClassesWithZeroPriv;
+    BefriendingClassesAllFriendsMC befriendingClassesAllFriendsMC;
+    // These are filled only if the given report is requested and only for
+    // the overall statistics (not per group).
+    BefriendedHosts befriendedHosts;
+    TopK heaviestFriendFuncs;
+    TopK largestFriendClasses;
+    struct Func {
+      Average average;
+      UsageQuantiles quantiles;
+      PercentageDistribution percentageDist;
+      NumberOfUsedPrivsDistribution usedPrivsDistribution;
+      ZeroPrivInHost zeroPrivInHost;
+      ZeroPrivInFriend zeroPrivInFriend;
+      MeyersCandidate meyersCandidate;
+      PossiblyIncorrectFriend possiblyIncorrect;
+    } func;
+    struct Class {
+      Average average;
+      UsageQuantiles quantiles;
+      PercentageDistribution percentageDist;
+      NumberOfUsedPrivsDistribution usedPrivsDistribution;
+    } clazz;
+
+    // The distributions buffer their entries, see PercentageDistribution.
+    void flush() {
+      func.percentageDist.flush();
+      clazz.percentageDist.flush();
+    }
+
+    void merge(const Accumulators &other) {
+      hostClassesWithZeroPriv.merge(other.hostClassesWithZeroPriv);
+      befriendedHosts.merge(other.befriendedHosts);
+      heaviestFriendFuncs.merge(other.heaviestFriendFuncs);
+      largestFriendClasses.merge(other.largestFriendClasses);
+      befriendingClassesAllFriendsMC.merge(
+          other.befriendingClassesAllFriendsMC);
+      func.average.merge(other.func.average);
+      func.quantiles.merge(other.func.quantiles);
+      func.percentageDist.merge(other.func.percentageDist);
+      func.usedPrivsDistribution.merge(other.func.usedPrivsDistribution);
+      func.meyersCandidate.merge(other.func.meyersCandidate);
+      clazz.average.merge(other.clazz.average);
+      clazz.quantiles.merge(other.clazz.quantiles);
+      clazz.percentageDist.merge(other.clazz.percentageDist);
+      clazz.usedPrivsDistribution.merge(other.clazz.usedPrivsDistribution);
+    }
+  } acc;
+
+  // The accumulators of each group, if grouping is requested.
+  using Groups = std::map<std::string, Accumulators>;
+  Groups groups;
+
+  Accumulators &getGroup(Groups &g, const std::string &name) {
+    auto it = g.find(name);
+    if (it == std::end(g)) {
+      it = g.emplace(name, Accumulators{bucketWidth}).first;
+    }
+    return it->second;
+  }
+
+  void mergeGroups(Groups &to, const Groups &from) {
+    for (const auto &v : from) {
+      getGroup(to, v.first).merge(v.second);
+    }
+  }
+
+  // A contiguous range of friend declarations processed by one thread.
+  // The listings (warnings, candidates) are buffered and printed after
+  // all the partitions are done, in the order of the partitions. Also the
+  // accumulators are merged in this order. The number of partitions does
+  // not depend on the number of threads, so the output is the same
+  // regardless of the number of threads.
+  struct Partition {
+    explicit Partition(int bucketWidth) : acc(bucketWidth) {}
+    std::vector<const Result::FuncDecl *> funcDecls;
+    std::vector<const Result::ClassDecl *> classDecls;
+    Accumulators acc;
+    Groups groups;
+    std::string funcOut;
+    std::string classOut;
+  };
+
+  // Distributes the friend declarations between the partitions, so each
+  // partition gets roughly the same number of instances. The friend
+  // declarations are in the order of the output (see sortedFuncDecls).
+  template <typename FriendDecl, typename Size, typename Add>
+  void distribute(const std::vector<const FriendDecl *> &friendDecls,
+                  Size size, Add add, std::vector<Partition> &partitions) {
+    std::size_t total = 0;
+    for (const FriendDecl *d : friendDecls) {
+      total += size(*d);
+    }
+    const std::size_t perPartition = total / partitions.size() + 1;
+    std::size_t processed = 0;
+    for (const FriendDecl *d : friendDecls) {
+      add(partitions[std::min(processed / perPartition,
+                              partitions.size() - 1)],
+          *d);
+      processed += size(*d);
+    }
+  }
+
+  void traverse() {
+    const std::size_t numPartitions = 64;
+    std::vector<Partition> partitions;
+    for (std::size_t i = 0; i < numPartitions; ++i) {
+      partitions.emplace_back(bucketWidth);
+    }
+    distribute(sortedFuncDecls(result),
+               [](const Result::FuncDecl &d) { return d.instances.size(); },
+               [](Partition &p, const Result::FuncDecl &d) {
+                 p.funcDecls.push_back(&d);
+               },
+               partitions);
+    distribute(sortedClassDecls(result),
+               [](const Result::ClassDecl &d) {
+                 std::size_t size = 0;
+                 for (const Result::ClassResult *classResult : d.classResults) {
+                   size += classResult->memberFuncResults.size();
+                 }
+                 return size;
+               },
+               [](Partition &p, const Result::ClassDecl &d) {
+                 p.classDecls.push_back(&d);
+               },
+               partitions);
+
+    auto process = [this](Partition &p) {
+      llvm::raw_string_ostream funcOs{p.funcOut};
+      llvm::raw_string_ostream classOs{p.classOut};
+      for (const auto *funcDecl : p.funcDecls) {
+        traverseFriendFuncData(*funcDecl, p.acc, p.groups, funcOs);
+      }
+      for (const auto *classDecl : p.classDecls) {
+        traverseFriendClassData(*classDecl, p.acc, p.groups, classOs);
+      }
+      p.acc.flush();
+      for (auto &g : p.groups) {
+        g.second.flush();
+      }
+      funcOs.flush();
+      classOs.flush();
+    };
+
+    std::atomic<std::size_t> next{0};
+    auto worker = [&partitions, &next, &process]() {
+      for (std::size_t i = next++; i < partitions.size(); i = next++) {
+        process(partitions[i]);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+      t.join();
+    }
+
+    for (const auto &p : partitions) {
+      llvm::outs() << p.funcOut;
+    }
+    for (const auto &p : partitions) {
+      llvm::outs() << p.classOut;
+    }
+    for (const auto &p : partitions) {
+      acc.merge(p.acc);
+      mergeGroups(groups, p.groups);
+    }
+  }
+
+  void traverseFriendFuncData(const Result::FuncDecl &funcDecl,
+                              Accumulators &accs, Groups &grps,
+                              raw_ostream &os) {
+    for (const Result::FuncResult *funcRes : sortedFuncResults(funcDecl)) {
+      foldFuncInstance(*funcRes, accs, grps, os);
+    }
+  }
+
+  void traverseFriendClassData(const Result::ClassDecl &classDecl,
+                               Accumulators &accs, Groups &grps,
+                               raw_ostream &os) {
+    for (const Result::ClassResult *classResult :
+         sortedClassResults(classDecl)) {
+      IncorrectFriendClass incorrectFriendClass;
+      for (const Result::FuncResult *funcRes :
+           sortedFuncResults(*classResult)) {
+        foldClassFuncInstance(*funcRes, accs, grps, incorrectFriendClass, os);
+      }
+      if (PrintIncorrectFriendClasses && incorrectFriendClass.result) {
+        printIncorrectFriendClass(*classResult, os);
+      }
+      long memberFuncs = classResult->memberFuncResults.size();
+      if (accs.largestFriendClasses.mayAccept(memberFuncs)) {
+        accs.largestFriendClasses.add(
+            memberFuncs, classResult->diagName.get() +
+                             " [befriending class: " +
+                             classResult->hostDiagName.get() + "]");
+      }
+    }
+  }
+
+  void foldFuncInstance(const Result::FuncResult &funcRes, Accumulators &accs,
+                        Groups &grps, raw_ostream &os) {
+    if (diags(funcRes)) {
+      accumulateFuncInstance(funcRes, accs);
+      if (TopHosts) {
+        accs.befriendedHosts(funcRes.hostDiagName(), funcRes.multiplicity);
+      }
+      long used = privateUsage(funcRes).numerator;
+      if (accs.heaviestFriendFuncs.mayAccept(used)) {
+        accs.heaviestFriendFuncs.add(used, funcRes.diagName.get() +
+                                               " [befriending class: " +
+                                               funcRes.hostDiagName() + "]");
+      }
+      if (grouping.getKind() != Grouping::None) {
+        accumulateFuncInstance(funcRes,
+                               getGroup(grps, grouping.groupOf(funcRes)));
+      }
+
+      auto &func = accs.func;
+      if (PrintZeroPrivInHost && func.zeroPrivInHost(funcRes)) {
+        printFuncInstance(funcRes, os);
+      }
+      if (PrintZeroPrivInFriend && func.zeroPrivInFriend(funcRes)) {
+        printFuncInstance(funcRes, os);
       }
+
+      MeyersCandidate mc;
+      if (PrintMeyersCandidates && mc(funcRes)) {
+        os << "Meyers candidate:\n";
+        printFuncInstance(funcRes, os);
+      }
+
+      if (PrintPossiblyIncorrectFriend && func.possiblyIncorrect(funcRes)) {
+        os << "Warning: possibly incorrect friend function instance:\n";
+        printFuncInstance(funcRes, os);
+      }
+    } else {
+      os << "WRONG MEASURE here:\n" << funcRes.friendDeclLoc << "\n";
+      printFuncInstance(funcRes, os);
+      os << "SKIPPING ENTRY FROM STATISTICS\n\n";
     }
   }
 
-  void traverseFriendClassData() {
-    for (const auto &friendDecls : result.ClassResults) {
-      for (const auto &classSpecs : friendDecls.second) {
-        IncorrectFriendClass incorrectFriendClass;
-        for (const auto &funcResPair : classSpecs.second.memberFuncResults) {
-          const auto &funcRes = funcResPair.second;
-          if (diags(funcRes)) {
-            clazz.average(funcRes);
-            clazz.percentageDist(funcRes);
-            clazz.usedPrivsDistribution(funcRes);
-            hostClassesWithZeroPriv(funcRes);
-            befriendingClassesAllFriendsMC.classFunctionInstance(funcRes);
-            incorrectFriendClass(funcRes);
-          } else {
-            llvm::outs() << "WRONG MEASURE here:\n" << funcRes.friendDeclLocStr
-                         << "\n";
-            print(funcResPair);
-            llvm::outs() << "SKIPPING ENTRY FROM STATISTICS\n\n";
-          }
-        }
-        if (PrintIncorrectFriendClasses && incorrectFriendClass.result) {
-          printIncorrectFriendClass(classSpecs.second);
-        }
+  void accumulateFuncInstance(const Result::FuncResult &funcRes,
+                              Accumulators &accs) {
+    auto &func = accs.func;
+    // A collapsed entry stands for multiplicity instances.
+    if (needStatistics) {
+      const int weight = funcRes.multiplicity;
+      func.average(funcRes, weight);
+      func.quantiles(funcRes, weight);
+      func.percentageDist(funcRes, weight);
+      func.usedPrivsDistribution(funcRes, weight);
+      func.meyersCandidate(funcRes, weight);
+    }
+    if (needHostClasses) {
+      accs.hostClassesWithZeroPriv(funcRes);
+      accs.befriendingClassesAllFriendsMC.functionInstance(funcRes);
+    }
+  }
+
+  void foldClassFuncInstance(const Result::FuncResult &funcRes,
+                             Accumulators &accs, Groups &grps,
+                             IncorrectFriendClass &incorrectFriendClass,
+                             raw_ostream &os) {
+    if (diags(funcRes)) {
+      accumulateClassFuncInstance(funcRes, accs);
+      if (TopHosts) {
+        accs.befriendedHosts(funcRes.hostDiagName());
+      }
+      if (grouping.getKind() != Grouping::None) {
+        accumulateClassFuncInstance(funcRes,
+                                    getGroup(grps, grouping.groupOf(funcRes)));
       }
+      incorrectFriendClass(funcRes);
+    } else {
+      os << "WRONG MEASURE here:\n" << funcRes.friendDeclLoc << "\n";
+      printFuncInstance(funcRes, os);
+      os << "SKIPPING ENTRY FROM STATISTICS\n\n";
+    }
+  }
+
+  void accumulateClassFuncInstance(const Result::FuncResult &funcRes,
+                                   Accumulators &accs) {
+    auto &clazz = accs.clazz;
+    if (needStatistics) {
+      clazz.average(funcRes);
+      clazz.quantiles(funcRes);
+      clazz.percentageDist(funcRes);
+      clazz.usedPrivsDistribution(funcRes);
+    }
+    if (needHostClasses) {
+      accs.hostClassesWithZeroPriv(funcRes);
+      accs.befriendingClassesAllFriendsMC.classFunctionInstance(funcRes);
     }
   }
 
   void printHostClassesWithZeroPrivate() {
-    auto befrClassWithAllMC = befriendingClassesAllFriendsMC.getResult();
-    for (const auto &cip : hostClassesWithZeroPriv.classes) {
+    // Sort the classes by their location.
+    auto classes = acc.hostClassesWithZeroPriv.getClasses();
+    std::sort(std::begin(classes), std::end(classes),
+              [](const ClassInfo *a, const ClassInfo *b) {
+                return std::tie(a->loc, a->diagName) <
+                       std::tie(b->loc, b->diagName);
+              });
+    for (const auto &cip : classes) {
       // This is not a class with just MC friend functions
-      if (befrClassWithAllMC.count(cip) == 0) {
+      if (!acc.befriendingClassesAllFriendsMC.allFriendsMC(*cip)) {
         llvm::outs()
             << "Warning: befriending class with zero private entities:\n";
         print(*cip);
@@ -201,68 +658,265 @@ private:
     }
   }
 
-  void printIncorrectFriendClass(const Result::ClassResult &classResult) {
-    llvm::outs() << "Warning: possibly incorrect friend class:\n";
-    llvm::outs() << "diagName: " << classResult.diagName << "\n";
-    llvm::outs() << "defLoc: " << classResult.defLocStr << "\n";
-    llvm::outs() << "friendDeclLoc: " << classResult.friendDeclLocStr << "\n";
-    llvm::outs()
-        << "============================================================"
-           "================\n";
+  void printTopK(const char *title, const TopK &top) {
+    if (!top.getK())
+      return;
+    llvm::outs() << "########## Top " << top.getK() << " " << title
+                 << " ##########\n";
+    for (const auto &entry : top.get()) {
+      llvm::outs() << entry.first << "\t" << entry.second << "\n";
+    }
+    llvm::outs() << "\n";
+  }
+
+  void printTopK() {
+    printTopK("most befriended host classes (by friend instances)",
+              acc.befriendedHosts.top(TopHosts));
+    printTopK("friend functions using the most private entities",
+              acc.heaviestFriendFuncs);
+    printTopK("friend classes with the most member function instances",
+              acc.largestFriendClasses);
+  }
+
+  void printIncorrectFriendClass(const Result::ClassResult &classResult,
+                                 raw_ostream &os) {
+    os << "Warning: possibly incorrect friend class:\n";
+    os << "diagName: " << classResult.diagName << "\n";
+    os << "defLoc: " << classResult.defLoc << "\n";
+    os << "friendDeclLoc: " << classResult.friendDeclLoc << "\n";
+    os << "============================================================"
+          "================\n";
+  }
+
+  // The quantile in percentage, n/a if there are no entries.
+  template <typename Quantiles>
+  static std::string quantileText(const Quantiles &quantiles, double q) {
+    return quantiles.count() ? to_percentage(quantiles.get(q)) : "n/a";
   }
 
-  void conclusion() {
+  template <typename Quantiles>
+  void printQuantiles(const char *what, const Quantiles &quantiles) {
+    llvm::outs() << "Median, 90th and 99th percentile of usage of priv "
+                    "entities (vars, funcs, types) in "
+                 << what << ": " << quantileText(quantiles, 0.5) << ", "
+                 << quantileText(quantiles, 0.9) << ", "
+                 << quantileText(quantiles, 0.99) << "\n";
+  }
+
+  // Prints the statistics of the Accumulators or of a StatisticsState.
+  template <typename Acc> void conclusion(const Acc &a) {
     llvm::outs() << "########## Friend FUNCTIONS ##########"
                  << "\n";
     llvm::outs() << "Number of available friend function definitions: "
-                 << func.average.num << "\n";
+                 << a.func.average.num << "\n";
     llvm::outs() << "Number of friend function declarations with zero priv "
                     "entity declared in host class: "
-                 << func.average.numZeroDenom
+                 << a.func.average.numZeroDenom
                  << "\n";
-    double sum = func.average.get();
+    double sum = a.func.average.get();
     llvm::outs() << "Average usage of priv entities (vars, funcs, types) in "
                     "friend functions: "
                  << to_percentage(sum)
                  << "\n";
+    printQuantiles("friend functions", a.func.quantiles);
     llvm::outs()
         << "Friend functions private usage (in percentage) distribution:"
         << "\n";
-    llvm::outs() << func.percentageDist.dist;
+    llvm::outs() << a.func.percentageDist.get();
     llvm::outs() << "Friend functions private usage (by piece) distribution:"
                  << "\n";
-    llvm::outs() << func.usedPrivsDistribution.dist;
+    llvm::outs() << a.func.usedPrivsDistribution.dist;
     llvm::outs() << "Number of Meyers candidates: "
-                 << func.meyersCandidate.count << "\n";
+                 << a.func.meyersCandidate.count << "\n";
 
     llvm::outs() << "\n";
     llvm::outs() << "########## Friend CLASSES ##########"
                  << "\n";
     llvm::outs()
         << "Number of available function definitions in friend classes: "
-        << clazz.average.num << "\n";
+        << a.clazz.average.num << "\n";
     llvm::outs()
         << "Number of function declarations of friend classes with zero priv "
            "entity declared in host class: "
-        << clazz.average.numZeroDenom
+        << a.clazz.average.numZeroDenom
         << "\n";
-    sum = clazz.average.get();
+    sum = a.clazz.average.get();
     llvm::outs() << "Average usage of priv entities (vars, funcs, types) in "
                     "friend classes: "
                  << to_percentage(sum)
                  << "\n";
+    printQuantiles("friend classes", a.clazz.quantiles);
     llvm::outs() << R"("Indirect friend")"
                     " functions private usage (in percentage) distribution:"
                  << "\n";
-    llvm::outs() << clazz.percentageDist.dist;
+    llvm::outs() << a.clazz.percentageDist.get();
     llvm::outs() << R"("Indirect friend")"
                     " functions private usage (by piece) distribution:"
                  << "\n";
-    llvm::outs() << clazz.usedPrivsDistribution.dist;
+    llvm::outs() << a.clazz.usedPrivsDistribution.dist;
+  }
+
+  // Number of befriending classes with zero private entities, excluding
+  // those which have only Meyers candidate friend functions.
+  std::size_t numberOfHostClassesWithZeroPrivate(Accumulators &a) {
+    std::size_t result = 0;
+    for (const auto &cip : a.hostClassesWithZeroPriv.getClasses()) {
+      if (!a.befriendingClassesAllFriendsMC.allFriendsMC(*cip))
+        ++result;
+    }
+    return result;
+  }
+
+  void groupConclusions() {
+    for (const auto &g : groups) {
+      llvm::outs() << "\n";
+      llvm::outs() << "########## Group: " << g.first << " ##########\n";
+      conclusion(g.second);
+    }
+
+    // The most important numbers of each group in one tab separated table.
+    llvm::outs() << "\n";
+    llvm::outs() << "########## Groups ##########\n";
+    llvm::outs() << "group\tfriend funcs\tzero priv host\tavg usage\t"
+                    "median usage\tp90 usage\tp99 usage\tMeyers "
+                    "candidates\tfriend class funcs\tzero priv host\tavg "
+                    "usage\tmedian usage\tp90 usage\tp99 usage\t"
+                    "host classes with zero priv\n";
+    for (auto &g : groups) {
+      const auto &func = g.second.func;
+      const auto &clazz = g.second.clazz;
+      llvm::outs() << g.first << "\t" << func.average.num << "\t"
+                   << func.average.numZeroDenom << "\t"
+                   << to_percentage(func.average.get()) << "\t"
+                   << quantileText(func.quantiles, 0.5) << "\t"
+                   << quantileText(func.quantiles, 0.9) << "\t"
+                   << quantileText(func.quantiles, 0.99) << "\t"
+                   << func.meyersCandidate.count << "\t"
+                   << clazz.average.num << "\t" << clazz.average.numZeroDenom
+                   << "\t" << to_percentage(clazz.average.get()) << "\t"
+                   << quantileText(clazz.quantiles, 0.5) << "\t"
+                   << quantileText(clazz.quantiles, 0.9) << "\t"
+                   << quantileText(clazz.quantiles, 0.99) << "\t"
+                   << numberOfHostClassesWithZeroPrivate(g.second) << "\n";
+    }
   }
 };
 
+// The statistics of the sampled templates are based on a part of their
+// specializations only.
+static void printSampledTemplates(const Result &result) {
+  if (result.sampledTemplates.empty()) {
+    return;
+  }
+  llvm::outs() << "########## Sampled templates ##########\n";
+  for (const auto &v : result.sampledTemplates) {
+    llvm::outs() << v.second.diagName << " (" << v.first << "): analyzed "
+                 << v.second.numAnalyzed << " of "
+                 << v.second.numSpecializations << " specializations\n";
+  }
+  llvm::outs() << "Note: the results are sampled, the instances of these "
+                  "templates are under-represented.\n\n";
+}
+
+// Derives the facts to be collected from the requested outputs.
+static AnalysisPlan planAnalysis() {
+  AnalysisPlan plan;
+  // The classes without private entities (-zh,
+  // -host_classes_with_zero_priv) and the top hosts and friend classes need
+  // only the counts of the befriending classes and the instances.
+  plan.usage = !NoStatistics || PrintZeroPrivInFriend ||
+               PrintMeyersCandidates || PrintPossiblyIncorrectFriend ||
+               PrintIncorrectFriendClasses || TopFriendFuncs ||
+               !DumpFile.empty();
+  // The other listings need only to know whether an instance uses any
+  // private entity.
+  plan.exactUsage = !NoStatistics || TopFriendFuncs || !DumpFile.empty();
+  // The locations of the definitions are printed only in the listings of
+  // the instances and written into the dump.
+  plan.defLocations = PrintZeroPrivInHost || PrintZeroPrivInFriend ||
+                      PrintMeyersCandidates || PrintPossiblyIncorrectFriend ||
+                      PrintIncorrectFriendClasses || !DumpFile.empty();
+  return plan;
+}
+
+static bool readResultStore(StringRef path, Result &result) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << "Cannot read " << path << ": "
+                 << buffer.getError().message() << "\n";
+    return false;
+  }
+  std::string error;
+  if (!ResultReader{}.read((*buffer)->getBuffer(), result, error)) {
+    llvm::errs() << "Cannot read " << path << ": " << error << "\n";
+    return false;
+  }
+  return true;
+}
+
+static int diffMain(int argc, const char **argv) {
+  if (argc != 4) {
+    llvm::errs() << "Usage: " << argv[0] << " diff <old> <new>\n";
+    return 1;
+  }
+  Result oldResult, newResult;
+  if (!readResultStore(argv[2], oldResult) ||
+      !readResultStore(argv[3], newResult)) {
+    return 1;
+  }
+  printDiff(oldResult, newResult);
+  return 0;
+}
+
+static bool dumpResult(const Result &result) {
+  std::error_code EC;
+  raw_fd_ostream os(DumpFile, EC, sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "Cannot write " << DumpFile << ": " << EC.message()
+                 << "\n";
+    return false;
+  }
+  writeResult(os, result);
+  return true;
+}
+
+// Replaces the contributions of the analyzed translation units in the state
+// of the previous runs (if any) and saves the updated state.
+static bool updateState(
+    const std::vector<std::pair<std::string, Contribution>> &contributions,
+    StatisticsState &state) {
+  if (sys::fs::exists(StateFile)) {
+    auto buffer = MemoryBuffer::getFile(StateFile);
+    if (!buffer) {
+      llvm::errs() << "Cannot read " << StateFile << ": "
+                   << buffer.getError().message() << "\n";
+      return false;
+    }
+    std::string error;
+    if (!state.read((*buffer)->getBuffer(), error)) {
+      llvm::errs() << "Cannot read " << StateFile << ": " << error << "\n";
+      return false;
+    }
+  }
+  for (const auto &v : contributions) {
+    state.replace(v.first, v.second);
+  }
+  std::error_code EC;
+  raw_fd_ostream os(StateFile, EC, sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "Cannot write " << StateFile << ": " << EC.message()
+                 << "\n";
+    return false;
+  }
+  state.write(os);
+  return true;
+}
+
 int main(int argc, const char **argv) {
+  if (argc > 1 && StringRef(argv[1]) == "diff") {
+    return diffMain(argc, argv);
+  }
+
   CommonOptionsParser OptionsParser(argc, argv, MyToolCategory);
 
   auto files = OptionsParser.getSourcePathList();
@@ -270,23 +924,141 @@ int main(int argc, const char **argv) {
     files = OptionsParser.getCompilations().getAllFiles();
   }
 
+  if (Streaming &&
+      (PrintZeroPrivInHost || PrintZeroPrivInFriend || PrintMeyersCandidates ||
+       PrintPossiblyIncorrectFriend || PrintHostClassesWithZeroPrivate ||
+       PrintIncorrectFriendClasses || TopFriendClasses ||
+       !DumpFile.empty())) {
+    llvm::errs() << "-streaming can be used only to get the statistics, "
+                    "it cannot be combined with listings or -dump.\n";
+    return 1;
+  }
+
+  if (StackSize < 1 || StackSize > 4095) {
+    llvm::errs() << "-stack_size must be between 1 and 4095.\n";
+    return 1;
+  }
+
+  if (PercentageBucketWidth < 1 || PercentageBucketWidth > 100) {
+    llvm::errs() << "-percentage_bucket_width must be between 1 and 100.\n";
+    return 1;
+  }
+
+  Grouping grouping;
+  if (!GroupBy.empty() && !grouping.parse(GroupBy)) {
+    llvm::errs() << "Invalid -group-by value: " << GroupBy << "\n";
+    return 1;
+  }
+
+  if (!StateFile.empty() && (!GroupBy.empty() || NoStatistics)) {
+    llvm::errs() << "-state keeps only the overall statistics, it cannot be "
+                    "combined with -group-by or -no_stats.\n";
+    return 1;
+  }
+
+  PathFilter pathFilter;
+  std::string pathFilterError;
+  if (!pathFilter.parse(HeaderFilter, ExcludePath, pathFilterError)) {
+    llvm::errs() << "Invalid -header-filter or -exclude-path: "
+                 << pathFilterError << "\n";
+    return 1;
+  }
+  NameFilter nameFilter;
+  std::string nameFilterError;
+  if (!nameFilter.parse(OnlyClass, OnlyFriend, nameFilterError)) {
+    llvm::errs() << "Invalid -only-class or -only-friend: " << nameFilterError
+                 << "\n";
+    return 1;
+  }
+  // The excluded translation units are not even parsed.
+  files.erase(std::remove_if(files.begin(), files.end(),
+                             [&pathFilter](const std::string &file) {
+                               return pathFilter.excluded(file);
+                             }),
+              files.end());
+
   ClangTool Tool(OptionsParser.getCompilations(), files);
 
-  FriendHandler Handler;
-  MatchFinder Finder;
-  Finder.addMatcher(FriendMatcher, &Handler);
+  unsigned numThreads = TraversalThreads;
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
 
+  FriendHandler Handler;
+  Handler.setAnalysisThreads(AnalysisThreads);
+  Handler.setBatching(BatchFriends);
+  Handler.setMaxSpecializations(MaxSpecializations);
+  Handler.setCollapsing(CollapseSpecializations);
+  Handler.setPatternMode(AnalyzePatterns);
+  Handler.setPathFilter(pathFilter);
+  Handler.setNameFilter(nameFilter);
+  Handler.setPlan(planAnalysis());
+  Handler.setRecording(!StateFile.empty());
+  DataTraversal traversal{Handler.getResult(), numThreads,
+                          PercentageBucketWidth, grouping};
+  if (Streaming) {
+    Handler.setSink(&traversal);
+  }
   ProgressIndicator progressIndicator{files.size()};
-  auto ret =
-      Tool.run(newFrontendActionFactory(&Finder, &progressIndicator).get());
+  ContributionCollector collector{files.size(), Handler};
+  SourceFileCallbacks *callbacks =
+      StateFile.empty() ? &progressIndicator : &collector;
+  int ret = 0;
+  auto runTool = [&]() {
+    if (UseFriendMatcher) {
+      MatchFinder Finder;
+      Finder.addMatcher(FriendMatcher, &Handler);
+      ret = Tool.run(newFrontendActionFactory(&Finder, callbacks).get());
+    } else {
+      FriendIndexerFactory indexerFactory{Handler};
+      ret = Tool.run(
+          newFrontendActionFactory(&indexerFactory, callbacks).get());
+    }
+  };
+  // The parser and the RecursiveASTVisitors recurse deep on complicated
+  // code, so the tool runs on a thread with a big stack, independently of
+  // the stack limit of the main thread (ulimit -s).
+  llvm_execute_on_thread(
+      [](void *fn) { (*static_cast<decltype(runTool) *>(fn))(); }, &runTool,
+      StackSize * 1024 * 1024);
   llvm::outs() << "\n";
   llvm::outs() << "Number of processed friend function declarations: "
                << Handler.getResult().friendFuncDeclCount << "\n";
   llvm::outs() << "Number of processed friend class declarations: "
                << Handler.getResult().friendClassDeclCount << "\n";
   llvm::outs() << "\n";
+  printSampledTemplates(Handler.getResult());
+  if (AnalyzePatterns) {
+    llvm::outs() << "Note: the results are approximate, the templates are "
+                    "analyzed on their patterns (-analyze_patterns).\n\n";
+  }
+
+  if (!DumpFile.empty() && !dumpResult(Handler.getResult())) {
+    return 1;
+  }
+
+  StatisticsState state{PercentageBucketWidth};
+  if (!StateFile.empty()) {
+    // The options which change the measured instances.
+    state.setOption("only-class", OnlyClass);
+    state.setOption("only-friend", OnlyFriend);
+    state.setOption("header-filter", HeaderFilter);
+    state.setOption("exclude-path", ExcludePath);
+    state.setOption("analyze_patterns", AnalyzePatterns ? "1" : "0");
+    state.setOption("max_specializations",
+                    std::to_string(MaxSpecializations.getValue()));
+    state.setOption("collapse_specializations",
+                    CollapseSpecializations ? "1" : "0");
+    if (!updateState(collector.contributions, state)) {
+      return 1;
+    }
+    llvm::outs() << "Statistics of the " << state.numUnits()
+                 << " translation units of the state (-state).\n\n";
+    traversal.setState(&state);
+  }
 
-  DataTraversal traversal{Handler.getResult()};
+  // In streaming mode the result does not contain any instances, all of
+  // them are already folded into the statistics.
   traversal();
 
   return ret;
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "../DataCrunching.hpp"
+#include "../DataIO.hpp"
 
 TEST(getInterval, First) {
   double d = 0.2345;
@@ -22,3 +23,507 @@ TEST(getInterval, One) {
   EXPECT_EQ(p.second, 2);
 }
 
+
+namespace {
+Result::FuncResult makeFuncResult(int usedVars, int parentVars) {
+  Result::FuncResult funcRes;
+  funcRes.usedPrivateVarsCount = usedVars;
+  funcRes.parentPrivateVarsCount = parentVars;
+  return funcRes;
+}
+} // unnamed namespace
+
+TEST(Average, Merge) {
+  Average a, b, all;
+  auto r1 = makeFuncResult(1, 2);
+  auto r2 = makeFuncResult(1, 4);
+  auto r3 = makeFuncResult(0, 0);
+  a(r1);
+  b(r2);
+  b(r3);
+  all(r1);
+  all(r2);
+  all(r3);
+  a.merge(b);
+  EXPECT_EQ(a.num, all.num);
+  EXPECT_EQ(a.numZeroDenom, all.numZeroDenom);
+  EXPECT_DOUBLE_EQ(a.get(), all.get());
+}
+
+TEST(PercentageDistribution, Merge) {
+  PercentageDistribution a, b;
+  a(makeFuncResult(1, 2));
+  b(makeFuncResult(1, 2));
+  b(makeFuncResult(0, 3));
+  b.flush();
+  a.merge(b);
+  const auto &dist = a.get();
+  EXPECT_EQ(dist.count(dist.bucketOf(0.0)), 1);
+  EXPECT_EQ(dist.count(dist.bucketOf(0.5)), 2);
+}
+
+TEST(PercentageDistribution, RemoveAndSubtract) {
+  PercentageDistribution a, b;
+  a(makeFuncResult(1, 2));
+  a(makeFuncResult(0, 3));
+  a(makeFuncResult(1, 4));
+  b(makeFuncResult(1, 4));
+  b.flush();
+  a.remove(makeFuncResult(1, 2));
+  a.subtract(b);
+  const auto &dist = a.get();
+  EXPECT_EQ(dist.count(dist.bucketOf(0.0)), 1);
+  EXPECT_EQ(dist.count(dist.bucketOf(0.5)), 0);
+  EXPECT_EQ(dist.count(dist.bucketOf(0.25)), 0);
+}
+
+TEST(Average, Remove) {
+  Average a, expected;
+  a(makeFuncResult(1, 2));
+  a(makeFuncResult(0, 0));
+  a(makeFuncResult(1, 4));
+  expected(makeFuncResult(1, 4));
+  a.remove(makeFuncResult(1, 2));
+  a.remove(makeFuncResult(0, 0));
+  EXPECT_EQ(a.num, expected.num);
+  EXPECT_EQ(a.numZeroDenom, expected.numZeroDenom);
+  EXPECT_DOUBLE_EQ(a.get(), expected.get());
+}
+
+TEST(DiscreteDistribution, RemoveAndSubtract) {
+  DiscreteDistribution<int> a, b;
+  a.addValue(1);
+  a.addValue(1);
+  a.addValue(2);
+  b.addValue(1);
+  a.subtract(b);
+  a.removeValue(2);
+  EXPECT_EQ(a.get(), (std::map<int, int>{{1, 1}}));
+}
+
+TEST(UsageHistogram, Intervals) {
+  UsageHistogram h;
+  EXPECT_EQ(h.interval(h.bucketOf(0.0)), std::make_pair(0, 0));
+  EXPECT_EQ(h.interval(h.bucketOf(0.2345)), std::make_pair(23, 24));
+  EXPECT_EQ(h.interval(h.bucketOf(1.0)), std::make_pair(100, 101));
+
+  UsageHistogram h10{10};
+  EXPECT_EQ(h10.interval(h10.bucketOf(0.0)), std::make_pair(0, 0));
+  EXPECT_EQ(h10.interval(h10.bucketOf(0.2345)), std::make_pair(20, 30));
+  EXPECT_EQ(h10.interval(h10.bucketOf(1.0)), std::make_pair(100, 110));
+}
+
+TEST(UsageHistogram, BatchIsSameAsOneByOne) {
+  std::vector<int> numerators, denominators;
+  for (int den = 0; den < 40; ++den) {
+    for (int num = 0; num <= den; ++num) {
+      numerators.push_back(num);
+      denominators.push_back(den);
+    }
+  }
+  UsageHistogram batch, oneByOne;
+  batch.addBatch(numerators.data(), denominators.data(), numerators.size());
+  for (std::size_t i = 0; i < numerators.size(); ++i) {
+    Result::FuncResult funcRes =
+        makeFuncResult(numerators[i], denominators[i]);
+    oneByOne.addValue(privateUsage(funcRes).usage);
+  }
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    EXPECT_EQ(batch.count(i), oneByOne.count(i));
+  }
+}
+
+TEST(UsageHistogram, PrintedAsDiscreteDistribution) {
+  DiscreteDistribution<std::pair<int, int>> discrete;
+  PercentageDistribution percentage;
+  for (int den = 1; den < 10; ++den) {
+    for (int num = 0; num <= den; ++num) {
+      Result::FuncResult funcRes = makeFuncResult(num, den);
+      double usage = privateUsage(funcRes).usage;
+      discrete.addValue(usage == 0.0 ? getInterval(-.5)
+                                     : getInterval(usage * 100));
+      percentage(funcRes);
+    }
+  }
+  std::string expected, actual;
+  llvm::raw_string_ostream expectedOs{expected}, actualOs{actual};
+  expectedOs << discrete;
+  percentage.flush();
+  actualOs << percentage.get();
+  EXPECT_EQ(expectedOs.str(), actualOs.str());
+}
+
+TEST(BefriendingClassesAllFriendsMC, Merge) {
+  ClassRegistry classes;
+  auto ci = classes.get(Location{"a.h", 1, 1}, "A<int>");
+  Result::FuncResult funcRes = makeFuncResult(0, 0);
+  funcRes.parentClassInfo = ci;
+  funcRes.friendDeclLoc = Location{"a.h", 2, 1};
+  funcRes.defLoc = funcRes.friendDeclLoc;
+
+  BefriendingClassesAllFriendsMC a, b;
+  a.functionInstance(funcRes);
+  EXPECT_TRUE(a.allFriendsMC(*ci));
+  b.classFunctionInstance(funcRes);
+  a.merge(b);
+  EXPECT_FALSE(a.allFriendsMC(*ci));
+}
+
+TEST(ClassRegistry, DenseIds) {
+  ClassRegistry classes;
+  auto a = classes.get(Location{"a.h", 1, 1}, "A");
+  auto b = classes.get(Location{"b.h", 1, 1}, "B");
+  EXPECT_EQ(a->id, 0u);
+  EXPECT_EQ(b->id, 1u);
+  EXPECT_EQ(classes.get(Location{"a.h", 1, 1}, "A"), a);
+  EXPECT_EQ(classes.size(), 2u);
+  EXPECT_EQ(classes[1], b);
+}
+
+TEST(HostClassesWithZeroPrivate, SameClassOnce) {
+  ClassRegistry classes;
+  HostClassesWithZeroPrivate a, b;
+  Result::FuncResult funcRes = makeFuncResult(0, 0);
+  funcRes.parentClassInfo = classes.get(Location{"b.h", 1, 1}, "B");
+  a(funcRes);
+  // The same class found in another translation unit.
+  funcRes.parentClassInfo = classes.get(Location{"b.h", 1, 1}, "B");
+  a(funcRes);
+  funcRes.parentClassInfo = classes.get(Location{"a.h", 1, 1}, "A");
+  b(funcRes);
+  a.merge(b);
+  auto result = a.getClasses();
+  ASSERT_EQ(result.size(), 2u);
+  EXPECT_EQ(result[0]->diagName, "B");
+  EXPECT_EQ(result[1]->diagName, "A");
+}
+
+TEST(QuantileSketch, ExactBelowCapacity) {
+  QuantileSketch sketch{64};
+  for (int i = 50; i > 0; --i) {
+    sketch.add(i);
+  }
+  EXPECT_EQ(sketch.quantile(0.0), 1);
+  EXPECT_EQ(sketch.quantile(0.5), 25);
+  EXPECT_EQ(sketch.quantile(0.9), 45);
+  EXPECT_EQ(sketch.quantile(1.0), 50);
+}
+
+TEST(QuantileSketch, Empty) {
+  QuantileSketch sketch;
+  EXPECT_TRUE(std::isnan(sketch.quantile(0.5)));
+}
+
+// The quantiles of an empty category are not printed, see the count.
+TEST(UsageQuantiles, Count) {
+  UsageQuantiles quantiles;
+  EXPECT_EQ(quantiles.count(), 0u);
+  quantiles(makeFuncResult(1, 2), 3);
+  EXPECT_EQ(quantiles.count(), 3u);
+}
+
+namespace {
+// Checks that the rank of the estimated quantiles is within the documented
+// error bound.
+void checkRankError(const QuantileSketch &sketch, std::vector<double> values,
+                    std::size_t k) {
+  std::sort(std::begin(values), std::end(values));
+  const double n = values.size();
+  const double bound = n * (std::floor(std::log2(n / k)) + 1) / k;
+  for (double q : {0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99}) {
+    double estimate = sketch.quantile(q);
+    auto lower = std::lower_bound(std::begin(values), std::end(values),
+                                  estimate) - std::begin(values);
+    auto upper = std::upper_bound(std::begin(values), std::end(values),
+                                  estimate) - std::begin(values);
+    double rank = std::ceil(q * n);
+    // The estimate is a value which occupies the ranks (lower, upper].
+    EXPECT_LE(rank, upper + bound) << q;
+    EXPECT_GE(rank, lower + 1 - bound) << q;
+  }
+}
+} // unnamed namespace
+
+TEST(QuantileSketch, RankErrorIsBounded) {
+  const std::size_t k = 128;
+  QuantileSketch sketch{k};
+  std::vector<double> values;
+  for (int i = 0; i < 100000; ++i) {
+    // Deterministic pseudo random values with many duplicates.
+    double value = ((i * 7919) % 1000) / 1000.0;
+    values.push_back(value);
+    sketch.add(value);
+  }
+  checkRankError(sketch, values, k);
+}
+
+TEST(QuantileSketch, MergedRankErrorIsBounded) {
+  const std::size_t k = 128;
+  QuantileSketch merged{k};
+  std::vector<double> values;
+  for (int part = 0; part < 10; ++part) {
+    QuantileSketch sketch{k};
+    for (int i = 0; i < 5000 * (part + 1); ++i) {
+      double value = ((i * 104729 + part) % 9973) / 9973.0;
+      values.push_back(value);
+      sketch.add(value);
+    }
+    merged.merge(sketch);
+  }
+  EXPECT_EQ(merged.count(), values.size());
+  checkRankError(merged, values, k);
+}
+
+TEST(Grouping, Parse) {
+  Grouping g;
+  EXPECT_TRUE(g.parse("file"));
+  EXPECT_EQ(g.getKind(), Grouping::File);
+  EXPECT_TRUE(g.parse("dir:2"));
+  EXPECT_EQ(g.getKind(), Grouping::Dir);
+  EXPECT_TRUE(g.parse("namespace:1"));
+  EXPECT_EQ(g.getKind(), Grouping::Namespace);
+  EXPECT_FALSE(Grouping{}.parse("dir"));
+  EXPECT_FALSE(Grouping{}.parse("dir:0"));
+  EXPECT_FALSE(Grouping{}.parse("dir:x"));
+  EXPECT_FALSE(Grouping{}.parse("file:1"));
+  EXPECT_FALSE(Grouping{}.parse("module:1"));
+}
+
+namespace {
+ClassRegistry hosts;
+
+Result::FuncResult makeFuncResultOf(const std::string &host,
+                                    const Location &friendDeclLoc) {
+  Result::FuncResult funcRes;
+  funcRes.diagName = "f";
+  funcRes.friendDeclLoc = friendDeclLoc;
+  funcRes.parentClassInfo = hosts.get(Location{"a.h", 1, 1}, host);
+  return funcRes;
+}
+} // unnamed namespace
+
+TEST(Grouping, GroupOf) {
+  auto p = makeFuncResultOf("boost::asio::ip::address<std::map<int, int>>",
+                            Location{"/src/Modules/Core/a.h", 10, 3});
+  Grouping g;
+  ASSERT_TRUE(g.parse("file"));
+  EXPECT_EQ(g.groupOf(p), "/src/Modules/Core/a.h");
+  ASSERT_TRUE(g.parse("dir:2"));
+  EXPECT_EQ(g.groupOf(p), "/src/Modules/");
+  ASSERT_TRUE(g.parse("dir:10"));
+  EXPECT_EQ(g.groupOf(p), "/src/Modules/Core/");
+  ASSERT_TRUE(g.parse("namespace:2"));
+  EXPECT_EQ(g.groupOf(p), "boost::asio");
+  ASSERT_TRUE(g.parse("namespace:5"));
+  EXPECT_EQ(g.groupOf(p), "boost::asio::ip");
+  EXPECT_EQ(g.groupOf(makeFuncResultOf("A<ns::B>", Location{"a.h", 1, 1})),
+            "(global)");
+  ASSERT_TRUE(g.parse("dir:1"));
+  EXPECT_EQ(g.groupOf(makeFuncResultOf("A", Location{"a.h", 1, 1})), ".");
+}
+
+TEST(TopK, KeepsLargest) {
+  TopK top{3};
+  top.add(5, "e");
+  top.add(1, "a");
+  top.add(7, "g");
+  top.add(5, "d");
+  top.add(2, "b");
+  top.add(7, "f");
+  auto result = top.get();
+  ASSERT_EQ(result.size(), 3u);
+  EXPECT_EQ(result[0], TopK::Entry(7, "f"));
+  EXPECT_EQ(result[1], TopK::Entry(7, "g"));
+  EXPECT_EQ(result[2], TopK::Entry(5, "d"));
+  EXPECT_FALSE(top.mayAccept(4));
+}
+
+TEST(TopK, Merge) {
+  TopK a{2}, b{2}, all{2};
+  for (int i = 0; i < 10; ++i) {
+    std::string name(1, 'a' + i);
+    (i % 2 ? a : b).add(i % 4, name);
+    all.add(i % 4, name);
+  }
+  a.merge(b);
+  EXPECT_EQ(a.get(), all.get());
+}
+
+TEST(TopK, Zero) {
+  TopK top;
+  top.add(1, "a");
+  EXPECT_TRUE(top.get().empty());
+}
+
+TEST(BefriendedHosts, Top) {
+  BefriendedHosts a, b;
+  a("A");
+  a("B");
+  b("A");
+  a.merge(b);
+  auto result = a.top(1).get();
+  ASSERT_EQ(result.size(), 1u);
+  EXPECT_EQ(result[0], TopK::Entry(2, "A"));
+}
+
+TEST(BefriendedHosts, Weighted) {
+  BefriendedHosts hosts;
+  hosts("A", 3);
+  hosts("B");
+  hosts("B");
+  auto result = hosts.top(1).get();
+  ASSERT_EQ(result.size(), 1u);
+  EXPECT_EQ(result[0], TopK::Entry(3, "A"));
+}
+
+// An entry with a weight is the same as the entry added weight times.
+TEST(Accumulators, WeightedIsSameAsRepeated) {
+  auto r1 = makeFuncResult(1, 2);
+  auto r2 = makeFuncResult(0, 0);
+  auto r3 = makeFuncResult(3, 4);
+  Average average, averageRepeated;
+  PercentageDistribution percentages, percentagesRepeated;
+  NumberOfUsedPrivsDistribution usedPrivs, usedPrivsRepeated;
+  UsageQuantiles quantiles, quantilesRepeated;
+  for (const auto &entry : {std::make_pair(r1, 5), std::make_pair(r2, 2),
+                            std::make_pair(r3, 1)}) {
+    average(entry.first, entry.second);
+    percentages(entry.first, entry.second);
+    usedPrivs(entry.first, entry.second);
+    quantiles(entry.first, entry.second);
+    for (int i = 0; i < entry.second; ++i) {
+      averageRepeated(entry.first);
+      percentagesRepeated(entry.first);
+      usedPrivsRepeated(entry.first);
+      quantilesRepeated(entry.first);
+    }
+  }
+  EXPECT_EQ(average.num, averageRepeated.num);
+  EXPECT_EQ(average.numZeroDenom, averageRepeated.numZeroDenom);
+  EXPECT_DOUBLE_EQ(average.get(), averageRepeated.get());
+  percentages.flush();
+  percentagesRepeated.flush();
+  const auto &dist = percentages.get();
+  const auto &distRepeated = percentagesRepeated.get();
+  for (std::size_t i = 0; i < dist.size(); ++i) {
+    EXPECT_EQ(dist.count(i), distRepeated.count(i)) << i;
+  }
+  EXPECT_EQ(usedPrivs.dist.get(), usedPrivsRepeated.dist.get());
+  for (double q : {0.0, 0.25, 0.5, 0.75, 1.0}) {
+    EXPECT_EQ(quantiles.get(q), quantilesRepeated.get(q)) << q;
+  }
+
+  average.remove(r1, 5);
+  percentages.remove(r1, 5);
+  usedPrivs.remove(r1, 5);
+  EXPECT_EQ(average.num, 3);
+  EXPECT_EQ(percentages.get().count(percentages.get().bucketOf(0.5)), 0);
+  EXPECT_EQ(usedPrivs.dist.get().count(1), 0u);
+}
+
+TEST(QuantileSketch, WeightedRankErrorIsBounded) {
+  const std::size_t k = 128;
+  QuantileSketch sketch{k};
+  std::vector<double> values;
+  for (int i = 0; i < 20000; ++i) {
+    double value = ((i * 7919) % 1000) / 1000.0;
+    int weight = 1 + i % 7;
+    values.insert(std::end(values), weight, value);
+    sketch.add(value, weight);
+  }
+  EXPECT_EQ(sketch.count(), values.size());
+  checkRankError(sketch, values, k);
+}
+
+TEST(FlatIdSet, InsertAndContains) {
+  FlatIdSet set;
+  for (std::uint64_t id = 0; id < 1000; ++id) {
+    EXPECT_TRUE(set.insert(id * 0x100000000ULL));
+  }
+  EXPECT_EQ(set.size(), 1000u);
+  for (std::uint64_t id = 0; id < 1000; ++id) {
+    EXPECT_FALSE(set.insert(id * 0x100000000ULL));
+    EXPECT_TRUE(set.contains(id * 0x100000000ULL));
+    EXPECT_FALSE(set.contains(id * 0x100000000ULL + 7));
+  }
+  EXPECT_EQ(set.size(), 1000u);
+}
+
+// The ids zero and one are different ids.
+TEST(FlatIdSet, ZeroAndOne) {
+  FlatIdSet set;
+  EXPECT_TRUE(set.insert(1));
+  EXPECT_FALSE(set.contains(0));
+  EXPECT_TRUE(set.insert(0));
+  EXPECT_FALSE(set.insert(0));
+  EXPECT_TRUE(set.contains(0));
+  EXPECT_TRUE(set.contains(1));
+  EXPECT_EQ(set.size(), 2u);
+}
+
+TEST(FlatIdMap, InsertionOrderAndStableValues) {
+  FlatIdMap<int> map;
+  auto first = map.insert(0, 0);
+  EXPECT_TRUE(first.second);
+  for (int i = 1; i < 1000; ++i) {
+    EXPECT_TRUE(map.insert(i * 0x100000000ULL, i).second);
+  }
+  // The values are not moved by the growth of the table.
+  EXPECT_EQ(map.find(0), first.first);
+  auto again = map.insert(5 * 0x100000000ULL, -1);
+  EXPECT_FALSE(again.second);
+  EXPECT_EQ(*again.first, 5);
+  EXPECT_EQ(map.size(), 1000u);
+  EXPECT_EQ(map.find(7), nullptr);
+  int expected = 0;
+  for (int v : map) {
+    EXPECT_EQ(v, expected++);
+  }
+}
+
+TEST(InternedString, SharedStorage) {
+  InternedString a{std::string{"a.h:2:1"}};
+  InternedString b{"a.h:2:1"};
+  InternedString c{"a.h:3:1"};
+  EXPECT_EQ(&a.get(), &b.get());
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_TRUE(a < c);
+  EXPECT_TRUE(InternedString{}.empty());
+  EXPECT_EQ(InternedString{""}, InternedString{});
+  const std::string &s = c;
+  EXPECT_EQ(s, "a.h:3:1");
+}
+
+TEST(Location, Pooled) {
+  Location a{"a.h", 2, 1};
+  EXPECT_EQ(a, (Location{"a.h", 2, 1}));
+  EXPECT_NE(a, (Location{"a.h", 2, 2}));
+  EXPECT_EQ(a.file(), "a.h");
+  EXPECT_EQ(a.line(), 2u);
+  EXPECT_EQ(a.column(), 1u);
+  EXPECT_TRUE(a.spelling().empty());
+  EXPECT_EQ(a.hash(), (Location{"a.h", 2, 1}).hash());
+  EXPECT_TRUE(Location{}.empty());
+  EXPECT_EQ(Location{}, (Location{"", 0, 0}));
+  // By the numbers, not by the rendering.
+  EXPECT_TRUE((Location{"a.h", 9, 1}) < (Location{"a.h", 10, 1}));
+  EXPECT_TRUE((Location{"a.h", 10, 1}) < (Location{"b.h", 1, 1}));
+}
+
+TEST(Location, RenderAndParse) {
+  const char *rendered[] = {
+      "a.h:2:1", "a.h:3:5 <Spelling=b.h:1:2>", "a.h:3:5 <Spelling=line:4:7>",
+      "a.h:3:5 <Spelling=col:7>", "<invalid loc>", "c:\\a.h:3:5"};
+  for (const char *text : rendered) {
+    EXPECT_EQ(toString(parseLocation(text)), text);
+  }
+  Location macro = parseLocation("a.h:3:5 <Spelling=line:4:7>");
+  EXPECT_EQ(macro.line(), 3u);
+  EXPECT_EQ(macro.spelling(), (Location{"a.h", 4, 7}));
+  Location windows = parseLocation("c:\\a.h:3:5");
+  EXPECT_EQ(windows.file(), "c:\\a.h");
+  EXPECT_TRUE(parseLocation("<invalid loc>").isVerbatim());
+  EXPECT_TRUE(parseLocation("a.h:03:5").isVerbatim());
+  EXPECT_TRUE(parseLocation("").empty());
+}
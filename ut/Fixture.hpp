@@ -3,6 +3,7 @@
 #include <gtest/gtest.h>
 #include "clang/Tooling/Tooling.h"
 #include "../FriendStats.hpp"
+#include "../DataIO.hpp"
 
 // Note, it is not nice to do this in a header,
 // but there are no plans to make this visible, or to be used
@@ -39,7 +40,7 @@ struct FriendStats : ::testing::Test {
     Tool.reset(new tooling::ClangTool(*Compilations, Sources));
 
     Finder.addMatcher(FriendMatcher, &Handler);
-    // Dump the whole ast of the translation unit if debug is on
+    // Dump the whole ast of the translation unit if the ast is traced
     Finder.addMatcher(TuMatcher, &tuHandler);
   }
 };
@@ -80,86 +81,66 @@ struct FriendStatsHeader : ::testing::Test {
     Tool.reset(new tooling::ClangTool(*Compilations, Sources));
 
     Finder.addMatcher(FriendMatcher, &Handler);
-    // Dump the whole ast of the translation unit if debug is on
+    // Dump the whole ast of the translation unit if the ast is traced
     Finder.addMatcher(TuMatcher, &tuHandler);
   }
 };
 
 
-inline const Result::FuncResult &getFirstFuncResult(const Result &res) {
-  return (*res.FuncResults.begin()->second.begin()).second;
-}
-inline const Result::FuncResultsForFriendDecl::value_type &getFirstFuncResPair(const Result &res) {
-  return (*res.FuncResults.begin()->second.begin());
-}
-inline const Result::FuncResultsForFriendDecl &
-getFuncResultsFor1stFriendDecl(const Result &res) {
-  return res.FuncResults.begin()->second;
+// The getters follow the order of the output, see sortedFuncDecls.
+using FuncResults = std::vector<const Result::FuncResult *>;
+using ClassResults = std::vector<const Result::ClassResult *>;
+
+inline FuncResults getFuncResultsFor1stFriendDecl(const Result &res) {
+  return sortedFuncResults(*sortedFuncDecls(res).at(0));
 }
-inline const Result::FuncResultsForFriendDecl &
-getFuncResultsFor2ndFriendDecl(const Result &res) {
+inline FuncResults getFuncResultsFor2ndFriendDecl(const Result &res) {
   assert(res.FuncResults.size() > 1);
-  return (++res.FuncResults.begin())->second;
+  return sortedFuncResults(*sortedFuncDecls(res).at(1));
 }
-inline const Result::FuncResult &
-get1stFuncResult(const Result::FuncResultsForFriendDecl &r) {
-  return r.begin()->second;
+inline const Result::FuncResult &get1stFuncResult(const FuncResults &r) {
+  return *r.at(0);
 }
-inline const Result::FuncResult &
-get2ndFuncResult(const Result::FuncResultsForFriendDecl &r) {
+inline const Result::FuncResult &get2ndFuncResult(const FuncResults &r) {
   assert(r.size() > 1);
-  return (++r.begin())->second;
+  return *r.at(1);
+}
+inline const Result::FuncResult &getFirstFuncResult(const Result &res) {
+  return get1stFuncResult(getFuncResultsFor1stFriendDecl(res));
 }
 
 // Class specific result getters
-inline const Result::ClassResultsForFriendDecl &
-getClassResultsFor1stFriendDecl(const Result &res) {
-  return res.ClassResults.begin()->second;
+inline ClassResults getClassResultsFor1stFriendDecl(const Result &res) {
+  return sortedClassResults(*sortedClassDecls(res).at(0));
 }
-inline const Result::ClassResultsForFriendDecl &
-getClassResultsFor2ndFriendDecl(const Result &res) {
-  return (++res.ClassResults.begin())->second;
+inline ClassResults getClassResultsFor2ndFriendDecl(const Result &res) {
+  return sortedClassResults(*sortedClassDecls(res).at(1));
 }
-inline const Result::ClassResult &
-get1stClassResult(const Result::ClassResultsForFriendDecl &r) {
-  return r.begin()->second;
+inline const Result::ClassResult &get1stClassResult(const ClassResults &r) {
+  return *r.at(0);
 }
-inline const Result::ClassResult &
-get2ndClassResult(const Result::ClassResultsForFriendDecl &r) {
+inline const Result::ClassResult &get2ndClassResult(const ClassResults &r) {
   assert(r.size() > 1);
-  return (++r.begin())->second;
+  return *r.at(1);
 }
-inline const Result::ClassResult &
-get3rdClassResult(const Result::ClassResultsForFriendDecl &r) {
+inline const Result::ClassResult &get3rdClassResult(const ClassResults &r) {
   assert(r.size() > 2);
-  auto it = r.begin();
-  ++it;
-  ++it;
-  return it->second;
+  return *r.at(2);
 }
-// TODO use getNthMemberFuncResult(const Result::ClassResult &r, std::size_t N)
 inline const Result::FuncResult &
-get1stMemberFuncResult(const Result::ClassResult &r) {
-  //return r.memberFuncResults.at(0).funcResult;
-  assert(r.memberFuncResults.size() > 0);
-  return r.memberFuncResults.begin()->second;
+getNthMemberFuncResult(const Result::ClassResult &r, std::size_t N) {
+  assert(r.memberFuncResults.size() > N-1);
+  return *sortedFuncResults(r).at(N - 1);
 }
 inline const Result::FuncResult &
-get2ndMemberFuncResult(const Result::ClassResult &r) {
-  assert(r.memberFuncResults.size() > 1);
-  auto it = r.memberFuncResults.begin();
-  ++it;
-  return it->second;
+get1stMemberFuncResult(const Result::ClassResult &r) {
+  return getNthMemberFuncResult(r, 1);
 }
 inline const Result::FuncResult &
-getNthMemberFuncResult(const Result::ClassResult &r, std::size_t N) {
-  assert(r.memberFuncResults.size() > N-1);
-  auto it = r.memberFuncResults.begin();
-  std::advance(it, N-1);
-  return it->second;
+get2ndMemberFuncResult(const Result::ClassResult &r) {
+  return getNthMemberFuncResult(r, 2);
 }
 inline const Result::FuncResult &getFirstMemberFuncResult(const Result &res) {
   return get1stMemberFuncResult(
       get1stClassResult(getClassResultsFor1stFriendDecl(res)));
 }
-
@@ -1,4 +1,5 @@
 #include "../FriendStats.hpp"
+#include "../StatisticsState.hpp"
 #include "Fixture.hpp"
 
 using namespace clang::tooling;
@@ -8,14 +9,14 @@ using namespace clang;
 TEST_F(FriendStats, ClassCount) {
   Tool->mapVirtualFile(FileA, "class A { friend class B; }; class B {};");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
 }
 
 TEST_F(FriendStats, ClassCount_ExtendedFriend) {
   Tool->mapVirtualFile(FileA, "class Y {}; class A { friend Y; }; ");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
 }
 
@@ -38,7 +39,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -68,7 +69,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -96,7 +97,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -130,7 +131,7 @@ void foo() {
 }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -165,7 +166,7 @@ public:
 void foo () { B b; }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -192,7 +193,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -222,7 +223,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -242,6 +243,35 @@ class B {
   }
 }
 
+// The instances are identified by their names, so the overloads are merged,
+// the first one is kept.
+TEST_F(FriendClassesStats, OverloadedMemberFunctions) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A {
+  int a = 0;
+  int b;
+  friend class B;
+};
+class B {
+  void func(A &a) {
+    a.a = 1;
+    a.b = 2;
+  }
+  void func(A &a, int) {
+    a.a = 1;
+  }
+};
+    )");
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.ClassResults.size(), 1u);
+
+  const auto &cr = get1stClassResult(getClassResultsFor1stFriendDecl(res));
+  ASSERT_EQ(cr.memberFuncResults.size(), 1u);
+  EXPECT_EQ(get1stMemberFuncResult(cr).usedPrivateVarsCount, 2);
+}
+
 TEST_F(FriendClassesStats, MemberFunctionsAndMemberFunctionTemplates) {
   Tool->mapVirtualFile(FileA,
                        R"(
@@ -270,7 +300,7 @@ template void B::func3<int>(A&);
 template void B::func3<char>(A&);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -323,7 +353,7 @@ class C {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 2);
   ASSERT_EQ(res.ClassResults.size(), 2u);
 
@@ -369,7 +399,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -401,7 +431,7 @@ class B {
 template class B<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -442,7 +472,7 @@ template class B<int>;
 template class C<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 2);
   ASSERT_EQ(res.ClassResults.size(), 2u);
 
@@ -496,7 +526,7 @@ class B<char> {
 template class B<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -548,7 +578,7 @@ template class B<int>;
 template void B<int>::func<char>(A &a);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -588,7 +618,7 @@ template void B<int>::func<char>(A &a);
 template void B<int>::func<float>(A &a);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -627,7 +657,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -669,7 +699,7 @@ class B {
 template class B::C<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -707,7 +737,7 @@ class B {
 template class B::C<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -757,7 +787,7 @@ template class B<int>;
 template class B<int>::C<int>;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -799,7 +829,7 @@ class B {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -858,7 +888,7 @@ class B<char> {
 };
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -922,7 +952,7 @@ class B<char> {
 };
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -979,7 +1009,7 @@ template void B<int>::func<char>(A&);
 template void B<int>::func<int>(A&);
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -1038,7 +1068,7 @@ template void B<int>::func<char>(A&);
 template void B<int>::func<int>(A&);
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -1061,6 +1091,118 @@ template void B<int>::func<int>(A&);
   }
 }
 
+namespace {
+// Replaces the contribution of each translation unit in the state right
+// after it is analyzed, like -state does.
+struct StateUpdater : SourceFileCallbacks {
+  FriendHandler &handler;
+  StatisticsState &state;
+  std::string currentFile;
+  StateUpdater(FriendHandler &handler, StatisticsState &state)
+      : handler(handler), state(state) {}
+  bool handleBeginSource(CompilerInstance &, StringRef Filename) override {
+    currentFile = Filename;
+    return true;
+  }
+  void handleEndSource() override {
+    state.replace(currentFile, handler.takeContribution());
+  }
+};
+
+// Runs a recording handler on the files and updates the state.
+void updateState(ClangTool &tool, StatisticsState &state) {
+  FriendHandler handler;
+  handler.setRecording(true);
+  MatchFinder finder;
+  finder.addMatcher(FriendMatcher, &handler);
+  StateUpdater updater{handler, state};
+  tool.run(newFrontendActionFactory(&finder, &updater).get());
+}
+
+// Every entry of the result is counted, like in the statistics of a run.
+void addEntries(const Result &result, StatisticsState &state) {
+  Contribution contribution;
+  std::uint64_t id = 0;
+  for (const Result::FuncDecl *friendDecl : sortedFuncDecls(result)) {
+    for (const Result::FuncResult *funcRes : sortedFuncResults(*friendDecl)) {
+      contribution.funcs.emplace_back(++id, *funcRes);
+    }
+  }
+  for (const Result::ClassDecl *friendDecl : sortedClassDecls(result)) {
+    for (const Result::ClassResult *classResult :
+         sortedClassResults(*friendDecl)) {
+      for (const Result::FuncResult *funcRes :
+           sortedFuncResults(*classResult)) {
+        contribution.classFuncs.emplace_back(++id, *funcRes);
+      }
+    }
+  }
+  state.replace("result", contribution);
+}
+
+void expectSameStatistics(const StatisticsState::Part &a,
+                          const StatisticsState::Part &b) {
+  EXPECT_EQ(a.average.num, b.average.num);
+  EXPECT_DOUBLE_EQ(a.average.sum, b.average.sum);
+  EXPECT_EQ(a.quantiles.counts, b.quantiles.counts);
+  EXPECT_EQ(a.usedPrivsDistribution.dist.get(),
+            b.usedPrivsDistribution.dist.get());
+  EXPECT_EQ(a.meyersCandidate.count, b.meyersCandidate.count);
+}
+} // unnamed namespace
+
+// The results of the friend class declaration are kept from the first
+// translation unit only, so B::f<char> is dropped. The state counts the
+// same instances as the run, also when b.cc is analyzed again alone.
+TEST_F(FriendStatsHeader, StateOfFriendClassInDifferentTranslationUnits) {
+  const char *header = R"(
+class A {
+  int a;
+  int b;
+  friend class B;
+  friend void func(A &);
+};
+inline void func(A &a) { a.a = 1; }
+class B {
+  template <typename T> void f(A &a, T) {
+    a.a = 1;
+    a.b = 2;
+  }
+};
+    )";
+  const char *fileB = R"(
+#include "a.h"
+template void B::f<char>(A &, char);
+)";
+  Tool->mapVirtualFile(HeaderA, header);
+  Tool->mapVirtualFile(FileA, R"(
+#include "a.h"
+template void B::f<int>(A &, int);
+)");
+  Tool->mapVirtualFile(FileB, fileB);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  StatisticsState expected;
+  addEntries(Handler.getResult(), expected);
+  EXPECT_EQ(expected.func.average.num, 1);
+  EXPECT_EQ(expected.clazz.average.num, 1);
+
+  StatisticsState state;
+  updateState(*Tool, state);
+  EXPECT_EQ(state.numUnits(), 2u);
+  expectSameStatistics(state.func, expected.func);
+  expectSameStatistics(state.clazz, expected.clazz);
+
+  // Only b.cc is analyzed again.
+  std::vector<std::string> sourcesB;
+  sourcesB.push_back(FileB.str());
+  ClangTool toolB(*Compilations, sourcesB);
+  toolB.mapVirtualFile(HeaderA, header);
+  toolB.mapVirtualFile(FileB, fileB);
+  updateState(toolB, state);
+  expectSameStatistics(state.func, expected.func);
+  expectSameStatistics(state.clazz, expected.clazz);
+}
+
 TEST_F(FriendClassesStats, UseInClassDeclContext) {
   Tool->mapVirtualFile(FileA,
                        R"(
@@ -1078,7 +1220,7 @@ public:
 void foo () { B b; }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendClassDeclCount, 1);
   ASSERT_EQ(res.ClassResults.size(), 1u);
 
@@ -1089,3 +1231,53 @@ void foo () { B b; }
   const Result::FuncResult &fr = get1stMemberFuncResult(cr);
   EXPECT_EQ(fr.types.usedPrivateCount, 1);
 }
+
+// The body of B::member is summarized once and evaluated for both
+// befriending classes.
+TEST_F(FriendClassesStats, SameFriendClassOfMoreHosts) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A1 {
+  int a;
+  friend class B;
+};
+class A2 {
+  int x, y;
+  struct T {};
+  friend class B;
+};
+class B {
+public:
+  void member(A1 &a1, A2 &a2) {
+    a1.a = a2.x + a2.y;
+    A2::T t;
+  }
+};
+    )");
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.friendClassDeclCount, 2);
+  ASSERT_EQ(res.ClassResults.size(), 2u);
+  {
+    // A1
+    const auto &crs = getClassResultsFor1stFriendDecl(res);
+    ASSERT_EQ(crs.size(), 1u);
+    const auto &cr = get1stClassResult(crs);
+    ASSERT_EQ(cr.memberFuncResults.size(), 1u);
+    const Result::FuncResult &fr = get1stMemberFuncResult(cr);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 1);
+    EXPECT_EQ(fr.parentPrivateVarsCount, 1);
+    EXPECT_EQ(fr.types.usedPrivateCount, 0);
+  }
+  {
+    // A2
+    const auto &crs = getClassResultsFor2ndFriendDecl(res);
+    ASSERT_EQ(crs.size(), 1u);
+    const auto &cr = get1stClassResult(crs);
+    ASSERT_EQ(cr.memberFuncResults.size(), 1u);
+    const Result::FuncResult &fr = get1stMemberFuncResult(cr);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 2);
+    EXPECT_EQ(fr.parentPrivateVarsCount, 2);
+    EXPECT_EQ(fr.types.usedPrivateCount, 1);
+  }
+}
@@ -12,10 +12,10 @@ using namespace clang;
 
 template <typename T>
 void printFuncResults(const T& res) {
-  for (const auto &v : res.FuncResults) {
-    llvm::outs() << "FriendDeclId: " << v.first << "\n";
-    for (const auto funcResPair : v.second) {
-      print(funcResPair);
+  for (const auto *friendDecl : sortedFuncDecls(res)) {
+    llvm::outs() << "FriendDeclId: " << friendDecl->friendDeclLoc << "\n";
+    for (const auto *funcRes : sortedFuncResults(*friendDecl)) {
+      printFuncInstance(*funcRes);
     }
   }
 }
@@ -24,7 +24,7 @@ TEST_F(FriendStats, FuncCount) {
   Tool->mapVirtualFile(FileA,
                        "class A { friend void func(); }; void func(){};");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
 }
 
@@ -43,7 +43,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -69,7 +69,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -98,7 +98,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -139,7 +139,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -161,7 +161,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -187,7 +187,7 @@ class A {
 void foo() { XXX<int>::A x; bool b = x == x; }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -211,7 +211,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -229,7 +229,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -250,7 +250,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -272,7 +272,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -296,7 +296,7 @@ void func(A &a) {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -320,7 +320,7 @@ int A::a = 0;
 int A::b = 0;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -342,7 +342,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -365,7 +365,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -389,7 +389,7 @@ public:
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -414,7 +414,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -435,7 +435,7 @@ public:
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -458,7 +458,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -479,7 +479,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -502,7 +502,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -522,7 +522,7 @@ A::Double func(A::Int) {
 }
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -539,7 +539,7 @@ class A {
 A::Int func(A::Int) { return 0; }
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -560,7 +560,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -589,7 +589,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -622,7 +622,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -654,7 +654,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -677,7 +677,7 @@ void func() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -725,21 +725,23 @@ void g() {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 2);
   ASSERT_EQ(res.FuncResults.size(), 2u);
 
   {
+    // f, the friend declarations are in the order of their lines.
     const Result::FuncResult &fr =
         get1stFuncResult(getFuncResultsFor1stFriendDecl(res));
     EXPECT_EQ(fr.types.usedPrivateCount, 1);
-    EXPECT_EQ(fr.types.parentPrivateCount, 3);
+    EXPECT_EQ(fr.types.parentPrivateCount, 2);
   }
   {
+    // g
     const Result::FuncResult &fr =
         get1stFuncResult(getFuncResultsFor2ndFriendDecl(res));
     EXPECT_EQ(fr.types.usedPrivateCount, 1);
-    EXPECT_EQ(fr.types.parentPrivateCount, 2);
+    EXPECT_EQ(fr.types.parentPrivateCount, 3);
   }
 }
 
@@ -761,7 +763,7 @@ void func(A::Int) {
 }
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 }
@@ -780,7 +782,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -800,7 +802,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -820,7 +822,7 @@ class A {
 };
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -843,10 +845,99 @@ class A {
 template void f<int>(int);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
 }
 
+TEST_F(TemplateFriendStats, MaxSpecializations) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A;
+template <typename T> void func(T, A a);
+class A {
+  int a = 0;
+  template <typename T>
+  friend void func(T, A a) { a.a = 1; }
+};
+template void func<char>(char, A);
+template void func<short>(short, A);
+template void func<int>(int, A);
+template void func<long>(long, A);
+template void func<double>(double, A);
+    )");
+  Handler.setMaxSpecializations(2);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 1u);
+  const auto &frs = getFuncResultsFor1stFriendDecl(res);
+  ASSERT_EQ(frs.size(), 2u);
+  for (const auto *funcRes : frs) {
+    EXPECT_TRUE(funcRes->sampled);
+    EXPECT_EQ(funcRes->usedPrivateVarsCount, 1);
+  }
+  ASSERT_EQ(res.sampledTemplates.size(), 1u);
+  const auto &sampledTemplate = res.sampledTemplates.begin()->second;
+  EXPECT_EQ(sampledTemplate.diagName, "func");
+  EXPECT_EQ(sampledTemplate.numSpecializations, 5);
+  EXPECT_EQ(sampledTemplate.numAnalyzed, 2);
+}
+
+TEST_F(TemplateFriendStats, CollapseSpecializations) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A;
+template <typename T> void func(T, A a);
+class A {
+  int a = 0;
+  int b = 0;
+  template <typename T>
+  friend void func(T, A a) { a.a = 1; }
+};
+template void func<char>(char, A);
+template void func<short>(short, A);
+template void func<int>(int, A);
+    )");
+  Handler.setCollapsing(true);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 1u);
+  const auto &frs = getFuncResultsFor1stFriendDecl(res);
+  ASSERT_EQ(frs.size(), 1u);
+  EXPECT_EQ(get1stFuncResult(frs).multiplicity, 3);
+  EXPECT_EQ(get1stFuncResult(frs).usedPrivateVarsCount, 1);
+}
+
+TEST_F(TemplateFriendStats, PatternMode) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+template <typename T> class A;
+template <typename T> void func(A<T> &a);
+template <typename T> class A {
+  int a = 0;
+  int b;
+  friend void func<T>(A &a);
+};
+template <typename T> void func(A<T> &a) { a.a = 1; }
+void use() {
+  A<int> a;
+  A<double> ad;
+  func(a);
+  func(ad);
+}
+    )");
+  Handler.setPatternMode(true);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 1u);
+  const auto &frs = getFuncResultsFor1stFriendDecl(res);
+  ASSERT_EQ(frs.size(), 1u);
+  const auto &fr = get1stFuncResult(frs);
+  EXPECT_TRUE(fr.approximate);
+  // a.a is resolved by its name.
+  EXPECT_EQ(fr.usedPrivateVarsCount, 1);
+  EXPECT_EQ(fr.parentPrivateVarsCount, 2);
+}
+
 TEST_F(TemplateFriendStats,
        NumberOfUsedPrivateOrProtectedVariablesInFriendFunc) {
   Tool->mapVirtualFile(FileA,
@@ -866,7 +957,7 @@ class A {
 template void func<int>(int, A);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -893,7 +984,7 @@ void func(T, A& a) {
 template void func<int>(int, A&);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -934,7 +1025,7 @@ template void func<double>(double, A&);
 void fooo() { A a; func<double>(1.0,a); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -978,7 +1069,7 @@ void foo() { A a; func<double>(1.0, a); } //CC
 template <typename T> void func(T*, A&) {} //CD
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -1009,7 +1100,7 @@ template <typename T> class A {
 void f() { A<int> aint; func(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1033,7 +1124,7 @@ void f1() { A<int> aint; func(aint); }
 void f2() { A<char> aint; func(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
   EXPECT_EQ(res.FuncResults.size(), 1u);
   {
@@ -1073,18 +1164,20 @@ void f1() { A<int> aint; func(aint); }
 void f2() { A<float> aint; func(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 2);
   ASSERT_EQ(res.FuncResults.size(), 2u);
   {
+    // A<int>, its friend declaration comes first.
     auto fr = getFirstFuncResult(res);
-    EXPECT_EQ(fr.usedPrivateVarsCount, 1);
-    EXPECT_EQ(fr.parentPrivateVarsCount, 2);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 2);
+    EXPECT_EQ(fr.parentPrivateVarsCount, 3);
   }
   {
+    // A<float>
     auto fr = get1stFuncResult(getFuncResultsFor2ndFriendDecl(res));
-    EXPECT_EQ(fr.usedPrivateVarsCount, 2);
-    EXPECT_EQ(fr.parentPrivateVarsCount, 3);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 1);
+    EXPECT_EQ(fr.parentPrivateVarsCount, 2);
   }
 }
 
@@ -1104,7 +1197,7 @@ template <typename T> class A {
 void f() { A<int> aint; func(1, aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1131,20 +1224,22 @@ template <typename T> class A {
 void f() { A<int> aint; func(1, aint); func2(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 2);
   ASSERT_EQ(res.FuncResults.size(), 2u);
 
   {
+    // func2
     const Result::FuncResult &fr =
         get1stFuncResult(getFuncResultsFor1stFriendDecl(res));
-    EXPECT_EQ(fr.usedPrivateVarsCount, 2);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 1);
     EXPECT_EQ(fr.parentPrivateVarsCount, 3);
   }
   {
+    // func
     const Result::FuncResult &fr =
         get1stFuncResult(getFuncResultsFor2ndFriendDecl(res));
-    EXPECT_EQ(fr.usedPrivateVarsCount, 1);
+    EXPECT_EQ(fr.usedPrivateVarsCount, 2);
     EXPECT_EQ(fr.parentPrivateVarsCount, 3);
   }
 }
@@ -1163,7 +1258,7 @@ template <typename T> class A {
 void f() { A<int> aint; func2(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1188,7 +1283,7 @@ class A<T*> {
 void f() { A<int*> aint; func2(aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   //ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   ASSERT_EQ(getFuncResultsFor1stFriendDecl(res).size(), 1u);
@@ -1217,7 +1312,7 @@ template <typename T> class A {
 void f() { A<int> aint; func(1, aint); }
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1250,7 +1345,7 @@ void func(A<T>& a) {
 template void func(A<int>& a);
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   ASSERT_EQ(getFuncResultsFor1stFriendDecl(res).size(), 1u);
@@ -1259,6 +1354,83 @@ template void func(A<int>& a);
   EXPECT_EQ(fr.parentPrivateVarsCount, 3);
 }
 
+TEST_F(FriendStats, PlanWithoutUsage) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A {
+  int a = 0;
+  int b;
+  friend void func(A &x) { x.a = 1; }
+  friend void outOfLine(A &x);
+};
+void outOfLine(A &x) { x.b = 1; }
+    )");
+  AnalysisPlan plan;
+  plan.usage = false;
+  plan.defLocations = false;
+  Handler.setPlan(plan);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 2u);
+  const auto &inClass = get1stFuncResult(getFuncResultsFor1stFriendDecl(res));
+  EXPECT_EQ(inClass.usedPrivateVarsCount, 0);
+  EXPECT_EQ(inClass.parentPrivateVarsCount, 2);
+  // The in-class definition still has the location of the declaration.
+  EXPECT_EQ(inClass.defLoc, inClass.friendDeclLoc);
+  const auto &outOfLine =
+      get1stFuncResult(getFuncResultsFor2ndFriendDecl(res));
+  EXPECT_TRUE(outOfLine.defLoc.empty());
+}
+
+TEST_F(FriendStats, PlanWithoutExactUsage) {
+  Tool->mapVirtualFile(FileA,
+                       R"(
+class A {
+  int a = 0;
+  int b;
+  static int s;
+  void m() {}
+  struct Inner {};
+  friend void vars(A &x) { x.a = 1; x.b = 2; }
+  friend void staticVar() { A::s = 1; }
+  friend void method(A &x) { x.m(); }
+  friend void type() { Inner i; (void)i; }
+  friend void none(A &) {}
+};
+    )");
+  Tool->run(newFrontendActionFactory(&Finder).get());
+
+  FriendHandler anyHandler;
+  AnalysisPlan plan;
+  plan.exactUsage = false;
+  anyHandler.setPlan(plan);
+  MatchFinder anyFinder;
+  anyFinder.addMatcher(FriendMatcher, &anyHandler);
+  Tool->run(newFrontendActionFactory(&anyFinder).get());
+
+  const Result &exact = Handler.getResult();
+  const Result &any = anyHandler.getResult();
+  ASSERT_EQ(any.FuncResults.size(), 5u);
+  ASSERT_EQ(exact.FuncResults.size(), any.FuncResults.size());
+  ZeroPrivInFriend zpf;
+  IncorrectFriendClassFunctionInstance incorrect;
+  SelfDiagnostics diags;
+  const auto exactDecls = sortedFuncDecls(exact);
+  const auto anyDecls = sortedFuncDecls(any);
+  for (std::size_t i = 0; i < exactDecls.size(); ++i) {
+    ASSERT_EQ(anyDecls[i]->friendDeclLoc, exactDecls[i]->friendDeclLoc);
+    const auto &exactRes = *exactDecls[i]->instances.at(0);
+    const auto &anyRes = *anyDecls[i]->instances.at(0);
+    EXPECT_EQ(zpf(anyRes), zpf(exactRes)) << exactRes.diagName.get();
+    EXPECT_EQ(incorrect(anyRes), incorrect(exactRes));
+    EXPECT_TRUE(diags(anyRes));
+    if (exactRes.diagName.get() == "vars") {
+      EXPECT_EQ(exactRes.usedPrivateVarsCount, 2);
+      EXPECT_EQ(anyRes.usedPrivateVarsCount, 1);
+    }
+  }
+}
+
 // ================= Duplicate Tests ======================================== //
 
 TEST_F(FriendStatsHeader, NoDuplicateCountOnClasses) {
@@ -1266,7 +1438,7 @@ TEST_F(FriendStatsHeader, NoDuplicateCountOnClasses) {
   Tool->mapVirtualFile(FileA, R"(#include "a.h")");
   Tool->mapVirtualFile(FileB, R"(#include "a.h")");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendClassDeclCount, 1);
 }
 
@@ -1282,10 +1454,64 @@ TEST_F(FriendStatsHeader, NoDuplicateCountOnFunctions) {
     )");
   Tool->mapVirtualFile(FileB, R"(#include "a.h")");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
 }
 
+namespace {
+struct CountingSink : ResultSink {
+  int funcInstances = 0;
+  int classFuncInstances = 0;
+  void funcInstance(const Result::FuncResult &) { ++funcInstances; }
+  void classFuncInstance(const Result::FuncResult &) {
+    ++classFuncInstances;
+  }
+};
+} // unnamed namespace
+
+TEST_F(FriendStatsHeader, NoDuplicateCountInStreamingMode) {
+  Tool->mapVirtualFile(HeaderA,
+                       R"(
+class A {
+  int a;
+  friend void func(A &);
+  friend class B;
+};
+inline void func(A &a) { a.a = 1; }
+class B { void f(A &a) { a.a = 2; } };
+    )");
+  Tool->mapVirtualFile(FileA, R"(#include "a.h")");
+  Tool->mapVirtualFile(FileB, R"(#include "a.h")");
+  CountingSink sink;
+  Handler.setSink(&sink);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  EXPECT_EQ(res.friendFuncDeclCount, 1);
+  EXPECT_EQ(res.friendClassDeclCount, 1);
+  EXPECT_EQ(res.FuncResults.size(), 0u);
+  EXPECT_EQ(res.ClassResults.size(), 0u);
+  EXPECT_EQ(sink.funcInstances, 1);
+  EXPECT_EQ(sink.classFuncInstances, 1);
+}
+
+TEST_F(FriendStatsHeader, ExcludePath) {
+  Tool->mapVirtualFile(HeaderA,
+                       "class A { int a; friend void f(A &x) { x.a = 1; } };");
+  Tool->mapVirtualFile(FileA, R"(
+#include "a.h"
+class B { int b; friend void g(B &x) { x.b = 1; } };
+    )");
+  Tool->mapVirtualFile(FileB, R"(#include "a.h")");
+  PathFilter pathFilter;
+  std::string error;
+  ASSERT_TRUE(pathFilter.parse("", "a\\.h$", error)) << error;
+  Handler.setPathFilter(pathFilter);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  const auto &res = Handler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 1u);
+  EXPECT_EQ(getFirstFuncResult(res).diagName, "g");
+}
+
 TEST_F(
     FriendStatsHeader,
     DifferentFriendFunctionTemplateSpecializationsInDifferentTranslationUnits) {
@@ -1318,7 +1544,7 @@ template void func(A<int>& a);
 template void func(A<char>& a);
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1362,7 +1588,7 @@ template void func(A<int>& a);
 template void func(A<int>& a);
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   EXPECT_EQ(getFuncResultsFor1stFriendDecl(res).size(), 1u);
@@ -1406,7 +1632,7 @@ using XXX = Z<T>;
 template void func(A<XXX<char>::type>& a);
 )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   EXPECT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
   auto fr = getFirstFuncResult(res);
@@ -1438,7 +1664,7 @@ Rational<int> oneHalf(1, 2);
 Rational<int> result = oneHalf * 2;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -1446,8 +1672,8 @@ Rational<int> result = oneHalf * 2;
   ASSERT_EQ(zpf(getFirstFuncResult(res)), true);
 
   MeyersCandidate mc;
-  const auto& funcResPair = getFirstFuncResPair(res);
-  EXPECT_EQ(mc(funcResPair), true);
+  const auto& funcRes = getFirstFuncResult(res);
+  EXPECT_EQ(mc(funcRes), true);
 }
 
 TEST_F(FriendStats, NotMeyersBecauseNotTemplateClass) {
@@ -1467,7 +1693,7 @@ Rational oneHalf(1, 2);
 Rational result = oneHalf * 2;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -1475,8 +1701,8 @@ Rational result = oneHalf * 2;
   ASSERT_EQ(zpf(getFirstFuncResult(res)), true);
 
   MeyersCandidate mc;
-  const auto& funcResPair = getFirstFuncResPair(res);
-  EXPECT_EQ(mc(funcResPair), false);
+  const auto& funcRes = getFirstFuncResult(res);
+  EXPECT_EQ(mc(funcRes), false);
 }
 
 TEST_F(FriendStats, NotMeyersBecauseOutOfClassFriendDef) {
@@ -1508,7 +1734,7 @@ template void func(A<int>& a);
 
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -1516,8 +1742,8 @@ template void func(A<int>& a);
   ASSERT_EQ(zpf(getFirstFuncResult(res)), true);
 
   MeyersCandidate mc;
-  const auto& funcResPair = getFirstFuncResPair(res);
-  EXPECT_EQ(mc(funcResPair), false);
+  const auto& funcRes = getFirstFuncResult(res);
+  EXPECT_EQ(mc(funcRes), false);
 }
 
 TEST_F(FriendStats, NotMeyersBecauseOfPrivUsage) {
@@ -1538,7 +1764,7 @@ Rational<int> oneHalf(1, 2);
 Rational<int> result = oneHalf * 2;
     )");
   Tool->run(newFrontendActionFactory(&Finder).get());
-  auto res = Handler.getResult();
+  const auto &res = Handler.getResult();
   ASSERT_EQ(res.friendFuncDeclCount, 1);
   ASSERT_EQ(res.FuncResults.size(), 1u);
 
@@ -1546,6 +1772,6 @@ Rational<int> result = oneHalf * 2;
   ASSERT_EQ(zpf(getFirstFuncResult(res)), false);
 
   MeyersCandidate mc;
-  const auto& funcResPair = getFirstFuncResPair(res);
-  EXPECT_EQ(mc(funcResPair), false);
+  const auto& funcRes = getFirstFuncResult(res);
+  EXPECT_EQ(mc(funcRes), false);
 }
@@ -0,0 +1,245 @@
+#include <chrono>
+#include "../FriendStats.hpp"
+#include "../DataIO.hpp"
+#include "Fixture.hpp"
+
+using namespace clang::tooling;
+using namespace llvm;
+using namespace clang;
+
+namespace {
+std::string write(const Result &result) {
+  std::string s;
+  llvm::raw_string_ostream os{s};
+  writeResult(os, result);
+  return os.str();
+}
+
+// Friend functions, friend function templates, friend classes and friend
+// class templates in class templates and in classes.
+const char *mixedFriendsCode = R"(
+template <typename T> class A;
+template <typename T> void func(A<T> &a);
+class B;
+template <typename T> class C;
+
+template <typename T> class A {
+  int a = 0;
+  int b;
+  friend void func<T>(A &a);
+  friend class B;
+  template <typename U> friend class C;
+  class Nested {
+    int n;
+    friend void nestedFriend(Nested &x) { x.n = 1; }
+  };
+};
+template <typename T> void func(A<T> &a) { a.a = 1; }
+class B {
+  void f(A<int> &a) { a.b = 2; }
+};
+template <typename T> class C {
+  void g(A<int> &a) { a.a = 3; a.b = 4; }
+};
+
+class D {
+  int d;
+  friend void h(D &x) { x.d = 1; }
+  friend class B;
+};
+
+void use() {
+  A<int> a;
+  A<double> ad;
+  func(a);
+  func(ad);
+  C<int> c;
+}
+    )";
+} // unnamed namespace
+
+struct FriendIndexerStats : FriendStats {
+  FriendHandler IndexerHandler;
+  FriendIndexerFactory IndexerFactory{IndexerHandler};
+};
+
+TEST_F(FriendIndexerStats, SameAsMatcher) {
+  Tool->mapVirtualFile(FileA, mixedFriendsCode);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  const Result &expected = Handler.getResult();
+  const Result &actual = IndexerHandler.getResult();
+  EXPECT_EQ(actual.friendFuncDeclCount, expected.friendFuncDeclCount);
+  EXPECT_EQ(actual.friendClassDeclCount, expected.friendClassDeclCount);
+  EXPECT_EQ(write(actual), write(expected));
+  EXPECT_FALSE(actual.FuncResults.empty());
+  EXPECT_FALSE(actual.ClassResults.empty());
+}
+
+TEST_F(FriendIndexerStats, ParallelSameAsSerial) {
+  Tool->mapVirtualFile(FileA, mixedFriendsCode);
+  IndexerHandler.setAnalysisThreads(4);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  const Result &expected = Handler.getResult();
+  const Result &actual = IndexerHandler.getResult();
+  EXPECT_EQ(actual.friendFuncDeclCount, expected.friendFuncDeclCount);
+  EXPECT_EQ(actual.friendClassDeclCount, expected.friendClassDeclCount);
+  EXPECT_EQ(write(actual), write(expected));
+}
+
+// The friend classes have member function templates and nested class
+// templates, their specializations are read by the analysis threads.
+TEST_F(FriendIndexerStats, ParallelWithMemberTemplatesSameAsSerial) {
+  Tool->mapVirtualFile(FileA, R"(
+class B;
+template <typename T> class C;
+class A {
+  int a;
+  int b;
+  friend class B;
+  template <typename T> friend class C;
+};
+class B {
+  template <typename U> void f(A &x, U) { x.a = 1; }
+  template <typename U> struct Nested {
+    void g(A &x) { x.b = 2; }
+    template <typename V> void h(A &x, V) { x.a = 3; }
+  };
+public:
+  void use(A &x) {
+    f(x, 1);
+    f(x, 'c');
+    Nested<int>{}.g(x);
+    Nested<char>{}.h(x, 1.0);
+  }
+};
+template <typename T> class C {
+  template <typename U> void f(A &x, U) { x.a = 4; }
+  template <typename U> struct Nested {
+    void g(A &x) { x.b = 5; }
+  };
+public:
+  void use(A &x) {
+    f(x, T{});
+    Nested<T>{}.g(x);
+  }
+};
+void use(A &x) {
+  C<int>{}.use(x);
+  C<double>{}.use(x);
+}
+    )");
+  IndexerHandler.setAnalysisThreads(4);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  const Result &expected = Handler.getResult();
+  const Result &actual = IndexerHandler.getResult();
+  EXPECT_EQ(actual.friendClassDeclCount, expected.friendClassDeclCount);
+  EXPECT_EQ(write(actual), write(expected));
+  EXPECT_FALSE(actual.ClassResults.empty());
+}
+
+TEST_F(FriendIndexerStats, BatchedSameAsSerial) {
+  Tool->mapVirtualFile(FileA, mixedFriendsCode);
+  IndexerHandler.setBatching(true);
+  Tool->run(newFrontendActionFactory(&Finder).get());
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  EXPECT_EQ(write(IndexerHandler.getResult()), write(Handler.getResult()));
+
+  // Batched and parallel.
+  FriendHandler parallelHandler;
+  parallelHandler.setBatching(true);
+  parallelHandler.setAnalysisThreads(4);
+  FriendIndexerFactory parallelFactory{parallelHandler};
+  Tool->run(newFrontendActionFactory(&parallelFactory).get());
+  EXPECT_EQ(write(parallelHandler.getResult()), write(Handler.getResult()));
+}
+
+TEST_F(FriendIndexerStats, NameFilter) {
+  Tool->mapVirtualFile(FileA, R"(
+namespace a {
+class A { int x; friend void f(A &y) { y.x = 1; } };
+}
+namespace b {
+class B {
+  int x;
+  friend void f(B &y) { y.x = 1; }
+  friend void g(B &y) { y.x = 2; }
+};
+}
+    )");
+  NameFilter nameFilter;
+  std::string error;
+  ASSERT_TRUE(nameFilter.parse("^b::", "g$", error)) << error;
+  EXPECT_FALSE(nameFilter.mayContainClasses("a"));
+  EXPECT_TRUE(nameFilter.mayContainClasses("b"));
+  IndexerHandler.setNameFilter(nameFilter);
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  const Result &res = IndexerHandler.getResult();
+  ASSERT_EQ(res.FuncResults.size(), 1u);
+  const auto &funcRes = getFirstFuncResult(res);
+  EXPECT_EQ(funcRes.hostDiagName(), "b::B");
+  EXPECT_EQ(funcRes.diagName.get(), "b::g");
+}
+
+TEST_F(FriendIndexerStats, NameFilterWithAlternation) {
+  Tool->mapVirtualFile(FileA, R"(
+namespace boost {
+namespace asio { class A { int x; friend void f(A &y) { y.x = 1; } }; }
+namespace beast { class B { int x; friend void f(B &y) { y.x = 1; } }; }
+namespace core { class C { int x; friend void f(C &y) { y.x = 1; } }; }
+}
+    )");
+  NameFilter nameFilter;
+  std::string error;
+  ASSERT_TRUE(nameFilter.parse("^boost::asio::|^boost::beast::", "", error))
+      << error;
+  EXPECT_TRUE(nameFilter.mayContainClasses("boost"));
+  EXPECT_TRUE(nameFilter.mayContainClasses("boost::beast"));
+  EXPECT_FALSE(nameFilter.mayContainClasses("std"));
+
+  // An unanchored alternative can match in any namespace.
+  NameFilter unanchored;
+  ASSERT_TRUE(unanchored.parse("^boost::asio::|beast::", "", error)) << error;
+  EXPECT_TRUE(unanchored.mayContainClasses("std"));
+
+  IndexerHandler.setNameFilter(nameFilter);
+  Tool->run(newFrontendActionFactory(&IndexerFactory).get());
+  const Result &res = IndexerHandler.getResult();
+  EXPECT_EQ(res.FuncResults.size(), 2u);
+}
+
+// Compares the time of finding and handling the friend declarations with the
+// matcher and with the indexer on a large translation unit.
+// Run with --gtest_also_run_disabled_tests.
+TEST_F(FriendIndexerStats, DISABLED_BenchmarkMatcherAndIndexer) {
+  std::string code;
+  for (int i = 0; i < 2000; ++i) {
+    auto n = std::to_string(i);
+    code += "class A" + n + " { int a; friend void f" + n + "(A" + n +
+            " &x) { x.a = 1; } };\n";
+    // Lots of code without friends.
+    code += "int g" + n + "(int x) { int s = 0;";
+    for (int j = 0; j < 20; ++j) {
+      code += " if (x > " + std::to_string(j) + ") { s += x * " +
+              std::to_string(j) + " + (s ^ x); }";
+    }
+    code += " return s; }\n";
+  }
+  Tool->mapVirtualFile(FileA, code);
+
+  using Clock = std::chrono::steady_clock;
+  auto time = [this](FrontendActionFactory *factory) {
+    auto start = Clock::now();
+    Tool->run(factory);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               Clock::now() - start)
+        .count();
+  };
+  auto matcherTime = time(newFrontendActionFactory(&Finder).get());
+  auto indexerTime = time(newFrontendActionFactory(&IndexerFactory).get());
+  llvm::outs() << "matcher: " << matcherTime << " ms, indexer: "
+               << indexerTime << " ms (including parsing)\n";
+  EXPECT_EQ(write(IndexerHandler.getResult()), write(Handler.getResult()));
+}
@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/Tooling.h"
+#include "../FriendStats.hpp"
+
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace clang;
+
+namespace {
+// The members of A are used before and after the out-of-line definitions
+// of A::m and A::s. After them the uses refer to the redeclarations.
+const char *redeclaredMembersCode = R"(
+class A {
+  int x;
+  int y;
+  static int s;
+  void m();
+  void n() {}
+  friend void before(A &a);
+  friend void after(A &a);
+public:
+  int pub;
+};
+void before(A &a) { a.x = 1; a.m(); a.n(); A::s = 1; a.pub = 1; }
+int A::s = 0;
+void A::m() {}
+void after(A &a) { a.y = 1; a.m(); A::s = 2; a.pub = 2; }
+)";
+
+struct MemberIndexTest : ::testing::Test {
+  std::unique_ptr<ASTUnit> AST =
+      buildASTFromCodeWithArgs(redeclaredMembersCode, {"-std=c++14"});
+  FunctionSummaryCache summaries;
+
+  template <typename T, typename Matcher> const T *find(const Matcher &M) {
+    return selectFirst<T>("x", match(M.bind("x"), AST->getASTContext()));
+  }
+  const CXXRecordDecl *classA() {
+    return find<CXXRecordDecl>(
+        cxxRecordDecl(hasName("A"), isDefinition(), unless(isImplicit())));
+  }
+  Result::FuncResult countIn(const char *function) {
+    const CXXRecordDecl *A = classA();
+    const FunctionDecl *F =
+        find<FunctionDecl>(functionDecl(hasName(function), isDefinition()));
+    MemberIndex index{A};
+    return countUsedMembers(summaries.get(F), A, index);
+  }
+};
+} // unnamed namespace
+
+TEST_F(MemberIndexTest, IndexesTheMembersDeclaredInTheClass) {
+  ASSERT_TRUE(AST);
+  const CXXRecordDecl *A = classA();
+  ASSERT_TRUE(A);
+  MemberIndex index{A};
+  const auto *x = find<FieldDecl>(fieldDecl(hasName("x")));
+  const auto *n = find<CXXMethodDecl>(cxxMethodDecl(hasName("n")));
+  ASSERT_TRUE(x && n);
+  EXPECT_GE(index.bitOf(x), 0);
+  EXPECT_GE(index.bitOf(n), 0);
+
+  // The out-of-line definitions are redeclarations, they are not indexed.
+  const auto *mDecl = find<CXXMethodDecl>(
+      cxxMethodDecl(hasName("m"), unless(isDefinition())));
+  const auto *mDef =
+      find<CXXMethodDecl>(cxxMethodDecl(hasName("m"), isDefinition()));
+  ASSERT_TRUE(mDecl && mDef);
+  EXPECT_GE(index.bitOf(mDecl), 0);
+  EXPECT_EQ(index.bitOf(mDef), -1);
+  const auto *sDef = find<VarDecl>(varDecl(hasName("s"), isDefinition()));
+  ASSERT_TRUE(sDef);
+  EXPECT_EQ(index.bitOf(sDef), -1);
+}
+
+TEST_F(MemberIndexTest, CountsTheIndexedMembers) {
+  ASSERT_TRUE(AST);
+  auto funcRes = countIn("before");
+  // x and s, the public member is not counted.
+  EXPECT_EQ(funcRes.usedPrivateVarsCount, 2);
+  // m and n.
+  EXPECT_EQ(funcRes.usedPrivateMethodsCount, 2);
+}
+
+TEST_F(MemberIndexTest, CountsTheRedeclaredMembersOutsideOfTheIndex) {
+  ASSERT_TRUE(AST);
+  // A::m and A::s refer to their out-of-line definitions here, they are
+  // counted by the fallback for the members which are not in the index.
+  auto funcRes = countIn("after");
+  // y and s.
+  EXPECT_EQ(funcRes.usedPrivateVarsCount, 2);
+  // m.
+  EXPECT_EQ(funcRes.usedPrivateMethodsCount, 1);
+}
@@ -0,0 +1,178 @@
+#include <gtest/gtest.h>
+#include "../ResultDiff.hpp"
+
+namespace {
+ClassRegistry classes;
+
+Result::FuncResult
+makeFuncResult(int usedVars, int parentVars,
+               const std::string &diagName = "f\twith\\tab") {
+  Result::FuncResult funcRes;
+  funcRes.diagName = diagName;
+  funcRes.friendDeclLoc = Location{"a.h", 3, 5};
+  funcRes.defLoc = Location{"a.h", 10, 1};
+  funcRes.usedPrivateVarsCount = usedVars;
+  funcRes.parentPrivateVarsCount = parentVars;
+  funcRes.types.parentPrivateCount = 1;
+  funcRes.parentClassInfo = classes.get(Location{"a.h", 1, 1}, "A");
+  return funcRes;
+}
+
+// The instances are identified by their names, like in a stored result.
+void addFuncResult(Result &result, const Location &friendDeclLoc,
+                   const Result::FuncResult &funcRes) {
+  const std::uint64_t declId = friendDeclLoc.hash();
+  auto &decl = result.addFuncDecl(declId, friendDeclLoc);
+  result.addFuncResult(
+      decl, combineIds(declId, stableHash(funcRes.diagName.get())), funcRes);
+}
+
+// The instance of the friend class B of A.
+Result::ClassResult &addClassResult(Result &result,
+                                    const Location &friendDeclLoc) {
+  Result::ClassResult classResult;
+  classResult.diagName = "B";
+  classResult.defLoc = Location{"b.h", 1, 1};
+  classResult.friendDeclLoc = friendDeclLoc;
+  classResult.hostDiagName = "A";
+  auto &decl = result.addClassDecl(friendDeclLoc.hash(), friendDeclLoc);
+  return result.addClassResult(
+      decl, combineIds(friendDeclLoc.hash(), stableHash("B")), classResult);
+}
+
+Result makeResult() {
+  Result result;
+  addFuncResult(result, Location{"a.h", 3, 5}, makeFuncResult(1, 2));
+  const Location emptyDecl{"a.h", 4, 5};
+  result.addFuncDecl(emptyDecl.hash(), emptyDecl);
+  auto &classResult = addClassResult(result, Location{"a.h", 5, 5});
+  result.addMemberFuncResult(classResult, stableHash("B::g()"),
+                             makeFuncResult(0, 2, "B::g()"));
+  auto &sampledTemplate = result.sampledTemplates[Location{"c.h", 1, 1}];
+  sampledTemplate.diagName = "C";
+  sampledTemplate.numSpecializations = 10;
+  sampledTemplate.numAnalyzed = 2;
+  return result;
+}
+
+std::string write(const Result &result) {
+  std::string s;
+  llvm::raw_string_ostream os{s};
+  writeResult(os, result);
+  return os.str();
+}
+} // unnamed namespace
+
+TEST(ResultStore, RoundTrip) {
+  Result result = makeResult();
+  result.funcInstances.begin()->multiplicity = 3;
+  std::string written = write(result);
+  Result read;
+  std::string error;
+  ASSERT_TRUE(ResultReader{}.read(written, read, error)) << error;
+  EXPECT_EQ(read.friendFuncDeclCount, 2);
+  EXPECT_EQ(read.friendClassDeclCount, 1);
+  const auto &funcRes = *read.FuncResults.begin()->instances[0];
+  EXPECT_EQ(funcRes.friendDeclLoc, (Location{"a.h", 3, 5}));
+  EXPECT_EQ(funcRes.defLoc, (Location{"a.h", 10, 1}));
+  EXPECT_EQ(funcRes.diagName, "f\twith\\tab");
+  EXPECT_EQ(funcRes.usedPrivateVarsCount, 1);
+  EXPECT_EQ(funcRes.types.parentPrivateCount, 1);
+  EXPECT_FALSE(funcRes.sampled);
+  EXPECT_EQ(funcRes.multiplicity, 3);
+  ASSERT_EQ(read.sampledTemplates.size(), 1u);
+  const Location sampledLoc{"c.h", 1, 1};
+  EXPECT_EQ(read.sampledTemplates[sampledLoc].numSpecializations, 10);
+  ASSERT_TRUE(funcRes.parentClassInfo);
+  EXPECT_EQ(funcRes.parentClassInfo->diagName, "A");
+  // The same class is shared between the instances.
+  const auto &classResult = *read.ClassResults.begin()->classResults[0];
+  EXPECT_EQ(classResult.hostDiagName, "A");
+  EXPECT_EQ(funcRes.parentClassInfo,
+            classResult.memberFuncResults[0]->parentClassInfo);
+  EXPECT_EQ(write(read), written);
+}
+
+TEST(ResultStore, Malformed) {
+  Result read;
+  std::string error;
+  EXPECT_FALSE(ResultReader{}.read("something else\n", read, error));
+  EXPECT_FALSE(ResultReader{}.read(std::string(resultStoreHeader) +
+                                       "\nf\tid\tA\tf\tx\n",
+                                   read, error));
+  EXPECT_EQ(error, "malformed line 2");
+}
+
+TEST(ResultDiff, Instances) {
+  Result oldResult = makeResult();
+  Result newResult;
+  // Locations differ between versions, the instances are matched by names.
+  const Location moved{"a.h", 13, 5};
+  addFuncResult(newResult, moved, makeFuncResult(2, 2));
+  addFuncResult(newResult, moved, makeFuncResult(0, 2, "h()"));
+  addClassResult(newResult, Location{"a.h", 5, 5});
+
+  ResultDiff diff = diffResults(oldResult, newResult);
+  ASSERT_EQ(diff.funcs.added.size(), 1u);
+  EXPECT_EQ(diff.funcs.added[0].key.second, "h()");
+  EXPECT_TRUE(diff.funcs.removed.empty());
+  ASSERT_EQ(diff.funcs.changed.size(), 1u);
+  EXPECT_EQ(diff.funcs.changed[0].oldRes->usedPrivateVarsCount, 1);
+  EXPECT_EQ(diff.funcs.changed[0].newRes->usedPrivateVarsCount, 2);
+  EXPECT_TRUE(diff.classFuncs.added.empty());
+  ASSERT_EQ(diff.classFuncs.removed.size(), 1u);
+  EXPECT_EQ(diff.classFuncs.removed[0].classKey.second, "B");
+  EXPECT_TRUE(diff.classFuncs.changed.empty());
+}
+
+TEST(ResultDiff, SameNames) {
+  Result oldResult = makeResult();
+  Result newResult;
+  // The instance of the old result and a new one with the same names, in
+  // another friend declaration.
+  addFuncResult(newResult, Location{"a.h", 3, 5}, makeFuncResult(1, 2));
+  addFuncResult(newResult, Location{"a.h", 20, 5}, makeFuncResult(2, 4));
+
+  ResultDiff diff = diffResults(oldResult, newResult);
+  EXPECT_TRUE(diff.funcs.changed.empty());
+  ASSERT_EQ(diff.funcs.added.size(), 1u);
+  EXPECT_EQ(diff.funcs.added[0].newRes->usedPrivateVarsCount, 2);
+  EXPECT_TRUE(diff.funcs.removed.empty());
+
+  diff = diffResults(newResult, oldResult);
+  ASSERT_EQ(diff.funcs.removed.size(), 1u);
+  EXPECT_EQ(diff.funcs.removed[0].oldRes->parentPrivateVarsCount, 4);
+
+  // Both instances are counted, like in the statistics of the tool.
+  ResultSummary summary(newResult);
+  EXPECT_EQ(summary.func.average.num, 2);
+  summary.apply(diff);
+  EXPECT_EQ(summary.func.average.num, 1);
+}
+
+TEST(ResultSummary, ApplyDiff) {
+  Result oldResult = makeResult();
+  Result newResult;
+  const Location friendDeclLoc{"a.h", 3, 5};
+  addFuncResult(newResult, friendDeclLoc, makeFuncResult(2, 2));
+  // Collapsed entry, it is counted twice.
+  auto collapsed = makeFuncResult(0, 0, "h()");
+  collapsed.multiplicity = 2;
+  addFuncResult(newResult, friendDeclLoc, collapsed);
+  // Insane entry, it is not counted.
+  addFuncResult(newResult, friendDeclLoc, makeFuncResult(3, 2, "i()"));
+
+  ResultSummary summary(oldResult);
+  summary.apply(diffResults(oldResult, newResult));
+  ResultSummary expected(newResult);
+  EXPECT_EQ(summary.func.average.num, 3);
+  EXPECT_EQ(summary.func.average.num, expected.func.average.num);
+  EXPECT_DOUBLE_EQ(summary.func.average.get(), expected.func.average.get());
+  EXPECT_EQ(summary.func.usedPrivsDistribution.dist.get(),
+            expected.func.usedPrivsDistribution.dist.get());
+  EXPECT_EQ(nonEmptyBuckets(summary.func.percentageDist.get()),
+            nonEmptyBuckets(expected.func.percentageDist.get()));
+  EXPECT_EQ(summary.clazz.average.num, 0);
+  EXPECT_TRUE(nonEmptyBuckets(summary.clazz.percentageDist.get()).empty());
+  EXPECT_TRUE(summary.clazz.usedPrivsDistribution.dist.get().empty());
+}
@@ -0,0 +1,246 @@
+#include <gtest/gtest.h>
+#include "../StatisticsState.hpp"
+
+namespace {
+ClassRegistry classes;
+
+Result::FuncResult makeFuncResult(int usedVars, int parentVars) {
+  Result::FuncResult funcRes;
+  funcRes.friendDeclLoc = Location{"a.h", 3, 5};
+  funcRes.defLoc = Location{"a.h", 10, 1};
+  funcRes.usedPrivateVarsCount = usedVars;
+  funcRes.parentPrivateVarsCount = parentVars;
+  funcRes.parentClassInfo = classes.get(Location{"a.h", 1, 1}, "A");
+  return funcRes;
+}
+
+// Defined in the friend declaration of a class template instantiation and
+// uses no private entity.
+Result::FuncResult makeMeyersCandidate() {
+  Result::FuncResult funcRes = makeFuncResult(0, 2);
+  funcRes.defLoc = funcRes.friendDeclLoc;
+  funcRes.parentClassInfo = classes.get(Location{"b.h", 1, 1}, "B<int>");
+  return funcRes;
+}
+
+// The translation units a.cpp and b.cpp include the same header, its
+// instance 1 is contributed by both.
+Contribution contributionOfA() {
+  Contribution contribution;
+  contribution.funcs.emplace_back(1, makeFuncResult(1, 2));
+  contribution.funcs.emplace_back(2, makeMeyersCandidate());
+  contribution.classFuncs.emplace_back(3, makeFuncResult(2, 2));
+  return contribution;
+}
+
+Contribution contributionOfB() {
+  Contribution contribution;
+  contribution.funcs.emplace_back(1, makeFuncResult(1, 2));
+  // Collapsed entry, it is counted twice.
+  auto collapsed = makeFuncResult(1, 4);
+  collapsed.multiplicity = 2;
+  contribution.funcs.emplace_back(4, collapsed);
+  // Insane entry, it is not counted.
+  contribution.funcs.emplace_back(5, makeFuncResult(3, 2));
+  return contribution;
+}
+
+std::string write(const StatisticsState &state) {
+  std::string s;
+  llvm::raw_string_ostream os{s};
+  state.write(os);
+  return os.str();
+}
+
+void expectSame(const StatisticsState::Part &a,
+                const StatisticsState::Part &b) {
+  EXPECT_EQ(a.average.num, b.average.num);
+  EXPECT_EQ(a.average.numZeroDenom, b.average.numZeroDenom);
+  EXPECT_NEAR(a.average.sum, b.average.sum, 1e-9);
+  EXPECT_EQ(a.quantiles.counts, b.quantiles.counts);
+  EXPECT_EQ(a.quantiles.n, b.quantiles.n);
+  EXPECT_EQ(a.usedPrivsDistribution.dist.get(),
+            b.usedPrivsDistribution.dist.get());
+  const UsageHistogram &ha = a.percentageDist.get();
+  const UsageHistogram &hb = b.percentageDist.get();
+  ASSERT_EQ(ha.size(), hb.size());
+  for (std::size_t i = 0; i < ha.size(); ++i) {
+    EXPECT_EQ(ha.count(i), hb.count(i));
+  }
+  EXPECT_EQ(a.meyersCandidate.count, b.meyersCandidate.count);
+}
+} // unnamed namespace
+
+TEST(ExactUsageQuantiles, AddAndRemove) {
+  ExactUsageQuantiles quantiles;
+  EXPECT_TRUE(std::isnan(quantiles.get(0.5)));
+  quantiles(makeFuncResult(1, 4));
+  quantiles(makeFuncResult(1, 2), 2);
+  quantiles(makeFuncResult(2, 2));
+  EXPECT_DOUBLE_EQ(quantiles.get(0.0), 0.25);
+  EXPECT_DOUBLE_EQ(quantiles.get(0.5), 0.5);
+  EXPECT_DOUBLE_EQ(quantiles.get(0.99), 1.0);
+  quantiles.remove(makeFuncResult(2, 2));
+  quantiles.remove(makeFuncResult(1, 2));
+  EXPECT_EQ(quantiles.n, 2);
+  EXPECT_DOUBLE_EQ(quantiles.get(0.99), 0.5);
+}
+
+TEST(StatisticsState, SharedInstancesAreCountedOnce) {
+  StatisticsState state;
+  state.replace("a.cpp", contributionOfA());
+  state.replace("b.cpp", contributionOfB());
+  EXPECT_EQ(state.numUnits(), 2u);
+  // 1, 2 and 4 twice.
+  EXPECT_EQ(state.func.average.num, 4);
+  EXPECT_EQ(state.func.meyersCandidate.count, 1u);
+  EXPECT_EQ(state.clazz.average.num, 1);
+
+  // Instance 1 is still contributed by b.cpp.
+  state.replace("a.cpp", Contribution{});
+  EXPECT_EQ(state.numUnits(), 1u);
+  EXPECT_EQ(state.func.average.num, 3);
+  EXPECT_EQ(state.func.meyersCandidate.count, 0u);
+  EXPECT_EQ(state.clazz.average.num, 0);
+  state.replace("b.cpp", Contribution{});
+  expectSame(state.func, StatisticsState{}.func);
+  expectSame(state.clazz, StatisticsState{}.clazz);
+}
+
+TEST(StatisticsState, ReplaceIsTheSameAsComputingAgain) {
+  StatisticsState state;
+  state.replace("a.cpp", contributionOfA());
+  state.replace("b.cpp", contributionOfB());
+
+  // b.cpp is analyzed again: instance 4 is gone, 1 is changed, 6 is new.
+  Contribution newB;
+  newB.funcs.emplace_back(1, makeFuncResult(2, 2));
+  newB.funcs.emplace_back(6, makeFuncResult(0, 0));
+  newB.classFuncs.emplace_back(7, makeFuncResult(1, 3));
+  state.replace("b.cpp", newB);
+
+  StatisticsState expected;
+  expected.replace("b.cpp", newB);
+  Contribution newA = contributionOfA();
+  // The shared instance has the counts of its last measurement.
+  newA.funcs[0].second = makeFuncResult(2, 2);
+  expected.replace("a.cpp", newA);
+  expectSame(state.func, expected.func);
+  expectSame(state.clazz, expected.clazz);
+  EXPECT_EQ(state.func.average.num, 3);
+  EXPECT_EQ(state.func.average.numZeroDenom, 1);
+}
+
+TEST(StatisticsState, RoundTrip) {
+  StatisticsState state{5};
+  state.replace("dir/a\tb.cpp", contributionOfA());
+  state.replace("b.cpp", contributionOfB());
+  std::string written = write(state);
+
+  StatisticsState read{5};
+  std::string error;
+  ASSERT_TRUE(read.read(written, error)) << error;
+  expectSame(read.func, state.func);
+  expectSame(read.clazz, state.clazz);
+  EXPECT_EQ(read.numUnits(), 2u);
+  EXPECT_EQ(write(read), written);
+
+  // The read state is updated the same way.
+  state.replace("b.cpp", contributionOfA());
+  read.replace("b.cpp", contributionOfA());
+  EXPECT_EQ(write(read), write(state));
+}
+
+// The friend class declaration 10 is seen by both translation units, only
+// the instances of the first one are counted.
+TEST(StatisticsState, FirstSeenClassDecls) {
+  Contribution a;
+  a.funcs.emplace_back(1, makeFuncResult(1, 2));
+  a.firstSeenClassFuncs.emplace_back(10, Contribution::Instances{});
+  a.firstSeenClassFuncs.back().second.emplace_back(11, makeFuncResult(1, 2));
+  Contribution b;
+  b.firstSeenClassFuncs.emplace_back(10, Contribution::Instances{});
+  b.firstSeenClassFuncs.back().second.emplace_back(12, makeFuncResult(0, 2));
+  b.firstSeenClassFuncs.back().second.emplace_back(13, makeFuncResult(2, 2));
+  StatisticsState state;
+  state.replace("a.cpp", a);
+  state.replace("b.cpp", b);
+  EXPECT_EQ(state.clazz.average.num, 1);
+  // a.cpp keeps its place.
+  state.replace("a.cpp", a);
+  EXPECT_EQ(state.clazz.average.num, 1);
+
+  StatisticsState read;
+  std::string error;
+  ASSERT_TRUE(read.read(write(state), error)) << error;
+  EXPECT_EQ(write(read), write(state));
+
+  // The declaration is not seen by a.cpp any more.
+  Contribution newA = a;
+  newA.firstSeenClassFuncs.clear();
+  state.replace("a.cpp", newA);
+  read.replace("a.cpp", newA);
+  StatisticsState expected;
+  expected.replace("b.cpp", b);
+  expected.replace("a.cpp", newA);
+  expectSame(state.clazz, expected.clazz);
+  expectSame(read.clazz, expected.clazz);
+  EXPECT_EQ(state.clazz.average.num, 2);
+
+  // a.cpp kept its place, it is the first one again.
+  state.replace("a.cpp", a);
+  EXPECT_EQ(state.clazz.average.num, 1);
+  state.replace("b.cpp", Contribution{});
+  EXPECT_EQ(state.clazz.average.num, 1);
+  state.replace("a.cpp", Contribution{});
+  EXPECT_EQ(state.numUnits(), 0u);
+  expectSame(state.clazz, StatisticsState{}.clazz);
+}
+
+TEST(StatisticsState, Malformed) {
+  StatisticsState state;
+  std::string error;
+  EXPECT_FALSE(state.read("something else\n", error));
+  EXPECT_FALSE(state.read(std::string(statisticsStateHeader) +
+                              "\ni\tf\t1\t0\t0\n",
+                          error));
+  EXPECT_EQ(error, "malformed line 2");
+  StatisticsState other{5};
+  std::string written = write(other);
+  EXPECT_FALSE(state.read(written, error));
+  EXPECT_EQ(error,
+            "the state was written with another -percentage_bucket_width");
+}
+
+TEST(StatisticsState, Options) {
+  StatisticsState state;
+  state.setOption("only-class", "^A\t$");
+  state.setOption("max_specializations", "0");
+  state.replace("a.cpp", contributionOfA());
+  std::string written = write(state);
+
+  StatisticsState read;
+  read.setOption("only-class", "^A\t$");
+  read.setOption("max_specializations", "0");
+  std::string error;
+  ASSERT_TRUE(read.read(written, error)) << error;
+  EXPECT_EQ(write(read), written);
+
+  StatisticsState other;
+  other.setOption("only-class", "^B$");
+  other.setOption("max_specializations", "0");
+  EXPECT_FALSE(other.read(written, error));
+  EXPECT_EQ(error, "the state was written with another -only-class");
+
+  // An option which is not in the state is another option too.
+  StatisticsState more;
+  more.setOption("only-class", "^A\t$");
+  more.setOption("max_specializations", "0");
+  more.setOption("exclude-path", "");
+  EXPECT_FALSE(more.read(written, error));
+  EXPECT_EQ(error, "the state was written with another -exclude-path");
+  StatisticsState fewer;
+  fewer.setOption("only-class", "^A\t$");
+  EXPECT_FALSE(fewer.read(written, error));
+  EXPECT_EQ(error, "the state was written with another -max_specializations");
+}